@@ -0,0 +1,285 @@
+/*
+ * gdk-pixbuf-texture-tool - Manipulate texture files
+ *
+ * Copyright (C) 2011 Intel Corporation.
+ *
+ * This software is licensed under the BSD 3-Clause license. See the COPYING
+ * file for the full text of the license.
+ *
+ */
+
+#include "gdk-pixbuf-pvr-codecs.h"
+
+/*
+ * Compressed pixel types we know how to decode without going through
+ * PVRTexLib, the uncompressed ones have their own table
+ */
+static const PvrFormatInfo formats[] =
+{
+  { PVR_ETC_RGB_4BPP, 4, 4, 8,
+    PVR_ETC_MIN_TEXWIDTH, PVR_ETC_MIN_TEXHEIGHT, PVR_FORMAT_OPAQUE,
+    pvr_etc1_decode, pvr_etc1_encode },
+  { PVR_ETC2_RGB, 4, 4, 8,
+    PVR_ETC_MIN_TEXWIDTH, PVR_ETC_MIN_TEXHEIGHT, PVR_FORMAT_OPAQUE,
+    pvr_etc2_decode, pvr_etc2_encode },
+  { PVR_ETC2_RGB_A1, 4, 4, 8,
+    PVR_ETC_MIN_TEXWIDTH, PVR_ETC_MIN_TEXHEIGHT, 0,
+    pvr_etc2_a1_decode, pvr_etc2_a1_encode },
+  { PVR_ETC2_RGBA, 4, 4, 16,
+    PVR_ETC_MIN_TEXWIDTH, PVR_ETC_MIN_TEXHEIGHT, 0,
+    pvr_etc2_rgba_decode, pvr_etc2_rgba_encode },
+
+  { PVR_OGL_PVRTC2, 8, 4, 8,
+    PVR_PVRTC2_MIN_TEXWIDTH, PVR_PVRTC2_MIN_TEXHEIGHT, PVR_FORMAT_TWIDDLED,
+    pvr_pvrtc2_decode },
+  { PVR_MGLPT_PVRTC2, 8, 4, 8,
+    PVR_PVRTC2_MIN_TEXWIDTH, PVR_PVRTC2_MIN_TEXHEIGHT, PVR_FORMAT_TWIDDLED,
+    pvr_pvrtc2_decode },
+  { PVR_OGL_PVRTC4, 4, 4, 8,
+    PVR_PVRTC4_MIN_TEXWIDTH, PVR_PVRTC4_MIN_TEXHEIGHT, PVR_FORMAT_TWIDDLED,
+    pvr_pvrtc4_decode },
+  { PVR_MGLPT_PVRTC4, 4, 4, 8,
+    PVR_PVRTC4_MIN_TEXWIDTH, PVR_PVRTC4_MIN_TEXHEIGHT, PVR_FORMAT_TWIDDLED,
+    pvr_pvrtc4_decode },
+  { PVR_PVRTC2_SRGB, 8, 4, 8,
+    PVR_PVRTC2_MIN_TEXWIDTH, PVR_PVRTC2_MIN_TEXHEIGHT,
+    PVR_FORMAT_TWIDDLED | PVR_FORMAT_SRGB,
+    pvr_pvrtc2_decode },
+  { PVR_PVRTC4_SRGB, 4, 4, 8,
+    PVR_PVRTC4_MIN_TEXWIDTH, PVR_PVRTC4_MIN_TEXHEIGHT,
+    PVR_FORMAT_TWIDDLED | PVR_FORMAT_SRGB,
+    pvr_pvrtc4_decode },
+
+  { PVR_D3D_DXT1, 4, 4, 8,
+    PVR_DXT_MIN_TEXWIDTH, PVR_DXT_MIN_TEXHEIGHT, 0,
+    pvr_bc1_decode },
+  { PVR_D3D_DXT2, 4, 4, 16,
+    PVR_DXT_MIN_TEXWIDTH, PVR_DXT_MIN_TEXHEIGHT, 0,
+    pvr_dxt2_decode },
+  { PVR_D3D_DXT3, 4, 4, 16,
+    PVR_DXT_MIN_TEXWIDTH, PVR_DXT_MIN_TEXHEIGHT, 0,
+    pvr_bc2_decode },
+  { PVR_D3D_DXT4, 4, 4, 16,
+    PVR_DXT_MIN_TEXWIDTH, PVR_DXT_MIN_TEXHEIGHT, 0,
+    pvr_dxt4_decode },
+  { PVR_D3D_DXT5, 4, 4, 16,
+    PVR_DXT_MIN_TEXWIDTH, PVR_DXT_MIN_TEXHEIGHT, 0,
+    pvr_bc3_decode },
+
+  { PVR_DX10_BC1_UNORM, 4, 4, 8,
+    PVR_DXT_MIN_TEXWIDTH, PVR_DXT_MIN_TEXHEIGHT, 0,
+    pvr_bc1_decode },
+  { PVR_DX10_BC1_UNORM_SRGB, 4, 4, 8,
+    PVR_DXT_MIN_TEXWIDTH, PVR_DXT_MIN_TEXHEIGHT, PVR_FORMAT_SRGB,
+    pvr_bc1_decode },
+  { PVR_DX10_BC2_UNORM, 4, 4, 16,
+    PVR_DXT_MIN_TEXWIDTH, PVR_DXT_MIN_TEXHEIGHT, 0,
+    pvr_bc2_decode },
+  { PVR_DX10_BC2_UNORM_SRGB, 4, 4, 16,
+    PVR_DXT_MIN_TEXWIDTH, PVR_DXT_MIN_TEXHEIGHT, PVR_FORMAT_SRGB,
+    pvr_bc2_decode },
+  { PVR_DX10_BC3_UNORM, 4, 4, 16,
+    PVR_DXT_MIN_TEXWIDTH, PVR_DXT_MIN_TEXHEIGHT, 0,
+    pvr_bc3_decode },
+  { PVR_DX10_BC3_UNORM_SRGB, 4, 4, 16,
+    PVR_DXT_MIN_TEXWIDTH, PVR_DXT_MIN_TEXHEIGHT, PVR_FORMAT_SRGB,
+    pvr_bc3_decode },
+};
+
+const PvrFormatInfo *
+pvr_format_info_lookup (PVRPixelType pixel_type)
+{
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (formats); i++)
+    {
+      if (formats[i].pixel_type == pixel_type)
+        return &formats[i];
+    }
+
+  for (i = 0; i < pvr_unpack_n_formats; i++)
+    {
+      if (pvr_unpack_formats[i].pixel_type == pixel_type)
+        return &pvr_unpack_formats[i];
+    }
+
+  return NULL;
+}
+
+guint
+pvr_format_info_get_n_rows (const PvrFormatInfo *info,
+                            guint                height)
+{
+  return (height + info->block_height - 1) / info->block_height;
+}
+
+gsize
+pvr_format_info_get_level_size (const PvrFormatInfo *info,
+                                guint                width,
+                                guint                height)
+{
+  gsize blocks_x, blocks_y;
+
+  width = MAX (width, info->min_width);
+  height = MAX (height, info->min_height);
+
+  blocks_x = (width + info->block_width - 1) / info->block_width;
+  blocks_y = pvr_format_info_get_n_rows (info, height);
+
+  return blocks_x * blocks_y * info->block_size;
+}
+
+static inline guint64
+rotl64 (guint64 x,
+        guint   r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline guint64
+hash_mix (guint64 h,
+          guint64 k)
+{
+  k *= G_GUINT64_CONSTANT (0x87c37b91114253d5);
+  k = rotl64 (k, 31);
+  k *= G_GUINT64_CONSTANT (0x4cf5ad432745937f);
+
+  h ^= k;
+  h = rotl64 (h, 27);
+
+  return h * 5 + 0x52dce729;
+}
+
+guint64
+pvr_hash_bytes (guint64       h,
+                const guchar *data,
+                gsize         size)
+{
+  guint64 k;
+
+  for (; size >= 8; size -= 8, data += 8)
+    {
+      memcpy (&k, data, 8);
+      h = hash_mix (h, k);
+    }
+
+  if (size)
+    {
+      k = 0;
+      memcpy (&k, data, size);
+      h = hash_mix (h, k);
+    }
+
+  return h;
+}
+
+/*
+ * The encoders are slow enough that it is worth spreading the rows of blocks
+ * over a few threads. Each job is a band of consecutive rows of one level so
+ * the threads don't write to the same cache lines. Jobs are queued from level
+ * 0 down, the bands of the small levels of a mipmap chain being the shortest
+ * they come last and fill in the time the threads would otherwise spend
+ * waiting for the last bands of the bigger ones.
+ */
+
+#define ROWS_PER_JOB 4
+
+typedef struct
+{
+  const PvrSurface *image;
+  guchar *data;
+  const guint8 *dirty;
+  guint first_row;
+  guint n_rows;
+} EncodeJob;
+
+typedef struct
+{
+  const PvrFormatInfo *info;
+  PvrQuality quality;
+} EncodeContext;
+
+static void
+encode_band (gpointer data,
+             gpointer user_data)
+{
+  EncodeContext *context = (EncodeContext *) user_data;
+  EncodeJob *job = (EncodeJob *) data;
+
+  context->info->encode (job->image, job->data, job->first_row, job->n_rows,
+                         job->dirty, context->quality);
+}
+
+void
+pvr_format_info_encode_levels (const PvrFormatInfo *info,
+                               const PvrSurface    *levels,
+                               guint                n_levels,
+                               guchar              *data,
+                               guint8             **dirty,
+                               PvrQuality           quality,
+                               guint                n_threads)
+{
+  EncodeContext context;
+  EncodeJob *jobs;
+  GThreadPool *pool = NULL;
+  guint n_jobs, i, j, row, n_rows;
+
+  n_jobs = 0;
+  for (i = 0; i < n_levels; i++)
+    {
+      n_rows = pvr_format_info_get_n_rows (info, levels[i].height);
+      n_jobs += (n_rows + ROWS_PER_JOB - 1) / ROWS_PER_JOB;
+    }
+
+  if (n_threads == 0)
+    n_threads = g_get_num_processors ();
+  n_threads = MIN (n_threads, n_jobs);
+
+  jobs = g_new (EncodeJob, n_jobs);
+  for (i = 0, j = 0; i < n_levels; i++)
+    {
+      n_rows = pvr_format_info_get_n_rows (info, levels[i].height);
+
+      for (row = 0; row < n_rows; row += ROWS_PER_JOB, j++)
+        {
+          jobs[j].image = &levels[i];
+          jobs[j].data = data;
+          jobs[j].dirty = dirty ? dirty[i] : NULL;
+          jobs[j].first_row = row;
+          jobs[j].n_rows = MIN (ROWS_PER_JOB, n_rows - row);
+        }
+
+      data += pvr_format_info_get_level_size (info, levels[i].width,
+                                              levels[i].height);
+    }
+
+  context.info = info;
+  context.quality = quality;
+
+  if (n_threads > 1)
+    pool = g_thread_pool_new (encode_band, &context, n_threads, TRUE, NULL);
+
+  for (j = 0; j < n_jobs; j++)
+    {
+      if (pool)
+        g_thread_pool_push (pool, &jobs[j], NULL);
+      else
+        encode_band (&jobs[j], &context);
+    }
+
+  if (pool)
+    g_thread_pool_free (pool, FALSE, TRUE);
+
+  g_free (jobs);
+}
+
+void
+pvr_format_info_encode (const PvrFormatInfo *info,
+                        const PvrSurface    *image,
+                        guchar              *data,
+                        PvrQuality           quality,
+                        guint                n_threads)
+{
+  pvr_format_info_encode_levels (info, image, 1, data, NULL, quality,
+                                 n_threads);
+}
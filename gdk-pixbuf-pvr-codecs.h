@@ -0,0 +1,427 @@
+/*
+ * gdk-pixbuf-texture-tool - Manipulate texture files
+ *
+ * Copyright (C) 2011 Intel Corporation.
+ *
+ * This software is licensed under the BSD 3-Clause license. See the COPYING
+ * file for the full text of the license.
+ *
+ */
+
+#ifndef __GDK_PIXBUF_PVR_CODECS_H__
+#define __GDK_PIXBUF_PVR_CODECS_H__
+
+#include <string.h>
+
+#include <glib.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "gdk-pixbuf-pvr.h"
+
+G_BEGIN_DECLS
+
+/*
+ * The native decoders write 8 bits per channel RGBA pixels directly into the
+ * memory of the GdkPixbuf handed back to the user, there is no intermediate
+ * image. Formats flagged PVR_FORMAT_OPAQUE are decoded to RGB instead.
+ *
+ * rowstride can be negative, pixels then points to the last row in memory.
+ * This is how vertically flipped textures are decoded straight to their
+ * final position.
+ *
+ * When the layout is PVR_SURFACE_BGRA_PREMULTIPLIED, the decoders write
+ * premultiplied BGRA pixels instead, always with 4 channels. That's the byte
+ * order of CAIRO_FORMAT_ARGB32 on little endian machines and the conversion
+ * is done on each block or row as it is stored, while it is still in cache.
+ * Encoders only take PVR_SURFACE_RGBA surfaces.
+ */
+typedef enum
+{
+  PVR_SURFACE_RGBA,
+  PVR_SURFACE_BGRA_PREMULTIPLIED,
+} PvrSurfaceLayout;
+
+typedef struct
+{
+  guchar          *pixels;
+  gint             rowstride;
+  guint            width;
+  guint            height;
+  guint            n_channels;
+  PvrSurfaceLayout layout;
+} PvrSurface;
+
+/* make row 0 of surface the last one in memory, and the other way around */
+static inline void
+pvr_surface_flip (PvrSurface *surface)
+{
+  surface->pixels += (gssize) (surface->height - 1) * surface->rowstride;
+  surface->rowstride = -surface->rowstride;
+}
+
+/*
+ * Decode n_rows rows of blocks, starting at first_row. data always points to
+ * the start of the level being decoded.
+ */
+typedef void (*PvrDecodeFunc) (const guchar     *data,
+                               const PvrSurface *surface,
+                               guint             first_row,
+                               guint             n_rows);
+
+typedef enum
+{
+  PVR_QUALITY_FAST,
+  PVR_QUALITY_NORMAL,
+  PVR_QUALITY_EXHAUSTIVE,
+} PvrQuality;
+
+/*
+ * Encode n_rows rows of blocks of image, starting at first_row. data always
+ * points to the start of the level being encoded. If dirty is not NULL, it has
+ * one byte per block of the level and only the blocks with a non-zero byte are
+ * encoded, the others are left untouched in data.
+ */
+typedef void (*PvrEncodeFunc) (const PvrSurface *image,
+                               guchar           *data,
+                               guint             first_row,
+                               guint             n_rows,
+                               const guint8     *dirty,
+                               PvrQuality        quality);
+
+typedef enum
+{
+  /* blocks are stored in Morton order, dimensions must be powers of 2 */
+  PVR_FORMAT_TWIDDLED = 1 << 0,
+  /* colours are sRGB encoded */
+  PVR_FORMAT_SRGB     = 1 << 1,
+  /* colours are explicitly linear */
+  PVR_FORMAT_LINEAR   = 1 << 2,
+  /* no alpha channel, decoded to RGB */
+  PVR_FORMAT_OPAQUE   = 1 << 3,
+  /* stored exactly like the pixels of a GdkPixbuf, usable in place */
+  PVR_FORMAT_PIXBUF_LAYOUT = 1 << 4,
+} PvrFormatFlags;
+
+typedef struct
+{
+  PVRPixelType  pixel_type;
+  guint         block_width;
+  guint         block_height;
+  guint         block_size;           /* in bytes */
+  guint         min_width;            /* levels are padded to that size */
+  guint         min_height;
+  guint         flags;
+  PvrDecodeFunc decode;
+  PvrEncodeFunc encode;               /* NULL if we can't encode natively */
+} PvrFormatInfo;
+
+const PvrFormatInfo *pvr_format_info_lookup (PVRPixelType pixel_type);
+
+/* uncompressed pixel types, see gdk-pixbuf-pvr-unpack.cc */
+extern const PvrFormatInfo pvr_unpack_formats[];
+extern const guint pvr_unpack_n_formats;
+
+guchar *pvr_unpack_untwiddle (const PvrFormatInfo *info,
+                              const guchar        *data,
+                              guint                width,
+                              guint                height);
+
+/*
+ * 64 bits MurmurHash3 style hash of size bytes, 8 at a time, continuing from
+ * h. It is not meant to resist someone crafting collisions.
+ */
+guint64 pvr_hash_bytes (guint64       h,
+                        const guchar *data,
+                        gsize         size);
+
+gsize pvr_format_info_get_level_size (const PvrFormatInfo *info,
+                                      guint                width,
+                                      guint                height);
+guint pvr_format_info_get_n_rows     (const PvrFormatInfo *info,
+                                      guint                height);
+
+void  pvr_format_info_encode         (const PvrFormatInfo *info,
+                                      const PvrSurface    *image,
+                                      guchar              *data,
+                                      PvrQuality           quality,
+                                      guint                n_threads);
+
+/*
+ * levels are stored one after the other in data, in the PVR file layout.
+ * dirty is either NULL or has one block mask per level, see PvrEncodeFunc.
+ */
+void  pvr_format_info_encode_levels  (const PvrFormatInfo *info,
+                                      const PvrSurface    *levels,
+                                      guint                n_levels,
+                                      guchar              *data,
+                                      guint8             **dirty,
+                                      PvrQuality           quality,
+                                      guint                n_threads);
+
+void pvr_etc1_decode (const guchar     *data,
+                      const PvrSurface *surface,
+                      guint             first_row,
+                      guint             n_rows);
+void pvr_etc1_encode (const PvrSurface *image,
+                      guchar           *data,
+                      guint             first_row,
+                      guint             n_rows,
+                      const guint8     *dirty,
+                      PvrQuality        quality);
+
+void pvr_etc2_decode      (const guchar     *data,
+                           const PvrSurface *surface,
+                           guint             first_row,
+                           guint             n_rows);
+void pvr_etc2_a1_decode   (const guchar     *data,
+                           const PvrSurface *surface,
+                           guint             first_row,
+                           guint             n_rows);
+void pvr_etc2_rgba_decode (const guchar     *data,
+                           const PvrSurface *surface,
+                           guint             first_row,
+                           guint             n_rows);
+void pvr_etc2_encode      (const PvrSurface *image,
+                           guchar           *data,
+                           guint             first_row,
+                           guint             n_rows,
+                           const guint8     *dirty,
+                           PvrQuality        quality);
+void pvr_etc2_a1_encode   (const PvrSurface *image,
+                           guchar           *data,
+                           guint             first_row,
+                           guint             n_rows,
+                           const guint8     *dirty,
+                           PvrQuality        quality);
+void pvr_etc2_rgba_encode (const PvrSurface *image,
+                           guchar           *data,
+                           guint             first_row,
+                           guint             n_rows,
+                           const guint8     *dirty,
+                           PvrQuality        quality);
+
+void pvr_pvrtc2_decode (const guchar     *data,
+                        const PvrSurface *surface,
+                        guint             first_row,
+                        guint             n_rows);
+void pvr_pvrtc4_decode (const guchar     *data,
+                        const PvrSurface *surface,
+                        guint             first_row,
+                        guint             n_rows);
+
+void pvr_bc1_decode  (const guchar     *data,
+                      const PvrSurface *surface,
+                      guint             first_row,
+                      guint             n_rows);
+void pvr_bc2_decode  (const guchar     *data,
+                      const PvrSurface *surface,
+                      guint             first_row,
+                      guint             n_rows);
+void pvr_bc3_decode  (const guchar     *data,
+                      const PvrSurface *surface,
+                      guint             first_row,
+                      guint             n_rows);
+void pvr_dxt2_decode (const guchar     *data,
+                      const PvrSurface *surface,
+                      guint             first_row,
+                      guint             n_rows);
+void pvr_dxt4_decode (const guchar     *data,
+                      const PvrSurface *surface,
+                      guint             first_row,
+                      guint             n_rows);
+
+/* mipmap chains, see gdk-pixbuf-pvr-mipmap.cc */
+guint pvr_mipmap_get_n_levels   (guint       width,
+                                 guint       height);
+gsize pvr_mipmap_chain_layout   (PvrSurface *levels,
+                                 guint       n_levels,
+                                 guchar     *pixels);
+void  pvr_mipmap_chain_generate (PvrSurface *levels,
+                                 guint       n_levels);
+
+#ifdef __SSE2__
+/* 2 RGBA pixels with 16 bits per channel, see pvr_premultiply_bgra() */
+static inline __m128i
+pvr_premultiply_bgra_epi16 (__m128i pixels)
+{
+  __m128i alpha, t;
+
+  /* alpha times itself would not be alpha, use 255 in its lane */
+  alpha = _mm_shufflelo_epi16 (pixels, _MM_SHUFFLE (3, 3, 3, 3));
+  alpha = _mm_shufflehi_epi16 (alpha, _MM_SHUFFLE (3, 3, 3, 3));
+  alpha = _mm_or_si128 (_mm_and_si128 (alpha,
+                                       _mm_set_epi16 (0, -1, -1, -1,
+                                                      0, -1, -1, -1)),
+                        _mm_set_epi16 (255, 0, 0, 0, 255, 0, 0, 0));
+
+  pixels = _mm_shufflelo_epi16 (pixels, _MM_SHUFFLE (3, 0, 1, 2));
+  pixels = _mm_shufflehi_epi16 (pixels, _MM_SHUFFLE (3, 0, 1, 2));
+
+  t = _mm_add_epi16 (_mm_mullo_epi16 (pixels, alpha), _mm_set1_epi16 (128));
+
+  return _mm_srli_epi16 (_mm_add_epi16 (t, _mm_srli_epi16 (t, 8)), 8);
+}
+#endif
+
+/*
+ * Convert n_pixels RGBA pixels to premultiplied BGRA, src and dest can be the
+ * same. (t + (t >> 8)) >> 8 is an exact rounded division by 255, like Cairo
+ * and pixman do it.
+ */
+static inline void
+pvr_premultiply_bgra (const guint8 *src,
+                      guint8       *dest,
+                      guint         n_pixels)
+{
+  guint i = 0;
+
+#ifdef __SSE2__
+  for (; i + 4 <= n_pixels; i += 4, src += 16, dest += 16)
+    {
+      const __m128i zero = _mm_setzero_si128 ();
+      __m128i pixels, lo, hi;
+
+      pixels = _mm_loadu_si128 ((const __m128i *) src);
+      lo = pvr_premultiply_bgra_epi16 (_mm_unpacklo_epi8 (pixels, zero));
+      hi = pvr_premultiply_bgra_epi16 (_mm_unpackhi_epi8 (pixels, zero));
+      _mm_storeu_si128 ((__m128i *) dest, _mm_packus_epi16 (lo, hi));
+    }
+#endif
+
+  for (; i < n_pixels; i++, src += 4, dest += 4)
+    {
+      guint r, g, b, a, t;
+
+      r = src[0];
+      g = src[1];
+      b = src[2];
+      a = src[3];
+
+      t = b * a + 128;
+      dest[0] = (t + (t >> 8)) >> 8;
+      t = g * a + 128;
+      dest[1] = (t + (t >> 8)) >> 8;
+      t = r * a + 128;
+      dest[2] = (t + (t >> 8)) >> 8;
+      dest[3] = a;
+    }
+}
+
+/*
+ * Drop the alpha byte of n_pixels RGBA pixels, src and dest can be the same.
+ * With SSE2 each 4 pixels are stored with 16 bytes writes of which only the
+ * first 12 are kept, hence the 2 pixels of margin before the end of the row.
+ */
+static inline void
+pvr_rgba_to_rgb (const guint8 *src,
+                 guint8       *dest,
+                 guint         n_pixels)
+{
+  guint i = 0;
+
+#ifdef __SSE2__
+  for (; i + 6 <= n_pixels; i += 4, src += 16, dest += 12)
+    {
+      const __m128i low_pixel = _mm_set_epi32 (0, -1, 0, -1);
+      const __m128i low_bytes = _mm_set_epi32 (0, 0, 0xffff, -1);
+      __m128i pixels, pairs;
+
+      pixels = _mm_and_si128 (_mm_loadu_si128 ((const __m128i *) src),
+                              _mm_set1_epi32 (0x00ffffff));
+
+      /* 2 RGB pixels in the 6 low bytes of each 64 bits half... */
+      pairs = _mm_or_si128 (_mm_and_si128 (pixels, low_pixel),
+                            _mm_slli_epi64 (_mm_srli_epi64 (pixels, 32), 24));
+
+      /* ...then the high half moved down right after the low one */
+      pairs = _mm_or_si128 (_mm_and_si128 (pairs, low_bytes),
+                            _mm_andnot_si128 (low_bytes,
+                                              _mm_srli_si128 (pairs, 2)));
+
+      _mm_storeu_si128 ((__m128i *) dest, pairs);
+    }
+#endif
+
+  for (; i < n_pixels; i++, src += 4, dest += 3)
+    {
+      dest[0] = src[0];
+      dest[1] = src[1];
+      dest[2] = src[2];
+    }
+}
+
+/*
+ * Called by the decoders that write whole RGBA rows of pixels, once the row
+ * at dest is complete.
+ */
+static inline void
+pvr_surface_finish_row (const PvrSurface *surface,
+                        guchar           *dest)
+{
+  if (surface->layout == PVR_SURFACE_BGRA_PREMULTIPLIED)
+    pvr_premultiply_bgra (dest, dest, surface->width);
+}
+
+/*
+ * Write a decoded 4x4 block of RGBA pixels at (x, y), clipping what falls
+ * outside of the surface. Alpha is dropped for RGB surfaces.
+ */
+static inline void
+pvr_surface_store_4x4 (const PvrSurface *surface,
+                       guint             x,
+                       guint             y,
+                       const guint8     *block)
+{
+  guint8 converted[64];
+  guchar *dest;
+  guint width, height, i;
+
+  dest = surface->pixels + (gssize) y * surface->rowstride +
+         x * surface->n_channels;
+  width = MIN (4, surface->width - x);
+  height = MIN (4, surface->height - y);
+
+  if (surface->layout == PVR_SURFACE_BGRA_PREMULTIPLIED)
+    {
+      pvr_premultiply_bgra (block, converted, 16);
+      block = converted;
+    }
+  else if (surface->n_channels == 3)
+    {
+      for (i = 0; i < height; i++)
+        {
+          pvr_rgba_to_rgb (block, dest, width);
+          block += 16;
+          dest += surface->rowstride;
+        }
+      return;
+    }
+
+#ifdef __SSE2__
+  if (G_LIKELY (width == 4))
+    {
+      for (i = 0; i < height; i++)
+        {
+          _mm_storeu_si128 ((__m128i *) dest,
+                            _mm_loadu_si128 ((const __m128i *) block));
+          block += 16;
+          dest += surface->rowstride;
+        }
+      return;
+    }
+#endif
+
+  for (i = 0; i < height; i++)
+    {
+      memcpy (dest, block, width * 4);
+      block += 16;
+      dest += surface->rowstride;
+    }
+}
+
+G_END_DECLS
+
+#endif /* __GDK_PIXBUF_PVR_CODECS_H__ */
@@ -0,0 +1,1239 @@
+/*
+ * gdk-pixbuf-texture-tool - Manipulate texture files
+ *
+ * Copyright (C) 2011 Intel Corporation.
+ *
+ * This software is licensed under the BSD 3-Clause license. See the COPYING
+ * file for the full text of the license.
+ *
+ */
+
+/*
+ * ETC1 block decoder, see the OES_compressed_ETC1_RGB8_texture extension for
+ * the description of the format. A block is a big endian 64 bits word:
+ *
+ *   63..32  base colours, table indexes, diff and flip bits
+ *   31..16  most significant bit of the pixel indexes
+ *   15..0   least significant bit of the pixel indexes
+ *
+ * with pixel indexes stored column by column.
+ *
+ * ETC2 (appendix C.1 of the OpenGL ES 3.0 specification) reuses the
+ * differential blocks whose second base colour overflows: on red they are T
+ * blocks, on green H blocks and on blue planar blocks. Punch-through blocks
+ * have no individual mode, the diff bit says whether the block is opaque and
+ * when it is not, pixel index 2 is transparent. RGBA blocks are an EAC alpha
+ * block followed by an ETC2 colour block.
+ */
+
+#include "gdk-pixbuf-pvr-codecs.h"
+
+typedef enum
+{
+  ETC_ETC2         = 1 << 0,    /* T, H and planar blocks */
+  ETC_PUNCHTHROUGH = 1 << 1,    /* 1 bit alpha, no individual mode */
+  ETC_EAC          = 1 << 2,    /* preceded by an EAC alpha block */
+} EtcFlags;
+
+/* modifiers for pixel indexes 0 (msb = 0, lsb = 0) to 3 (msb = 1, lsb = 1) */
+static const gint etc1_modifiers[8][4] =
+{
+  {  2,   8,   -2,   -8 },
+  {  5,  17,   -5,  -17 },
+  {  9,  29,   -9,  -29 },
+  { 13,  42,  -13,  -42 },
+  { 18,  60,  -18,  -60 },
+  { 24,  80,  -24,  -80 },
+  { 33, 106,  -33, -106 },
+  { 47, 183,  -47, -183 }
+};
+
+/* distances between the paint colours of T and H blocks */
+static const gint etc2_distances[8] = { 3, 6, 11, 16, 23, 32, 41, 64 };
+
+/* alpha modifiers for pixel indexes 0 to 7 */
+static const gint eac_modifiers[16][8] =
+{
+  { -3, -6,  -9, -15, 2, 5, 8, 14 },
+  { -3, -7, -10, -13, 2, 6, 9, 12 },
+  { -2, -5,  -8, -13, 1, 4, 7, 12 },
+  { -2, -4,  -6, -13, 1, 3, 5, 12 },
+  { -3, -6,  -8, -12, 2, 5, 7, 11 },
+  { -3, -7,  -9, -11, 2, 6, 8, 10 },
+  { -4, -7,  -8, -11, 3, 6, 7, 10 },
+  { -3, -5,  -8, -11, 2, 4, 7, 10 },
+  { -2, -6,  -8, -10, 1, 5, 7,  9 },
+  { -2, -5,  -8, -10, 1, 4, 7,  9 },
+  { -2, -4,  -8, -10, 1, 3, 7,  9 },
+  { -2, -5,  -7, -10, 1, 4, 6,  9 },
+  { -3, -4,  -7, -10, 2, 3, 6,  9 },
+  { -1, -2,  -3, -10, 0, 1, 2,  9 },
+  { -4, -6,  -8,  -9, 3, 5, 7,  8 },
+  { -3, -5,  -7,  -9, 2, 4, 6,  8 }
+};
+
+static inline guint8
+extend_4to8 (guint x)
+{
+  return (x << 4) | x;
+}
+
+static inline guint8
+extend_5to8 (guint x)
+{
+  return (x << 3) | (x >> 2);
+}
+
+static inline guint8
+extend_6to8 (guint x)
+{
+  return (x << 2) | (x >> 4);
+}
+
+static inline guint8
+extend_7to8 (guint x)
+{
+  return (x << 1) | (x >> 6);
+}
+
+static inline guint64
+etc_load (const guint8 *data)
+{
+  guint64 word = 0;
+  guint i;
+
+  for (i = 0; i < 8; i++)
+    word = word << 8 | data[i];
+
+  return word;
+}
+
+/* the n bits of word ending with bit msb */
+static inline guint
+etc_bits (guint64 word,
+          guint   msb,
+          guint   n)
+{
+  return (word >> (msb + 1 - n)) & ((1u << n) - 1);
+}
+
+/*
+ * Compute the 4 RGBA colours a subblock can reference from its base colour
+ * and modifier table
+ */
+#ifdef __SSE2__
+
+static void
+etc1_build_palette (const guint8 *base,
+                    guint         table,
+                    guint8       *palette)
+{
+  const gint *m = etc1_modifiers[table];
+  __m128i rgb, lo, hi;
+
+  rgb = _mm_set_epi16 (0, base[2], base[1], base[0],
+                       0, base[2], base[1], base[0]);
+  lo = _mm_add_epi16 (rgb, _mm_set_epi16 (0, m[1], m[1], m[1],
+                                          0, m[0], m[0], m[0]));
+  hi = _mm_add_epi16 (rgb, _mm_set_epi16 (0, m[3], m[3], m[3],
+                                          0, m[2], m[2], m[2]));
+
+  /* packus does the clamping to [0,255] for us */
+  _mm_storeu_si128 ((__m128i *) palette,
+                    _mm_or_si128 (_mm_packus_epi16 (lo, hi),
+                                  _mm_set1_epi32 (0xff000000)));
+}
+
+#else
+
+static void
+etc1_build_palette (const guint8 *base,
+                    guint         table,
+                    guint8       *palette)
+{
+  guint i, c;
+
+  for (i = 0; i < 4; i++)
+    {
+      for (c = 0; c < 3; c++)
+        palette[i * 4 + c] = CLAMP (base[c] + etc1_modifiers[table][i],
+                                    0, 255);
+      palette[i * 4 + 3] = 0xff;
+    }
+}
+
+#endif
+
+/* non opaque punch-through blocks have no small modifiers, and pixel index 2
+ * is transparent black */
+static void
+etc2_punch_palette (const guint8 *base,
+                    guint8       *palette)
+{
+  memcpy (palette, base, 3);
+  memset (palette + 8, 0, 4);
+}
+
+/* a T or H paint colour, colour + distance clamped */
+static void
+etc2_paint (const guint8 *colour,
+            gint          distance,
+            guint8       *paint)
+{
+  guint c;
+
+  for (c = 0; c < 3; c++)
+    paint[c] = CLAMP (colour[c] + distance, 0, 255);
+  paint[3] = 0xff;
+}
+
+static void
+etc2_build_t_palette (guint64  word,
+                      guint8  *palette)
+{
+  guint8 c1[3], c2[3];
+  gint d;
+
+  c1[0] = extend_4to8 (etc_bits (word, 60, 2) << 2 | etc_bits (word, 57, 2));
+  c1[1] = extend_4to8 (etc_bits (word, 55, 4));
+  c1[2] = extend_4to8 (etc_bits (word, 51, 4));
+  c2[0] = extend_4to8 (etc_bits (word, 47, 4));
+  c2[1] = extend_4to8 (etc_bits (word, 43, 4));
+  c2[2] = extend_4to8 (etc_bits (word, 39, 4));
+  d = etc2_distances[etc_bits (word, 35, 2) << 1 | etc_bits (word, 32, 1)];
+
+  etc2_paint (c1, 0, palette);
+  etc2_paint (c2, d, palette + 4);
+  etc2_paint (c2, 0, palette + 8);
+  etc2_paint (c2, -d, palette + 12);
+}
+
+static void
+etc2_build_h_palette (guint64  word,
+                      guint8  *palette)
+{
+  guint r1, g1, b1, r2, g2, b2;
+  guint8 c1[3], c2[3];
+  gint d;
+
+  r1 = etc_bits (word, 62, 4);
+  g1 = etc_bits (word, 58, 3) << 1 | etc_bits (word, 52, 1);
+  b1 = etc_bits (word, 51, 1) << 3 | etc_bits (word, 49, 3);
+  r2 = etc_bits (word, 46, 4);
+  g2 = etc_bits (word, 42, 4);
+  b2 = etc_bits (word, 38, 4);
+
+  /* the order of the base colours is the lsb of the distance index */
+  d = etc2_distances[etc_bits (word, 34, 1) << 2 |
+                     etc_bits (word, 32, 1) << 1 |
+                     ((r1 << 8 | g1 << 4 | b1) >= (r2 << 8 | g2 << 4 | b2))];
+
+  c1[0] = extend_4to8 (r1);
+  c1[1] = extend_4to8 (g1);
+  c1[2] = extend_4to8 (b1);
+  c2[0] = extend_4to8 (r2);
+  c2[1] = extend_4to8 (g2);
+  c2[2] = extend_4to8 (b2);
+
+  etc2_paint (c1, d, palette);
+  etc2_paint (c1, -d, palette + 4);
+  etc2_paint (c2, d, palette + 8);
+  etc2_paint (c2, -d, palette + 12);
+}
+
+/* the colour at (x, y) of a planar block, from the colours at (0, 0),
+ * (4, 0) and (0, 4) */
+static inline guint8
+etc2_planar_value (gint  o,
+                   gint  h,
+                   gint  v,
+                   guint x,
+                   guint y)
+{
+  gint value;
+
+  value = ((gint) x * (h - o) + (gint) y * (v - o) + 4 * o + 2) >> 2;
+
+  return CLAMP (value, 0, 255);
+}
+
+static void
+etc2_decode_planar (guint64  word,
+                    guint8  *block)
+{
+  guint8 o[3], h[3], v[3];
+  guint x, y, c;
+
+  o[0] = extend_6to8 (etc_bits (word, 62, 6));
+  o[1] = extend_7to8 (etc_bits (word, 56, 1) << 6 | etc_bits (word, 54, 6));
+  o[2] = extend_6to8 (etc_bits (word, 48, 1) << 5 |
+                      etc_bits (word, 44, 2) << 3 | etc_bits (word, 41, 3));
+  h[0] = extend_6to8 (etc_bits (word, 38, 5) << 1 | etc_bits (word, 32, 1));
+  h[1] = extend_7to8 (etc_bits (word, 31, 7));
+  h[2] = extend_6to8 (etc_bits (word, 24, 6));
+  v[0] = extend_6to8 (etc_bits (word, 18, 6));
+  v[1] = extend_7to8 (etc_bits (word, 12, 7));
+  v[2] = extend_6to8 (etc_bits (word, 5, 6));
+
+  for (y = 0; y < 4; y++)
+    {
+      for (x = 0; x < 4; x++, block += 4)
+        {
+          for (c = 0; c < 3; c++)
+            block[c] = etc2_planar_value (o[c], h[c], v[c], x, y);
+          block[3] = 0xff;
+        }
+    }
+}
+
+static void
+etc_decode_indexes (const guint8 *data,
+                    guint8      (*palette)[16],
+                    guint8       *block)
+{
+  guint msbs, lsbs, flip, x, y;
+
+  flip = data[3] & 0x1;
+  msbs = (data[4] << 8) | data[5];
+  lsbs = (data[6] << 8) | data[7];
+
+  for (y = 0; y < 4; y++)
+    {
+      for (x = 0; x < 4; x++)
+        {
+          guint i, index, sub;
+
+          i = x * 4 + y;
+          index = (((msbs >> i) & 1) << 1) | ((lsbs >> i) & 1);
+          sub = flip ? y >> 1 : x >> 1;
+
+          memcpy (block + (y * 4 + x) * 4, palette[sub] + index * 4, 4);
+        }
+    }
+}
+
+static void
+etc_decode_block (const guint8 *data,
+                  guint         flags,
+                  guint8       *block)
+{
+  guint8 base[2][3], palette[2][16];
+  gboolean differential, opaque = TRUE;
+  guint c;
+
+  if (flags & ETC_PUNCHTHROUGH)
+    {
+      differential = TRUE;
+      opaque = data[3] & 0x2;
+    }
+  else
+    {
+      differential = data[3] & 0x2;
+    }
+
+  if (differential)
+    {
+      /* differential mode: 555 base colour + 333 signed delta */
+      for (c = 0; c < 3; c++)
+        {
+          gint c1, c2;
+
+          c1 = data[c] >> 3;
+          c2 = c1 + (((gint8) (data[c] << 5)) >> 5);
+
+          if ((flags & ETC_ETC2) && (c2 < 0 || c2 > 31))
+            break;
+
+          base[0][c] = extend_5to8 (c1);
+          base[1][c] = extend_5to8 (c2 & 0x1f);
+        }
+
+      /* the first channel to overflow gives the ETC2 mode */
+      if (c < 3)
+        {
+          guint64 word = etc_load (data);
+
+          if (c == 2)
+            {
+              etc2_decode_planar (word, block);
+              return;
+            }
+
+          if (c == 0)
+            etc2_build_t_palette (word, palette[0]);
+          else
+            etc2_build_h_palette (word, palette[0]);
+
+          if (!opaque)
+            memset (palette[0] + 8, 0, 4);
+          memcpy (palette[1], palette[0], 16);
+
+          etc_decode_indexes (data, palette, block);
+          return;
+        }
+    }
+  else
+    {
+      /* individual mode: two 444 base colours */
+      for (c = 0; c < 3; c++)
+        {
+          base[0][c] = extend_4to8 (data[c] >> 4);
+          base[1][c] = extend_4to8 (data[c] & 0xf);
+        }
+    }
+
+  etc1_build_palette (base[0], data[3] >> 5, palette[0]);
+  etc1_build_palette (base[1], (data[3] >> 2) & 0x7, palette[1]);
+
+  if (!opaque)
+    {
+      etc2_punch_palette (base[0], palette[0]);
+      etc2_punch_palette (base[1], palette[1]);
+    }
+
+  etc_decode_indexes (data, palette, block);
+}
+
+/* replace the alpha of the decoded block with the values of an EAC block */
+static void
+eac_decode_block (const guint8 *data,
+                  guint8       *block)
+{
+  const gint *modifiers = eac_modifiers[data[1] & 0xf];
+  gint multiplier = data[1] >> 4;
+  guint64 indexes;
+  guint i;
+
+  indexes = etc_load (data);
+
+  for (i = 0; i < 16; i++)
+    {
+      gint alpha;
+
+      alpha = data[0] + modifiers[(indexes >> (45 - 3 * i)) & 0x7] *
+                        multiplier;
+
+      /* pixel indexes are stored column by column too */
+      block[((i % 4) * 4 + i / 4) * 4 + 3] = CLAMP (alpha, 0, 255);
+    }
+}
+
+static void
+etc_decode (const guchar     *data,
+            const PvrSurface *surface,
+            guint             first_row,
+            guint             n_rows,
+            guint             flags)
+{
+  guint blocks_x, block_size, bx, by;
+  guint8 block[16 * 4];
+
+  block_size = flags & ETC_EAC ? 16 : 8;
+  blocks_x = (surface->width + 3) / 4;
+  data += (gsize) first_row * blocks_x * block_size;
+
+  for (by = first_row; by < first_row + n_rows; by++)
+    {
+      for (bx = 0; bx < blocks_x; bx++)
+        {
+          if (flags & ETC_EAC)
+            {
+              etc_decode_block (data + 8, flags, block);
+              eac_decode_block (data, block);
+            }
+          else
+            {
+              etc_decode_block (data, flags, block);
+            }
+
+          pvr_surface_store_4x4 (surface, bx * 4, by * 4, block);
+          data += block_size;
+        }
+    }
+}
+
+void
+pvr_etc1_decode (const guchar     *data,
+                 const PvrSurface *surface,
+                 guint             first_row,
+                 guint             n_rows)
+{
+  etc_decode (data, surface, first_row, n_rows, 0);
+}
+
+void
+pvr_etc2_decode (const guchar     *data,
+                 const PvrSurface *surface,
+                 guint             first_row,
+                 guint             n_rows)
+{
+  etc_decode (data, surface, first_row, n_rows, ETC_ETC2);
+}
+
+void
+pvr_etc2_a1_decode (const guchar     *data,
+                    const PvrSurface *surface,
+                    guint             first_row,
+                    guint             n_rows)
+{
+  etc_decode (data, surface, first_row, n_rows,
+              ETC_ETC2 | ETC_PUNCHTHROUGH);
+}
+
+void
+pvr_etc2_rgba_decode (const guchar     *data,
+                      const PvrSurface *surface,
+                      guint             first_row,
+                      guint             n_rows)
+{
+  etc_decode (data, surface, first_row, n_rows, ETC_ETC2 | ETC_EAC);
+}
+
+/*
+ * ETC1 encoder.
+ *
+ * For both flip modes and both individual and differential modes we look
+ * for the base colour of each subblock around the average colour of its
+ * pixels, for each candidate colour trying the 8 modifier tables and
+ * picking the best modifier for each pixel. The quality setting decides how
+ * many candidates around the average we try:
+ *
+ *   fast:       the rounded average only
+ *   normal:     the average shifted by -1, 0 and +1 on all channels at once
+ *   exhaustive: -1, 0 and +1 on each channel independently
+ *
+ * The ETC2 encoders also try a planar block, which does much better than
+ * ETC1 on gradients, but not the T and H modes. Punch-through blocks with
+ * transparent pixels, those with an alpha below 128, are differential blocks
+ * without the small modifiers.
+ */
+
+#define ETC1_MAX_CANDIDATES 27
+
+typedef struct
+{
+  guint8 base[3];           /* quantized to 4 or 5 bits */
+  guint8 table;
+  guint8 indexes[8];
+  guint32 error;
+} Etc1Fit;
+
+/* pixels (as y * 4 + x) of each subblock, indexed by flip and subblock */
+static const guint8 etc1_subblock_pixels[2][2][8] =
+{
+  {
+    { 0, 4, 8, 12, 1, 5, 9, 13 },
+    { 2, 6, 10, 14, 3, 7, 11, 15 }
+  },
+  {
+    { 0, 1, 2, 3, 4, 5, 6, 7 },
+    { 8, 9, 10, 11, 12, 13, 14, 15 }
+  }
+};
+
+/*
+ * transparent is the mask of the transparent pixels (as 1 << (y * 4 + x)) of
+ * a punch-through block, those get pixel index 2 and the others can't use
+ * it. 0 for opaque blocks.
+ */
+static void
+etc1_fit_subblock (const guint8 (*pixels)[4],
+                   const guint8  *members,
+                   guint          bits,
+                   guint          transparent,
+                   Etc1Fit       *fit)
+{
+  guint8 base[3];
+  guint table, i, c;
+
+  for (c = 0; c < 3; c++)
+    base[c] = bits == 4 ? extend_4to8 (fit->base[c]) :
+                          extend_5to8 (fit->base[c]);
+
+  fit->error = G_MAXUINT32;
+
+  for (table = 0; table < 8; table++)
+    {
+      gint modifiers[4];
+      guint8 indexes[8];
+      guint32 error = 0;
+
+      memcpy (modifiers, etc1_modifiers[table], sizeof (modifiers));
+      if (transparent)
+        modifiers[0] = 0;
+
+      for (i = 0; i < 8 && error < fit->error; i++)
+        {
+          const guint8 *p = pixels[members[i]];
+          guint32 best = G_MAXUINT32;
+          guint m;
+
+          if (transparent & (1 << members[i]))
+            {
+              indexes[i] = 2;
+              continue;
+            }
+
+          for (m = 0; m < 4; m++)
+            {
+              guint32 e = 0;
+
+              if (transparent && m == 2)
+                continue;
+
+              for (c = 0; c < 3; c++)
+                {
+                  gint d;
+
+                  d = base[c] + modifiers[m];
+                  d = CLAMP (d, 0, 255) - p[c];
+                  e += d * d;
+                }
+
+              if (e < best)
+                {
+                  best = e;
+                  indexes[i] = m;
+                }
+            }
+
+          error += best;
+        }
+
+      if (error < fit->error)
+        {
+          fit->error = error;
+          fit->table = table;
+          memcpy (fit->indexes, indexes, 8);
+        }
+    }
+}
+
+/*
+ * Fill fits with the candidates base colours of a subblock, quantized to
+ * bits, and their best fit. Returns the number of candidates.
+ */
+static guint
+etc1_fit_candidates (const guint8 (*pixels)[4],
+                     const guint8  *members,
+                     guint          bits,
+                     PvrQuality     quality,
+                     guint          transparent,
+                     Etc1Fit       *fits)
+{
+  guint sum[3] = { 0, 0, 0 };
+  gint average[3];
+  guint max, n_fits, n_pixels, i, c;
+
+  n_pixels = 0;
+  for (i = 0; i < 8; i++)
+    {
+      if (transparent & (1 << members[i]))
+        continue;
+
+      for (c = 0; c < 3; c++)
+        sum[c] += pixels[members[i]][c];
+      n_pixels++;
+    }
+
+  max = (1 << bits) - 1;
+  for (c = 0; c < 3; c++)
+    average[c] = ((sum[c] / MAX (n_pixels, 1)) * max + 127) / 255;
+
+  n_fits = 0;
+  for (i = 0; i < 27; i++)
+    {
+      gint delta[3];
+      gboolean valid = TRUE;
+
+      delta[0] = (gint) (i % 3) - 1;
+      delta[1] = (gint) (i / 3 % 3) - 1;
+      delta[2] = (gint) (i / 9) - 1;
+
+      switch (quality)
+        {
+        case PVR_QUALITY_FAST:
+          valid = delta[0] == 0 && delta[1] == 0 && delta[2] == 0;
+          break;
+        case PVR_QUALITY_NORMAL:
+          valid = delta[0] == delta[1] && delta[1] == delta[2];
+          break;
+        case PVR_QUALITY_EXHAUSTIVE:
+          break;
+        }
+
+      for (c = 0; c < 3 && valid; c++)
+        valid = average[c] + delta[c] >= 0 &&
+                average[c] + delta[c] <= (gint) max;
+
+      if (!valid)
+        continue;
+
+      for (c = 0; c < 3; c++)
+        fits[n_fits].base[c] = average[c] + delta[c];
+      etc1_fit_subblock (pixels, members, bits, transparent, &fits[n_fits]);
+      n_fits++;
+    }
+
+  return n_fits;
+}
+
+static void
+etc1_pack_block (guint8        *data,
+                 gboolean       differential,
+                 guint          flip,
+                 const Etc1Fit *fit0,
+                 const Etc1Fit *fit1)
+{
+  guint msbs = 0, lsbs = 0, sub, i, c;
+
+  for (c = 0; c < 3; c++)
+    {
+      if (differential)
+        data[c] = (fit0->base[c] << 3) |
+                  ((fit1->base[c] - fit0->base[c]) & 0x7);
+      else
+        data[c] = (fit0->base[c] << 4) | fit1->base[c];
+    }
+
+  data[3] = (fit0->table << 5) | (fit1->table << 2) |
+            (differential << 1) | flip;
+
+  for (sub = 0; sub < 2; sub++)
+    {
+      const Etc1Fit *fit = sub ? fit1 : fit0;
+
+      for (i = 0; i < 8; i++)
+        {
+          guint pixel, bit;
+
+          /* pixel indexes are stored column by column */
+          pixel = etc1_subblock_pixels[flip][sub][i];
+          bit = (pixel % 4) * 4 + pixel / 4;
+
+          msbs |= (fit->indexes[i] >> 1) << bit;
+          lsbs |= (fit->indexes[i] & 1) << bit;
+        }
+    }
+
+  data[4] = msbs >> 8;
+  data[5] = msbs & 0xff;
+  data[6] = lsbs >> 8;
+  data[7] = lsbs & 0xff;
+}
+
+/* returns the squared error of the block written to data */
+static guint32
+etc1_encode_block (const guint8 (*pixels)[4],
+                   PvrQuality     quality,
+                   guint          flags,
+                   guint          transparent,
+                   guint8        *data)
+{
+  Etc1Fit fits[2][ETC1_MAX_CANDIDATES + 1];
+  guint32 best_error = G_MAXUINT32;
+  guint flip;
+
+  for (flip = 0; flip < 2; flip++)
+    {
+      const Etc1Fit *best0, *best1;
+      guint n_fits[2], i, j;
+
+      /* individual mode, the subblocks are independent */
+      if (!(flags & ETC_PUNCHTHROUGH))
+        {
+          for (i = 0; i < 2; i++)
+            n_fits[i] = etc1_fit_candidates (pixels,
+                                             etc1_subblock_pixels[flip][i],
+                                             4, quality, 0, fits[i]);
+
+          best0 = &fits[0][0];
+          for (i = 1; i < n_fits[0]; i++)
+            if (fits[0][i].error < best0->error)
+              best0 = &fits[0][i];
+
+          best1 = &fits[1][0];
+          for (i = 1; i < n_fits[1]; i++)
+            if (fits[1][i].error < best1->error)
+              best1 = &fits[1][i];
+
+          if (best0->error + best1->error < best_error)
+            {
+              best_error = best0->error + best1->error;
+              etc1_pack_block (data, FALSE, flip, best0, best1);
+            }
+        }
+
+      /* differential mode, the second base colour has to be within
+       * [-4, 3] of the first one */
+      for (i = 0; i < 2; i++)
+        n_fits[i] = etc1_fit_candidates (pixels,
+                                         etc1_subblock_pixels[flip][i],
+                                         5, quality, transparent, fits[i]);
+
+      /* without the individual mode to fall back to, make sure there is at
+       * least one valid pair: the best second colour clamped around the best
+       * first one */
+      if (flags & ETC_PUNCHTHROUGH)
+        {
+          Etc1Fit *clamped = &fits[1][n_fits[1]];
+          guint c;
+
+          best0 = &fits[0][0];
+          for (i = 1; i < n_fits[0]; i++)
+            if (fits[0][i].error < best0->error)
+              best0 = &fits[0][i];
+
+          best1 = &fits[1][0];
+          for (i = 1; i < n_fits[1]; i++)
+            if (fits[1][i].error < best1->error)
+              best1 = &fits[1][i];
+
+          for (c = 0; c < 3; c++)
+            clamped->base[c] = CLAMP (best1->base[c], best0->base[c] - 4,
+                                      best0->base[c] + 3);
+          etc1_fit_subblock (pixels, etc1_subblock_pixels[flip][1], 5,
+                             transparent, clamped);
+          n_fits[1]++;
+        }
+
+      for (i = 0; i < n_fits[0]; i++)
+        {
+          for (j = 0; j < n_fits[1]; j++)
+            {
+              const Etc1Fit *fit0 = &fits[0][i], *fit1 = &fits[1][j];
+              guint c;
+
+              if (fit0->error + fit1->error >= best_error)
+                continue;
+
+              for (c = 0; c < 3; c++)
+                {
+                  gint delta = fit1->base[c] - fit0->base[c];
+
+                  if (delta < -4 || delta > 3)
+                    break;
+                }
+
+              if (c < 3)
+                continue;
+
+              best_error = fit0->error + fit1->error;
+              etc1_pack_block (data, TRUE, flip, fit0, fit1);
+            }
+        }
+    }
+
+  /* the diff bit of punch-through blocks says whether they are opaque */
+  if (transparent)
+    data[3] &= ~0x2;
+
+  return best_error;
+}
+
+/*
+ * Planar blocks: each channel is a least squares fit of a plane to the
+ * pixels, quantized to 6, 7 and 6 bits for red, green and blue. Unless the
+ * quality is fast, the neighbouring quantized values are tried too.
+ */
+
+static const guint etc2_planar_bits[3] = { 6, 7, 6 };
+
+static inline guint8
+etc2_planar_extend (guint x,
+                    guint c)
+{
+  return etc2_planar_bits[c] == 7 ? extend_7to8 (x) : extend_6to8 (x);
+}
+
+static guint32
+etc2_planar_error (const guint8 (*pixels)[4],
+                   guint          c,
+                   gint           o,
+                   gint           h,
+                   gint           v)
+{
+  guint32 error = 0;
+  guint x, y;
+
+  for (y = 0; y < 4; y++)
+    {
+      for (x = 0; x < 4; x++)
+        {
+          gint d;
+
+          d = etc2_planar_value (o, h, v, x, y) - pixels[y * 4 + x][c];
+          error += d * d;
+        }
+    }
+
+  return error;
+}
+
+static guint32
+etc2_encode_planar (const guint8 (*pixels)[4],
+                    PvrQuality     quality,
+                    guint8        *data)
+{
+  guint ohv[3][3];              /* quantized o, h and v of each channel */
+  guint32 error = 0;
+  guint64 word;
+  guint c, i, j;
+
+  for (c = 0; c < 3; c++)
+    {
+      gint sum = 0, sum_x = 0, sum_y = 0, max, fit[3];
+      gdouble mean, dx, dy, plane[3];
+      guint32 best = G_MAXUINT32;
+
+      /* x and y centered on 1.5 and doubled to stay integers */
+      for (i = 0; i < 16; i++)
+        {
+          sum += pixels[i][c];
+          sum_x += ((gint) (i % 4) * 2 - 3) * pixels[i][c];
+          sum_y += ((gint) (i / 4) * 2 - 3) * pixels[i][c];
+        }
+
+      mean = sum / 16.0;
+      dx = sum_x / 40.0;
+      dy = sum_y / 40.0;
+      plane[0] = mean - 1.5 * dx - 1.5 * dy;
+      plane[1] = plane[0] + 4 * dx;
+      plane[2] = plane[0] + 4 * dy;
+
+      max = (1 << etc2_planar_bits[c]) - 1;
+      for (j = 0; j < 3; j++)
+        {
+          gint q = (gint) (plane[j] * max / 255 + 0.5);
+
+          fit[j] = CLAMP (q, 0, max);
+        }
+
+      for (i = 0; i < 27; i++)
+        {
+          gint value[3];
+          guint32 e;
+
+          if (quality == PVR_QUALITY_FAST && i != 13)
+            continue;
+
+          value[0] = fit[0] + (gint) (i % 3) - 1;
+          value[1] = fit[1] + (gint) (i / 3 % 3) - 1;
+          value[2] = fit[2] + (gint) (i / 9) - 1;
+
+          for (j = 0; j < 3; j++)
+            if (value[j] < 0 || value[j] > max)
+              break;
+          if (j < 3)
+            continue;
+
+          e = etc2_planar_error (pixels, c,
+                                 etc2_planar_extend (value[0], c),
+                                 etc2_planar_extend (value[1], c),
+                                 etc2_planar_extend (value[2], c));
+          if (e < best)
+            {
+              best = e;
+              for (j = 0; j < 3; j++)
+                ohv[c][j] = value[j];
+            }
+        }
+
+      error += best;
+    }
+
+  word = (guint64) ohv[0][0] << 57 |
+         (guint64) (ohv[1][0] >> 6) << 56 |
+         (guint64) (ohv[1][0] & 0x3f) << 49 |
+         (guint64) (ohv[2][0] >> 5) << 48 |
+         (guint64) ((ohv[2][0] >> 3) & 0x3) << 43 |
+         (guint64) (ohv[2][0] & 0x7) << 39 |
+         (guint64) (ohv[0][1] >> 1) << 34 |
+         (guint64) 1 << 33 |
+         (guint64) (ohv[0][1] & 0x1) << 32 |
+         (guint64) ohv[1][1] << 25 |
+         (guint64) ohv[2][1] << 19 |
+         (guint64) ohv[0][2] << 13 |
+         (guint64) ohv[1][2] << 6 |
+         (guint64) ohv[2][2];
+
+  /* use the unused bits to keep the red and green differential colours in
+   * range and to make the blue one overflow, which is what flags the block
+   * as planar */
+  if ((gint) etc_bits (word, 62, 4) + (((gint) etc_bits (word, 58, 3) ^ 4) - 4)
+      < 0)
+    word |= (guint64) 1 << 63;
+  if ((gint) etc_bits (word, 54, 4) + (((gint) etc_bits (word, 50, 3) ^ 4) - 4)
+      < 0)
+    word |= (guint64) 1 << 55;
+  if (etc_bits (word, 44, 2) + etc_bits (word, 41, 2) < 4)
+    word |= (guint64) 1 << 42;
+  else
+    word |= (guint64) 0x7 << 45;
+
+  for (i = 0; i < 8; i++)
+    data[i] = word >> (56 - i * 8);
+
+  return error;
+}
+
+/*
+ * EAC encoder. For each modifier table, the multiplier is the smallest one
+ * spanning the range of the alpha values of the block and the base value
+ * centres the table on that range. Unless the quality is fast, the
+ * neighbouring base values are tried too, with the neighbouring multipliers
+ * for normal quality and all of them for exhaustive quality.
+ */
+
+static guint32
+eac_fit (const guint8 (*pixels)[4],
+         gint           base,
+         gint           multiplier,
+         guint          table,
+         guint32        max_error,
+         guint64       *indexes)
+{
+  guint32 error = 0;
+  guint i, m;
+
+  *indexes = 0;
+  for (i = 0; i < 16 && error < max_error; i++)
+    {
+      guint32 best = G_MAXUINT32;
+      guint index = 0;
+      gint alpha;
+
+      /* pixel indexes are stored column by column */
+      alpha = pixels[(i % 4) * 4 + i / 4][3];
+
+      for (m = 0; m < 8; m++)
+        {
+          gint d;
+
+          d = base + eac_modifiers[table][m] * multiplier;
+          d = CLAMP (d, 0, 255) - alpha;
+          if ((guint32) (d * d) < best)
+            {
+              best = d * d;
+              index = m;
+            }
+        }
+
+      error += best;
+      *indexes = *indexes << 3 | index;
+    }
+
+  return error;
+}
+
+static void
+eac_encode_block (const guint8 (*pixels)[4],
+                  PvrQuality     quality,
+                  guint8        *data)
+{
+  guint32 best_error = G_MAXUINT32;
+  guint64 indexes, best_indexes = 0;
+  gint min = 255, max = 0, best_base = 0, best_multiplier = 1;
+  guint table, best_table = 0, i;
+
+  for (i = 0; i < 16; i++)
+    {
+      min = MIN (min, pixels[i][3]);
+      max = MAX (max, pixels[i][3]);
+    }
+
+  for (table = 0; table < 16 && best_error > 0; table++)
+    {
+      const gint *modifiers = eac_modifiers[table];
+      gint span, multiplier, first, last, delta;
+
+      span = modifiers[7] - modifiers[3];
+      multiplier = CLAMP ((max - min + span - 1) / span, 1, 15);
+
+      switch (quality)
+        {
+        case PVR_QUALITY_FAST:
+          first = last = multiplier;
+          break;
+        case PVR_QUALITY_NORMAL:
+          first = MAX (1, multiplier - 1);
+          last = MIN (15, multiplier + 1);
+          break;
+        default:
+          first = 1;
+          last = 15;
+          break;
+        }
+
+      for (multiplier = first; multiplier <= last; multiplier++)
+        {
+          gint base;
+
+          base = (min + max - (modifiers[7] + modifiers[3]) * multiplier +
+                  1) / 2;
+
+          for (delta = -1; delta <= 1; delta++)
+            {
+              guint32 error;
+
+              if (quality == PVR_QUALITY_FAST && delta != 0)
+                continue;
+
+              error = eac_fit (pixels, CLAMP (base + delta, 0, 255),
+                               multiplier, table, best_error, &indexes);
+              if (error < best_error)
+                {
+                  best_error = error;
+                  best_base = CLAMP (base + delta, 0, 255);
+                  best_multiplier = multiplier;
+                  best_table = table;
+                  best_indexes = indexes;
+                }
+            }
+        }
+    }
+
+  data[0] = best_base;
+  data[1] = best_multiplier << 4 | best_table;
+  for (i = 0; i < 6; i++)
+    data[2 + i] = best_indexes >> (40 - i * 8);
+}
+
+static void
+etc_encode_block (const guint8 (*pixels)[4],
+                  PvrQuality     quality,
+                  guint          flags,
+                  guint8        *data)
+{
+  guint transparent = 0, i;
+  guint32 error;
+
+  if (flags & ETC_EAC)
+    {
+      eac_encode_block (pixels, quality, data);
+      data += 8;
+    }
+
+  if (flags & ETC_PUNCHTHROUGH)
+    {
+      for (i = 0; i < 16; i++)
+        if (pixels[i][3] < 128)
+          transparent |= 1 << i;
+    }
+
+  error = etc1_encode_block (pixels, quality, flags, transparent, data);
+
+  /* planar blocks are always opaque */
+  if ((flags & ETC_ETC2) && transparent == 0 && error > 0)
+    {
+      guint8 planar[8];
+
+      if (etc2_encode_planar (pixels, quality, planar) < error)
+        memcpy (data, planar, 8);
+    }
+}
+
+/*
+ * Gather the 4x4 block at (x, y), replicating the last row and column for
+ * blocks straddling the edges of the image
+ */
+static void
+etc_gather_block (const PvrSurface *image,
+                  guint             x,
+                  guint             y,
+                  guint8          (*pixels)[4])
+{
+  guint i, j;
+
+  for (j = 0; j < 4; j++)
+    {
+      const guchar *row;
+
+      row = image->pixels +
+            (gssize) MIN (y + j, image->height - 1) * image->rowstride;
+
+      for (i = 0; i < 4; i++)
+        {
+          const guchar *p;
+
+          p = row + MIN (x + i, image->width - 1) * image->n_channels;
+          memcpy (pixels[j * 4 + i], p, 3);
+          pixels[j * 4 + i][3] = image->n_channels == 4 ? p[3] : 0xff;
+        }
+    }
+}
+
+static void
+etc_encode (const PvrSurface *image,
+            guchar           *data,
+            guint             first_row,
+            guint             n_rows,
+            const guint8     *dirty,
+            PvrQuality        quality,
+            guint             flags)
+{
+  guint blocks_x, block_size, bx, by;
+  guint8 pixels[16][4];
+
+  block_size = flags & ETC_EAC ? 16 : 8;
+  blocks_x = (image->width + 3) / 4;
+  data += (gsize) first_row * blocks_x * block_size;
+
+  for (by = first_row; by < first_row + n_rows; by++)
+    {
+      for (bx = 0; bx < blocks_x; bx++, data += block_size)
+        {
+          if (dirty && !dirty[by * blocks_x + bx])
+            continue;
+
+          etc_gather_block (image, bx * 4, by * 4, pixels);
+          etc_encode_block (pixels, quality, flags, data);
+        }
+    }
+}
+
+void
+pvr_etc1_encode (const PvrSurface *image,
+                 guchar           *data,
+                 guint             first_row,
+                 guint             n_rows,
+                 const guint8     *dirty,
+                 PvrQuality        quality)
+{
+  etc_encode (image, data, first_row, n_rows, dirty, quality, 0);
+}
+
+void
+pvr_etc2_encode (const PvrSurface *image,
+                 guchar           *data,
+                 guint             first_row,
+                 guint             n_rows,
+                 const guint8     *dirty,
+                 PvrQuality        quality)
+{
+  etc_encode (image, data, first_row, n_rows, dirty, quality, ETC_ETC2);
+}
+
+void
+pvr_etc2_a1_encode (const PvrSurface *image,
+                    guchar           *data,
+                    guint             first_row,
+                    guint             n_rows,
+                    const guint8     *dirty,
+                    PvrQuality        quality)
+{
+  etc_encode (image, data, first_row, n_rows, dirty, quality,
+              ETC_ETC2 | ETC_PUNCHTHROUGH);
+}
+
+void
+pvr_etc2_rgba_encode (const PvrSurface *image,
+                      guchar           *data,
+                      guint             first_row,
+                      guint             n_rows,
+                      const guint8     *dirty,
+                      PvrQuality        quality)
+{
+  etc_encode (image, data, first_row, n_rows, dirty, quality,
+              ETC_ETC2 | ETC_EAC);
+}
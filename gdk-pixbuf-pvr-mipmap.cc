@@ -0,0 +1,239 @@
+/*
+ * gdk-pixbuf-texture-tool - Manipulate texture files
+ *
+ * Copyright (C) 2011 Intel Corporation.
+ *
+ * This software is licensed under the BSD 3-Clause license. See the COPYING
+ * file for the full text of the license.
+ *
+ */
+
+/*
+ * Mipmap chain generation.
+ *
+ * Each level is a 2x2 box filter of the previous one, widened to 3 pixels for
+ * the last column and row of odd sizes. The colour channels are averaged in
+ * linear light: they are converted from sRGB to 12 bits linear values through
+ * a table, summed (4 * 4095 still fits in 16 bits so the sums can be done 8
+ * channels at a time with SSE2) and converted back with a second table
+ * indexed by the 12 bits average. Alpha is linear already and is averaged as
+ * is.
+ */
+
+#include <math.h>
+
+#include "gdk-pixbuf-pvr-codecs.h"
+
+#define LINEAR_BITS 12
+#define LINEAR_MAX  ((1 << LINEAR_BITS) - 1)
+
+static guint16 srgb_to_linear[256];
+static guint8 linear_to_srgb[LINEAR_MAX + 1];
+
+static void
+init_tables (void)
+{
+  static gsize initialized = 0;
+
+  if (g_once_init_enter (&initialized))
+    {
+      guint i;
+
+      for (i = 0; i < 256; i++)
+        {
+          gdouble v = i / 255.0;
+
+          v = v <= 0.04045 ? v / 12.92 : pow ((v + 0.055) / 1.055, 2.4);
+          srgb_to_linear[i] = (guint16) (v * LINEAR_MAX + 0.5);
+        }
+
+      for (i = 0; i <= LINEAR_MAX; i++)
+        {
+          gdouble v = i / (gdouble) LINEAR_MAX;
+
+          v = v <= 0.0031308 ? v * 12.92 : 1.055 * pow (v, 1 / 2.4) - 0.055;
+          linear_to_srgb[i] = (guint8) (v * 255 + 0.5);
+        }
+
+      g_once_init_leave (&initialized, 1);
+    }
+}
+
+static void
+linearize_row (const guchar *row,
+               guint16      *linear,
+               guint         width,
+               guint         n_channels)
+{
+  guint x, c;
+
+  for (x = 0; x < width; x++, row += n_channels, linear += n_channels)
+    {
+      for (c = 0; c < 3; c++)
+        linear[c] = srgb_to_linear[row[c]];
+      if (n_channels == 4)
+        linear[3] = row[3];
+    }
+}
+
+/*
+ * Average the 2x2 footprints of the two linearized rows a and b into row.
+ * With odd source widths the last footprint is 3 columns wide, and extra,
+ * when not NULL, is a third row for the last row of odd source heights, so
+ * no source pixel is dropped. 1 pixel wide sources use their column twice.
+ */
+static void
+downsample_row (const guint16 *a,
+                const guint16 *b,
+                const guint16 *extra,
+                guint          src_width,
+                guint          n_channels,
+                guchar        *row,
+                guint          width)
+{
+  guint16 average[8];
+  guint x, x0, x1, x2, c, sum, n;
+  gboolean wide;
+
+  for (x = 0; x < width; x++, row += n_channels)
+    {
+      x0 = 2 * x * n_channels;
+      x1 = MIN (2 * x + 1, src_width - 1) * n_channels;
+      x2 = (2 * x + 2) * n_channels;
+      wide = x == width - 1 && src_width > 2 * width;
+
+#ifdef __SSE2__
+      if (n_channels == 4 && x1 == x0 + 4 && !wide && extra == NULL)
+        {
+          __m128i sum;
+
+          /* the two pixels of a and b in one register each */
+          sum = _mm_add_epi16 (_mm_loadu_si128 ((const __m128i *) (a + x0)),
+                               _mm_loadu_si128 ((const __m128i *) (b + x0)));
+          sum = _mm_add_epi16 (sum, _mm_srli_si128 (sum, 8));
+          sum = _mm_srli_epi16 (_mm_add_epi16 (sum, _mm_set1_epi16 (2)), 2);
+          _mm_storeu_si128 ((__m128i *) average, sum);
+        }
+      else
+#endif
+        {
+          for (c = 0; c < n_channels; c++)
+            {
+              sum = a[x0 + c] + a[x1 + c] + b[x0 + c] + b[x1 + c];
+              n = 4;
+              if (wide)
+                {
+                  sum += a[x2 + c] + b[x2 + c];
+                  n += 2;
+                }
+              if (extra)
+                {
+                  sum += extra[x0 + c] + extra[x1 + c];
+                  n += 2;
+                  if (wide)
+                    {
+                      sum += extra[x2 + c];
+                      n++;
+                    }
+                }
+
+              average[c] = (sum + n / 2) / n;
+            }
+        }
+
+      for (c = 0; c < 3; c++)
+        row[c] = linear_to_srgb[average[c]];
+      if (n_channels == 4)
+        row[3] = average[3];
+    }
+}
+
+guint
+pvr_mipmap_get_n_levels (guint width,
+                         guint height)
+{
+  guint size, n_levels;
+
+  size = MAX (width, height);
+  for (n_levels = 1; size > 1; n_levels++)
+    size /= 2;
+
+  return n_levels;
+}
+
+gsize
+pvr_mipmap_chain_layout (PvrSurface *levels,
+                         guint       n_levels,
+                         guchar     *pixels)
+{
+  gsize size = 0;
+  guint i;
+
+  for (i = 1; i < n_levels; i++)
+    {
+      PvrSurface *level = &levels[i];
+
+      level->width = MAX (1, levels[i - 1].width / 2);
+      level->height = MAX (1, levels[i - 1].height / 2);
+      level->n_channels = levels[0].n_channels;
+      level->layout = levels[0].layout;
+      level->rowstride = level->width * level->n_channels;
+      level->pixels = pixels ? pixels + size : NULL;
+
+      size += (gsize) level->rowstride * level->height;
+    }
+
+  return size;
+}
+
+void
+pvr_mipmap_chain_generate (PvrSurface *levels,
+                           guint       n_levels)
+{
+  guint16 *a, *b, *extra;
+  guint i, y, n_channels;
+
+  if (n_levels < 2)
+    return;
+
+  init_tables ();
+
+  /* level 1 is the widest one we write, level 0 the widest we read */
+  n_channels = levels[0].n_channels;
+  a = g_new (guint16, levels[0].width * n_channels + 8);
+  b = g_new (guint16, levels[0].width * n_channels + 8);
+  extra = g_new (guint16, levels[0].width * n_channels + 8);
+
+  for (i = 1; i < n_levels; i++)
+    {
+      const PvrSurface *src = &levels[i - 1];
+      const PvrSurface *dst = &levels[i];
+
+      for (y = 0; y < dst->height; y++)
+        {
+          guint y0, y1, y2;
+          gboolean tall;
+
+          y0 = 2 * y;
+          y1 = MIN (2 * y + 1, src->height - 1);
+          y2 = 2 * y + 2;
+          tall = y == dst->height - 1 && src->height > 2 * dst->height;
+
+          linearize_row (src->pixels + (gssize) y0 * src->rowstride, a,
+                         src->width, n_channels);
+          linearize_row (src->pixels + (gssize) y1 * src->rowstride, b,
+                         src->width, n_channels);
+          if (tall)
+            linearize_row (src->pixels + (gssize) y2 * src->rowstride, extra,
+                           src->width, n_channels);
+
+          downsample_row (a, b, tall ? extra : NULL, src->width, n_channels,
+                          dst->pixels + (gssize) y * dst->rowstride,
+                          dst->width);
+        }
+    }
+
+  g_free (a);
+  g_free (b);
+  g_free (extra);
+}
@@ -0,0 +1,461 @@
+/*
+ * gdk-pixbuf-texture-tool - Manipulate texture files
+ *
+ * Copyright (C) 2011 Intel Corporation.
+ *
+ * This software is licensed under the BSD 3-Clause license. See the COPYING
+ * file for the full text of the license.
+ *
+ */
+
+/*
+ * PVRTC 2bpp and 4bpp decoder.
+ *
+ * A PVRTC texture is made of 64 bits words, one per 4x4 (4bpp) or 8x4 (2bpp)
+ * block of pixels, stored in Morton (twiddled) order. The low 32 bits hold
+ * the modulation data, the high 32 bits two colours, A and B. Each pixel is a
+ * blend of A and B bilinearly upscaled from the 4 blocks surrounding it, the
+ * blocks colours being centred in their block.
+ *
+ * We decode a row of blocks at a time: the modulation values of that band
+ * (plus one row above and below for the 2bpp interpolated modes) are unpacked
+ * into a small buffer, then each pixel row is produced by first blending the
+ * two rows of block colours it sits between and then interpolating that
+ * horizontally, which keeps everything we touch in a few cache lines.
+ */
+
+#include "gdk-pixbuf-pvr-codecs.h"
+
+/* modulation values are weights of B in 1/8th */
+#define MODULATION_PUNCH_THROUGH  0x80
+#define MODULATION_WEIGHT_MASK    0x0f
+
+static const guint8 modulation_values[4] = { 0, 3, 5, 8 };
+static const guint8 modulation_values_punch_through[4] =
+{
+  0, 4, 4 | MODULATION_PUNCH_THROUGH, 8
+};
+
+typedef struct
+{
+  const guchar *data;
+  guint bpp;
+  guint block_width;                /* in pixels, 8 for 2bpp, 4 for 4bpp */
+  guint blocks_x, blocks_y;
+  guint width, height;              /* padded to at least 2x2 blocks */
+
+  /* last two rows of block colours that were unpacked, A and B in RGBA */
+  guint8 *colours[2];
+  guint colours_row[2];
+
+  /* modulation for the current band: 4 rows plus one above and one below */
+  guint8 *modulation;
+  guint8 *modes;
+
+  gint *row_a, *row_b;              /* vertically blended colours */
+} PvrtcImage;
+
+static inline guint8
+extend_3to8 (guint x)
+{
+  return (x << 5) | (x << 2) | (x >> 1);
+}
+
+static inline guint8
+extend_4to8 (guint x)
+{
+  return (x << 4) | x;
+}
+
+static inline guint8
+extend_5to8 (guint x)
+{
+  return (x << 3) | (x >> 2);
+}
+
+static guint
+twiddle (guint blocks_x,
+         guint blocks_y,
+         guint x,
+         guint y)
+{
+  guint min_dimension, max_value, twiddled, bit, shift;
+
+  if (blocks_y < blocks_x)
+    {
+      min_dimension = blocks_y;
+      max_value = x;
+    }
+  else
+    {
+      min_dimension = blocks_x;
+      max_value = y;
+    }
+
+  twiddled = 0;
+  shift = 0;
+  for (bit = 1; bit < min_dimension; bit <<= 1)
+    {
+      if (y & bit)
+        twiddled |= 1 << (2 * shift);
+      if (x & bit)
+        twiddled |= 2 << (2 * shift);
+      shift++;
+    }
+
+  return twiddled | ((max_value >> shift) << (2 * shift));
+}
+
+static inline void
+pvrtc_get_word (const PvrtcImage *image,
+                guint             x,
+                guint             y,
+                guint32          *modulation,
+                guint32          *colours)
+{
+  const guchar *word;
+  guint32 tmp[2];
+
+  word = image->data + twiddle (image->blocks_x, image->blocks_y, x, y) * 8;
+  memcpy (tmp, word, 8);
+
+  *modulation = GUINT32_FROM_LE (tmp[0]);
+  *colours = GUINT32_FROM_LE (tmp[1]);
+}
+
+static void
+pvrtc_unpack_colours (guint32  data,
+                      guint8  *a,
+                      guint8  *b)
+{
+  if (data & 0x8000)
+    {
+      /* opaque RGB 554 */
+      a[0] = extend_5to8 ((data >> 10) & 0x1f);
+      a[1] = extend_5to8 ((data >> 5) & 0x1f);
+      a[2] = extend_4to8 ((data >> 1) & 0xf);
+      a[3] = 0xff;
+    }
+  else
+    {
+      /* translucent ARGB 3443 */
+      a[0] = extend_4to8 ((data >> 8) & 0xf);
+      a[1] = extend_4to8 ((data >> 4) & 0xf);
+      a[2] = extend_3to8 ((data >> 1) & 0x7);
+      a[3] = extend_4to8 (((data >> 12) & 0x7) << 1);
+    }
+
+  if (data & 0x80000000)
+    {
+      /* opaque RGB 555 */
+      b[0] = extend_5to8 ((data >> 26) & 0x1f);
+      b[1] = extend_5to8 ((data >> 21) & 0x1f);
+      b[2] = extend_5to8 ((data >> 16) & 0x1f);
+      b[3] = 0xff;
+    }
+  else
+    {
+      /* translucent ARGB 3444 */
+      b[0] = extend_4to8 ((data >> 24) & 0xf);
+      b[1] = extend_4to8 ((data >> 20) & 0xf);
+      b[2] = extend_4to8 ((data >> 16) & 0xf);
+      b[3] = extend_4to8 (((data >> 28) & 0x7) << 1);
+    }
+}
+
+static const guint8 *
+pvrtc_get_colour_row (PvrtcImage *image,
+                      guint       y)
+{
+  guint slot, x;
+  guint8 *row;
+
+  for (slot = 0; slot < 2; slot++)
+    {
+      if (image->colours_row[slot] == y)
+        return image->colours[slot];
+    }
+
+  /* replace the row we are the furthest from */
+  slot = image->colours_row[0] == (y + image->blocks_y - 1) % image->blocks_y;
+  row = image->colours[slot];
+
+  for (x = 0; x < image->blocks_x; x++)
+    {
+      guint32 modulation, colours;
+
+      pvrtc_get_word (image, x, y, &modulation, &colours);
+      pvrtc_unpack_colours (colours, row + x * 8, row + x * 8 + 4);
+    }
+
+  image->colours_row[slot] = y;
+
+  return row;
+}
+
+/*
+ * Unpack the modulation values of the block at (x, y) into values, a 8x4 or
+ * 4x4 array of weights. Returns the modulation mode of the block: 0 for
+ * the 2bpp direct and 4bpp modes, 1 to 3 for the 2bpp interpolated modes.
+ */
+static guint
+pvrtc_unpack_modulation (const PvrtcImage *image,
+                         guint             x,
+                         guint             y,
+                         guint8           *values)
+{
+  guint32 bits, colours;
+  guint mode, i, j;
+
+  pvrtc_get_word (image, x, y, &bits, &colours);
+  mode = colours & 0x1;
+
+  if (image->bpp == 4)
+    {
+      const guint8 *table;
+
+      table = mode ? modulation_values_punch_through : modulation_values;
+      for (i = 0; i < 16; i++, bits >>= 2)
+        values[i] = table[bits & 0x3];
+
+      return 0;
+    }
+
+  if (mode == 0)
+    {
+      /* 1 bit per pixel */
+      for (i = 0; i < 32; i++, bits >>= 1)
+        values[i] = (bits & 0x1) ? 8 : 0;
+
+      return 0;
+    }
+
+  /* only half of the pixels are stored, in a checkerboard pattern. Bit 0
+   * selects between the H&V and the H or V only modes and, if set, the
+   * low bit of the centre pixel tells which of the H or V mode it is */
+  if (bits & 0x1)
+    {
+      mode = (bits & (1 << 20)) ? 3 : 2;
+
+      if (bits & (1 << 21))
+        bits |= 1 << 20;
+      else
+        bits &= ~(1 << 20);
+    }
+
+  if (bits & 0x2)
+    bits |= 0x1;
+  else
+    bits &= ~0x1;
+
+  for (j = 0; j < 4; j++)
+    {
+      for (i = 0; i < 8; i++)
+        {
+          if (((i ^ j) & 1) == 0)
+            {
+              values[j * 8 + i] = modulation_values[bits & 0x3];
+              bits >>= 2;
+            }
+        }
+    }
+
+  return mode;
+}
+
+/*
+ * Fill the modulation buffer for the band of pixels covered by the row of
+ * blocks y. Buffer rows 1 to 4 are the band itself, rows 0 and 5 the
+ * neighbouring pixel rows needed by the 2bpp interpolated modes.
+ */
+static void
+pvrtc_unpack_band_modulation (PvrtcImage *image,
+                              guint       y)
+{
+  guint width, bw, x, i, j;
+  guint8 values[32];
+  guint8 *m;
+
+  width = image->width;
+  bw = image->block_width;
+  m = image->modulation;
+
+  for (x = 0; x < image->blocks_x; x++)
+    {
+      image->modes[x] = pvrtc_unpack_modulation (image, x, y, values);
+      for (j = 0; j < 4; j++)
+        memcpy (m + (j + 1) * width + x * bw, values + j * bw, bw);
+    }
+
+  if (image->bpp == 4)
+    return;
+
+  for (x = 0; x < image->blocks_x; x++)
+    {
+      pvrtc_unpack_modulation (image, x,
+                               (y + image->blocks_y - 1) % image->blocks_y,
+                               values);
+      memcpy (m + x * bw, values + 3 * bw, bw);
+
+      pvrtc_unpack_modulation (image, x, (y + 1) % image->blocks_y, values);
+      memcpy (m + 5 * width + x * bw, values, bw);
+    }
+
+  /* now that all the stored values are known, fill the missing ones */
+  for (x = 0; x < image->blocks_x; x++)
+    {
+      guint mode = image->modes[x];
+
+      if (mode == 0)
+        continue;
+
+      for (j = 1; j < 5; j++)
+        {
+          guint8 *above = m + (j - 1) * width;
+          guint8 *row = m + j * width;
+          guint8 *below = m + (j + 1) * width;
+
+          for (i = x * bw + (j & 1); i < (x + 1) * bw; i += 2)
+            {
+              guint left, right, up, down;
+
+              left = row[(i + width - 1) % width];
+              right = row[(i + 1) % width];
+              up = above[i];
+              down = below[i];
+
+              if (mode == 1)
+                row[i] = (left + right + up + down + 2) / 4;
+              else if (mode == 2)
+                row[i] = (left + right + 1) / 2;
+              else
+                row[i] = (up + down + 1) / 2;
+            }
+        }
+    }
+}
+
+static void
+pvrtc_decode_row (PvrtcImage       *image,
+                  const PvrSurface *surface,
+                  guint             y)
+{
+  const guint8 *top, *bottom, *modulation;
+  guint bw, half, u, x, wy, scale;
+  guchar *dest;
+
+  /* blend the two rows of block colours this row of pixels sits between */
+  u = y + image->height - 2;
+  wy = u % 4;
+  top = pvrtc_get_colour_row (image, (u / 4) % image->blocks_y);
+  bottom = pvrtc_get_colour_row (image, (u / 4 + 1) % image->blocks_y);
+
+  for (x = 0; x < image->blocks_x * 4; x++)
+    {
+      image->row_a[x] = top[(x / 4) * 8 + x % 4] * (4 - wy) +
+                        bottom[(x / 4) * 8 + x % 4] * wy;
+      image->row_b[x] = top[(x / 4) * 8 + 4 + x % 4] * (4 - wy) +
+                        bottom[(x / 4) * 8 + 4 + x % 4] * wy;
+    }
+
+  bw = image->block_width;
+  half = bw / 2;
+  scale = 4 * bw * 8;
+  modulation = image->modulation + (y % 4 + 1) * image->width;
+  dest = surface->pixels + (gssize) y * surface->rowstride;
+
+  for (x = 0; x < surface->width; x++)
+    {
+      const gint *a0, *a1, *b0, *b1;
+      guint bx0, bx1, wx, m, c;
+
+      u = x + image->width - half;
+      wx = u % bw;
+      bx0 = (u / bw) % image->blocks_x;
+      bx1 = (bx0 + 1) % image->blocks_x;
+
+      a0 = image->row_a + bx0 * 4;
+      a1 = image->row_a + bx1 * 4;
+      b0 = image->row_b + bx0 * 4;
+      b1 = image->row_b + bx1 * 4;
+
+      m = modulation[x] & MODULATION_WEIGHT_MASK;
+
+      for (c = 0; c < 4; c++)
+        {
+          guint a, b;
+
+          a = a0[c] * (bw - wx) + a1[c] * wx;
+          b = b0[c] * (bw - wx) + b1[c] * wx;
+
+          dest[c] = (a * (8 - m) + b * m + scale / 2) / scale;
+        }
+
+      if (modulation[x] & MODULATION_PUNCH_THROUGH)
+        dest[3] = 0;
+
+      dest += 4;
+    }
+
+  pvr_surface_finish_row (surface,
+                          surface->pixels + (gssize) y * surface->rowstride);
+}
+
+static void
+pvrtc_decode (const guchar     *data,
+              const PvrSurface *surface,
+              guint             first_row,
+              guint             n_rows,
+              guint             bpp)
+{
+  PvrtcImage image;
+  guint by, y;
+
+  image.data = data;
+  image.bpp = bpp;
+  image.block_width = bpp == 2 ? 8 : 4;
+  image.blocks_x = MAX (2, (surface->width + image.block_width - 1) /
+                           image.block_width);
+  image.blocks_y = MAX (2, (surface->height + 3) / 4);
+  image.width = image.blocks_x * image.block_width;
+  image.height = image.blocks_y * 4;
+
+  image.colours[0] = g_new (guint8, image.blocks_x * 8 * 2);
+  image.colours[1] = image.colours[0] + image.blocks_x * 8;
+  image.colours_row[0] = image.colours_row[1] = G_MAXUINT;
+  image.modulation = g_new (guint8, image.width * 6);
+  image.modes = g_new (guint8, image.blocks_x);
+  image.row_a = g_new (gint, image.blocks_x * 4 * 2);
+  image.row_b = image.row_a + image.blocks_x * 4;
+
+  for (by = first_row; by < first_row + n_rows; by++)
+    {
+      pvrtc_unpack_band_modulation (&image, by);
+
+      for (y = by * 4; y < MIN ((by + 1) * 4, surface->height); y++)
+        pvrtc_decode_row (&image, surface, y);
+    }
+
+  g_free (image.colours[0]);
+  g_free (image.modulation);
+  g_free (image.modes);
+  g_free (image.row_a);
+}
+
+void
+pvr_pvrtc2_decode (const guchar     *data,
+                   const PvrSurface *surface,
+                   guint             first_row,
+                   guint             n_rows)
+{
+  pvrtc_decode (data, surface, first_row, n_rows, 2);
+}
+
+void
+pvr_pvrtc4_decode (const guchar     *data,
+                   const PvrSurface *surface,
+                   guint             first_row,
+                   guint             n_rows)
+{
+  pvrtc_decode (data, surface, first_row, n_rows, 4);
+}
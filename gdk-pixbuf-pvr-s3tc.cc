@@ -0,0 +1,376 @@
+/*
+ * gdk-pixbuf-texture-tool - Manipulate texture files
+ *
+ * Copyright (C) 2011 Intel Corporation.
+ *
+ * This software is licensed under the BSD 3-Clause license. See the COPYING
+ * file for the full text of the license.
+ *
+ */
+
+/*
+ * S3TC (DXT1 to DXT5, DX10 BC1 to BC3) block decoders.
+ *
+ * All three formats share the same 64 bits colour block: two RGB 565 end
+ * points followed by 2 bits per pixel indexes into a 4 entries palette
+ * interpolated from them. BC2 prepends 4 bits of explicit alpha per pixel,
+ * BC3 two alpha end points and 3 bits per pixel indexes into a 8 entries
+ * palette. DXT2 and DXT4 are the premultiplied versions of DXT3 and DXT5.
+ */
+
+#include "gdk-pixbuf-pvr-codecs.h"
+
+typedef enum
+{
+  S3TC_BC1,
+  S3TC_BC2,
+  S3TC_BC3,
+} S3tcType;
+
+static inline guint
+read_le16 (const guint8 *data)
+{
+  return data[0] | (data[1] << 8);
+}
+
+static inline guint32
+read_le32 (const guint8 *data)
+{
+  return data[0] | (data[1] << 8) | (data[2] << 16) |
+         ((guint32) data[3] << 24);
+}
+
+static inline void
+unpack_565 (guint    colour,
+            guint16 *rgb)
+{
+  guint r, g, b;
+
+  r = (colour >> 11) & 0x1f;
+  g = (colour >> 5) & 0x3f;
+  b = colour & 0x1f;
+
+  rgb[0] = (r << 3) | (r >> 2);
+  rgb[1] = (g << 2) | (g >> 4);
+  rgb[2] = (b << 3) | (b >> 2);
+  rgb[3] = 0xff;
+}
+
+#ifdef __SSE2__
+
+/*
+ * Decode the colour block at data into the 4x4 RGBA block. If alpha is not
+ * NULL it holds the alpha of the 16 pixels and replaces the one coming from
+ * the colour block.
+ */
+static void
+s3tc_decode_colours (const guint8 *data,
+                     gboolean      four_colours,
+                     const guint8 *alpha,
+                     guint8       *block)
+{
+  guint16 e[8];
+  __m128i ends, c0, c1, c2, c3, zero, one, two, three;
+  guint32 indexes;
+  guint c0_raw, c1_raw, y;
+
+  c0_raw = read_le16 (data);
+  c1_raw = read_le16 (data + 2);
+  indexes = read_le32 (data + 4);
+
+  unpack_565 (c0_raw, e);
+  unpack_565 (c1_raw, e + 4);
+  ends = _mm_loadu_si128 ((const __m128i *) e);
+  zero = _mm_setzero_si128 ();
+
+  /* c0 and c1 in the low 64 bits of each register, 16 bits per channel */
+  c0 = ends;
+  c1 = _mm_unpackhi_epi64 (ends, ends);
+
+  if (four_colours || c0_raw > c1_raw)
+    {
+      __m128i third;
+
+      /* (2 * c0 + c1 + 1) / 3 and (c0 + 2 * c1 + 1) / 3, the multiply by
+       * 21846 >> 16 being an exact division by 3 for our range */
+      third = _mm_set1_epi16 (21846);
+      c2 = _mm_add_epi16 (_mm_add_epi16 (c0, c0), c1);
+      c3 = _mm_add_epi16 (_mm_add_epi16 (c1, c1), c0);
+      c2 = _mm_mulhi_epu16 (_mm_add_epi16 (c2, _mm_set1_epi16 (1)), third);
+      c3 = _mm_mulhi_epu16 (_mm_add_epi16 (c3, _mm_set1_epi16 (1)), third);
+    }
+  else
+    {
+      /* (c0 + c1) / 2 and transparent black */
+      c2 = _mm_srli_epi16 (_mm_add_epi16 (c0, c1), 1);
+      c3 = zero;
+    }
+
+  /* pack to 8 bits and broadcast each colour to a full register */
+  c0 = _mm_shuffle_epi32 (_mm_packus_epi16 (c0, zero), 0);
+  c1 = _mm_shuffle_epi32 (_mm_packus_epi16 (c1, zero), 0);
+  c2 = _mm_shuffle_epi32 (_mm_packus_epi16 (c2, zero), 0);
+  c3 = _mm_shuffle_epi32 (_mm_packus_epi16 (c3, zero), 0);
+
+  one = _mm_set1_epi32 (1);
+  two = _mm_set1_epi32 (2);
+  three = _mm_set1_epi32 (3);
+
+  for (y = 0; y < 4; y++, indexes >>= 8)
+    {
+      __m128i idx, row;
+
+      idx = _mm_set_epi32 ((indexes >> 6) & 0x3, (indexes >> 4) & 0x3,
+                           (indexes >> 2) & 0x3, indexes & 0x3);
+
+      row = _mm_and_si128 (_mm_cmpeq_epi32 (idx, zero), c0);
+      row = _mm_or_si128 (row,
+                          _mm_and_si128 (_mm_cmpeq_epi32 (idx, one), c1));
+      row = _mm_or_si128 (row,
+                          _mm_and_si128 (_mm_cmpeq_epi32 (idx, two), c2));
+      row = _mm_or_si128 (row,
+                          _mm_and_si128 (_mm_cmpeq_epi32 (idx, three), c3));
+
+      if (alpha)
+        {
+          __m128i a;
+
+          a = _mm_set_epi32 (alpha[3], alpha[2], alpha[1], alpha[0]);
+          row = _mm_and_si128 (row, _mm_set1_epi32 (0x00ffffff));
+          row = _mm_or_si128 (row, _mm_slli_epi32 (a, 24));
+          alpha += 4;
+        }
+
+      _mm_storeu_si128 ((__m128i *) (block + y * 16), row);
+    }
+}
+
+#else
+
+static void
+s3tc_decode_colours (const guint8 *data,
+                     gboolean      four_colours,
+                     const guint8 *alpha,
+                     guint8       *block)
+{
+  guint16 e[8];
+  guint8 palette[4][4];
+  guint32 indexes;
+  guint c0_raw, c1_raw, c, i;
+
+  c0_raw = read_le16 (data);
+  c1_raw = read_le16 (data + 2);
+  indexes = read_le32 (data + 4);
+
+  unpack_565 (c0_raw, e);
+  unpack_565 (c1_raw, e + 4);
+
+  for (c = 0; c < 4; c++)
+    {
+      palette[0][c] = e[c];
+      palette[1][c] = e[4 + c];
+
+      if (four_colours || c0_raw > c1_raw)
+        {
+          palette[2][c] = (2 * e[c] + e[4 + c] + 1) / 3;
+          palette[3][c] = (e[c] + 2 * e[4 + c] + 1) / 3;
+        }
+      else
+        {
+          palette[2][c] = (e[c] + e[4 + c]) / 2;
+          palette[3][c] = 0;
+        }
+    }
+
+  for (i = 0; i < 16; i++, indexes >>= 2)
+    {
+      memcpy (block + i * 4, palette[indexes & 0x3], 4);
+      if (alpha)
+        block[i * 4 + 3] = alpha[i];
+    }
+}
+
+#endif
+
+static void
+s3tc_decode_explicit_alpha (const guint8 *data,
+                            guint8       *alpha)
+{
+  guint i;
+
+  for (i = 0; i < 8; i++)
+    {
+      alpha[i * 2] = (data[i] & 0xf) * 17;
+      alpha[i * 2 + 1] = (data[i] >> 4) * 17;
+    }
+}
+
+static void
+s3tc_decode_interpolated_alpha (const guint8 *data,
+                                guint8       *alpha)
+{
+  guint8 palette[8];
+  guint64 indexes;
+  guint a0, a1, i;
+
+  a0 = data[0];
+  a1 = data[1];
+
+  palette[0] = a0;
+  palette[1] = a1;
+  if (a0 > a1)
+    {
+      for (i = 1; i < 7; i++)
+        palette[i + 1] = ((7 - i) * a0 + i * a1 + 3) / 7;
+    }
+  else
+    {
+      for (i = 1; i < 5; i++)
+        palette[i + 1] = ((5 - i) * a0 + i * a1 + 2) / 5;
+      palette[6] = 0;
+      palette[7] = 0xff;
+    }
+
+  indexes = read_le16 (data + 2) | ((guint64) read_le32 (data + 4) << 16);
+  for (i = 0; i < 16; i++, indexes >>= 3)
+    alpha[i] = palette[indexes & 0x7];
+}
+
+static void
+s3tc_unpremultiply (guint8 *block)
+{
+  guint i;
+
+  for (i = 0; i < 16; i++, block += 4)
+    {
+      guint a = block[3];
+
+      if (a == 0 || a == 0xff)
+        continue;
+
+      block[0] = MIN (255, (block[0] * 255 + a / 2) / a);
+      block[1] = MIN (255, (block[1] * 255 + a / 2) / a);
+      block[2] = MIN (255, (block[2] * 255 + a / 2) / a);
+    }
+}
+
+/* already premultiplied pixels only need their red and blue swapped */
+static void
+s3tc_swap_red_blue (guint8 *block)
+{
+  guint i;
+
+  for (i = 0; i < 16; i++, block += 4)
+    {
+      guint8 r = block[0];
+
+      block[0] = block[2];
+      block[2] = r;
+    }
+}
+
+/*
+ * DXT2 and DXT4 decoded to a premultiplied BGRA surface skip the round trip
+ * through straight alpha, the blocks are stored as they are once swizzled.
+ */
+static void
+s3tc_decode (const guchar     *data,
+             const PvrSurface *surface,
+             guint             first_row,
+             guint             n_rows,
+             S3tcType          type,
+             gboolean          premultiplied)
+{
+  const PvrSurface *dest = surface;
+  PvrSurface raw;
+  guint blocks_x, block_size, bx, by;
+  guint8 block[16 * 4], alpha[16];
+  gboolean keep_premultiplied;
+
+  keep_premultiplied = premultiplied &&
+                       surface->layout == PVR_SURFACE_BGRA_PREMULTIPLIED;
+  if (keep_premultiplied)
+    {
+      raw = *surface;
+      raw.layout = PVR_SURFACE_RGBA;
+      dest = &raw;
+    }
+
+  block_size = type == S3TC_BC1 ? 8 : 16;
+  blocks_x = (surface->width + 3) / 4;
+  data += (gsize) first_row * blocks_x * block_size;
+
+  for (by = first_row; by < first_row + n_rows; by++)
+    {
+      for (bx = 0; bx < blocks_x; bx++)
+        {
+          switch (type)
+            {
+            case S3TC_BC1:
+              s3tc_decode_colours (data, FALSE, NULL, block);
+              break;
+            case S3TC_BC2:
+              s3tc_decode_explicit_alpha (data, alpha);
+              s3tc_decode_colours (data + 8, TRUE, alpha, block);
+              break;
+            case S3TC_BC3:
+              s3tc_decode_interpolated_alpha (data, alpha);
+              s3tc_decode_colours (data + 8, TRUE, alpha, block);
+              break;
+            }
+
+          if (keep_premultiplied)
+            s3tc_swap_red_blue (block);
+          else if (premultiplied)
+            s3tc_unpremultiply (block);
+
+          pvr_surface_store_4x4 (dest, bx * 4, by * 4, block);
+          data += block_size;
+        }
+    }
+}
+
+void
+pvr_bc1_decode (const guchar     *data,
+                const PvrSurface *surface,
+                guint             first_row,
+                guint             n_rows)
+{
+  s3tc_decode (data, surface, first_row, n_rows, S3TC_BC1, FALSE);
+}
+
+void
+pvr_bc2_decode (const guchar     *data,
+                const PvrSurface *surface,
+                guint             first_row,
+                guint             n_rows)
+{
+  s3tc_decode (data, surface, first_row, n_rows, S3TC_BC2, FALSE);
+}
+
+void
+pvr_bc3_decode (const guchar     *data,
+                const PvrSurface *surface,
+                guint             first_row,
+                guint             n_rows)
+{
+  s3tc_decode (data, surface, first_row, n_rows, S3TC_BC3, FALSE);
+}
+
+void
+pvr_dxt2_decode (const guchar     *data,
+                 const PvrSurface *surface,
+                 guint             first_row,
+                 guint             n_rows)
+{
+  s3tc_decode (data, surface, first_row, n_rows, S3TC_BC2, TRUE);
+}
+
+void
+pvr_dxt4_decode (const guchar     *data,
+                 const PvrSurface *surface,
+                 guint             first_row,
+                 guint             n_rows)
+{
+  s3tc_decode (data, surface, first_row, n_rows, S3TC_BC3, TRUE);
+}
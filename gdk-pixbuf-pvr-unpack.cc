@@ -0,0 +1,624 @@
+/*
+ * gdk-pixbuf-texture-tool - Manipulate texture files
+ *
+ * Copyright (C) 2011 Intel Corporation.
+ *
+ * This software is licensed under the BSD 3-Clause license. See the COPYING
+ * file for the full text of the license.
+ *
+ */
+
+/*
+ * Unpackers and packers for the uncompressed pixel types.
+ *
+ * Each layout is described by the size of a pixel and the position/width of
+ * its channels inside a little endian word. The unpack kernel is a template
+ * on that description so every layout gets its own instantiation with all
+ * the shifts and masks known at compile time. 16 and 32 bits layouts are
+ * converted 8 and 4 pixels at a time with SSE2.
+ *
+ * A channel with a width of 0 is not present in the layout and reads as 0
+ * for colours and as opaque for alpha. Luminance layouts use the same bits
+ * for red, green and blue.
+ *
+ * Layouts that already are RGBA 8888 (or RGB 888) in memory are just copied.
+ *
+ * Layouts without alpha are decoded to RGB: the rows are unpacked to RGBA
+ * in a scratch row first so the same SSE2 code is used, and repacked.
+ *
+ * For premultiplied BGRA surfaces each row is converted right after being
+ * unpacked. The premultiplied layouts skip the round trip through straight
+ * alpha and only get their red and blue swapped.
+ *
+ * Packing goes the other way: each channel is rounded to its width and
+ * shifted in place, 8 RGBA pixels at a time with SSE2 for 16 bits layouts.
+ * Luminance layouts store the Rec. 601 luma of the pixel.
+ */
+
+#include "gdk-pixbuf-pvr-codecs.h"
+
+typedef enum
+{
+  UNPACK_PREMULTIPLIED = 1 << 0,
+} UnpackFlags;
+
+/* replicate the Bits wide value x to fill 8 bits */
+template <guint Bits>
+static inline guint
+expand (guint x)
+{
+  guint v = 0;
+  gint shift;
+
+  if (Bits == 0)
+    return 0;
+
+  for (shift = 8 - (gint) Bits; shift > -(gint) Bits; shift -= Bits)
+    v |= shift >= 0 ? x << shift : x >> -shift;
+
+  return v & 0xff;
+}
+
+template <guint Shift, guint Bits>
+static inline guint
+extract (guint32 word)
+{
+  if (Bits == 0)
+    return 0;
+
+  return expand<Bits> ((word >> Shift) & ((1u << Bits) - 1));
+}
+
+static inline void
+unpremultiply (guint8 *pixel)
+{
+  guint a = pixel[3];
+
+  if (a == 0 || a == 0xff)
+    return;
+
+  pixel[0] = MIN (255, (pixel[0] * 255 + a / 2) / a);
+  pixel[1] = MIN (255, (pixel[1] * 255 + a / 2) / a);
+  pixel[2] = MIN (255, (pixel[2] * 255 + a / 2) / a);
+}
+
+static inline void
+swap_red_blue (guint8 *pixel)
+{
+  guint8 r = pixel[0];
+
+  pixel[0] = pixel[2];
+  pixel[2] = r;
+}
+
+/* round the 8 bits value x to Bits bits, (t + (t >> 8)) >> 8 being an exact
+ * rounded division by 255 for our range */
+template <guint Bits>
+static inline guint
+quantize (guint x)
+{
+  guint t;
+
+  if (Bits == 0)
+    return 0;
+
+  t = x * ((1u << Bits) - 1) + 128;
+
+  return (t + (t >> 8)) >> 8;
+}
+
+#ifdef __SSE2__
+
+template <guint Bits>
+static inline __m128i
+expand_epi16 (__m128i x)
+{
+  __m128i v = _mm_setzero_si128 ();
+  gint shift;
+
+  for (shift = 8 - (gint) Bits; shift > -(gint) Bits; shift -= Bits)
+    {
+      if (shift >= 0)
+        v = _mm_or_si128 (v, _mm_slli_epi16 (x, shift));
+      else
+        v = _mm_or_si128 (v, _mm_srli_epi16 (x, -shift));
+    }
+
+  return _mm_and_si128 (v, _mm_set1_epi16 (0xff));
+}
+
+template <guint Shift, guint Bits>
+static inline __m128i
+extract_epi16 (__m128i words)
+{
+  if (Bits == 0)
+    return _mm_setzero_si128 ();
+
+  words = _mm_and_si128 (_mm_srli_epi16 (words, Shift),
+                         _mm_set1_epi16 ((1u << Bits) - 1));
+
+  return expand_epi16<Bits> (words);
+}
+
+template <guint Shift, guint Bits>
+static inline __m128i
+extract_epi32 (__m128i words)
+{
+  if (Bits == 0)
+    return _mm_setzero_si128 ();
+
+  return _mm_and_si128 (_mm_srli_epi32 (words, Shift), _mm_set1_epi32 (0xff));
+}
+
+/* 8 bits values in 16 bits lanes, see quantize() */
+template <guint Bits>
+static inline __m128i
+quantize_epi16 (__m128i x)
+{
+  __m128i t;
+
+  if (Bits == 0)
+    return _mm_setzero_si128 ();
+
+  t = _mm_mullo_epi16 (x, _mm_set1_epi16 ((1u << Bits) - 1));
+  t = _mm_add_epi16 (t, _mm_set1_epi16 (128));
+
+  return _mm_srli_epi16 (_mm_add_epi16 (t, _mm_srli_epi16 (t, 8)), 8);
+}
+
+#endif
+
+template <guint Bpp,
+          guint RS, guint RB, guint GS, guint GB,
+          guint BS, guint BB, guint AS, guint AB,
+          guint Flags>
+static void
+unpack_row (const guint8     *src,
+            guint8           *dest,
+            guint             width,
+            PvrSurfaceLayout  layout)
+{
+  guint x = 0;
+
+#ifdef __SSE2__
+  if (Bpp == 2)
+    {
+      for (; x + 8 <= width; x += 8, src += 16, dest += 32)
+        {
+          __m128i words, r, g, b, a, rg, ba;
+
+          words = _mm_loadu_si128 ((const __m128i *) src);
+          r = extract_epi16<RS, RB> (words);
+          g = extract_epi16<GS, GB> (words);
+          b = extract_epi16<BS, BB> (words);
+          if (AB)
+            a = extract_epi16<AS, AB> (words);
+          else
+            a = _mm_set1_epi16 (0xff);
+
+          rg = _mm_or_si128 (r, _mm_slli_epi16 (g, 8));
+          ba = _mm_or_si128 (b, _mm_slli_epi16 (a, 8));
+
+          _mm_storeu_si128 ((__m128i *) dest, _mm_unpacklo_epi16 (rg, ba));
+          _mm_storeu_si128 ((__m128i *) (dest + 16),
+                            _mm_unpackhi_epi16 (rg, ba));
+        }
+    }
+  else if (Bpp == 4 && (RB == 0 || RB == 8) && (GB == 0 || GB == 8) &&
+           (BB == 0 || BB == 8) && (AB == 0 || AB == 8))
+    {
+      for (; x + 4 <= width; x += 4, src += 16, dest += 16)
+        {
+          __m128i words, pixels;
+
+          words = _mm_loadu_si128 ((const __m128i *) src);
+          pixels = extract_epi32<RS, RB> (words);
+          pixels = _mm_or_si128 (pixels,
+                                 _mm_slli_epi32 (extract_epi32<GS, GB> (words),
+                                                 8));
+          pixels = _mm_or_si128 (pixels,
+                                 _mm_slli_epi32 (extract_epi32<BS, BB> (words),
+                                                 16));
+          if (AB)
+            pixels = _mm_or_si128 (pixels,
+                                   _mm_slli_epi32 (extract_epi32<AS, AB> (words),
+                                                   24));
+          else
+            pixels = _mm_or_si128 (pixels, _mm_set1_epi32 (0xff000000));
+
+          _mm_storeu_si128 ((__m128i *) dest, pixels);
+        }
+    }
+#endif
+
+  for (; x < width; x++, src += Bpp, dest += 4)
+    {
+      guint32 word;
+      guint i;
+
+      word = 0;
+      for (i = 0; i < Bpp; i++)
+        word |= (guint32) src[i] << (i * 8);
+
+      dest[0] = extract<RS, RB> (word);
+      dest[1] = extract<GS, GB> (word);
+      dest[2] = extract<BS, BB> (word);
+      dest[3] = AB ? extract<AS, AB> (word) : 0xff;
+    }
+
+  dest -= width * 4;
+
+  if (layout == PVR_SURFACE_BGRA_PREMULTIPLIED)
+    {
+      if (Flags & UNPACK_PREMULTIPLIED)
+        {
+          for (x = 0; x < width; x++, dest += 4)
+            swap_red_blue (dest);
+        }
+      else
+        {
+          pvr_premultiply_bgra (dest, dest, width);
+        }
+    }
+  else if (Flags & UNPACK_PREMULTIPLIED)
+    {
+      for (x = 0; x < width; x++, dest += 4)
+        unpremultiply (dest);
+    }
+}
+
+template <guint Bpp,
+          guint RS, guint RB, guint GS, guint GB,
+          guint BS, guint BB, guint AS, guint AB,
+          guint Flags>
+static void
+unpack (const guchar     *data,
+        const PvrSurface *surface,
+        guint             first_row,
+        guint             n_rows)
+{
+  guint8 *scratch = NULL;
+  gsize src_stride;
+  guint y;
+
+  src_stride = (gsize) surface->width * Bpp;
+  data += first_row * src_stride;
+
+  if (surface->n_channels == 3)
+    scratch = g_new (guint8, (gsize) surface->width * 4);
+
+  for (y = first_row; y < first_row + n_rows; y++, data += src_stride)
+    {
+      guchar *dest = surface->pixels + (gssize) y * surface->rowstride;
+
+      if (scratch)
+        {
+          unpack_row<Bpp, RS, RB, GS, GB, BS, BB, AS, AB, Flags>
+            (data, scratch, surface->width, surface->layout);
+          pvr_rgba_to_rgb (scratch, dest, surface->width);
+        }
+      else
+        {
+          unpack_row<Bpp, RS, RB, GS, GB, BS, BB, AS, AB, Flags>
+            (data, dest, surface->width, surface->layout);
+        }
+    }
+
+  g_free (scratch);
+}
+
+template <guint Bpp,
+          guint RS, guint RB, guint GS, guint GB,
+          guint BS, guint BB, guint AS, guint AB,
+          guint Flags>
+static void
+pack_row (const guint8 *src,
+          guint         n_channels,
+          guint8       *dest,
+          guint         width)
+{
+  const gboolean luminance = RB && RS == GS && RS == BS && RB == GB &&
+                             RB == BB;
+  guint x = 0;
+
+#ifdef __SSE2__
+  if (Bpp == 2 && n_channels == 4 && !luminance &&
+      !(Flags & UNPACK_PREMULTIPLIED))
+    {
+      const __m128i mask = _mm_set1_epi32 (0xff);
+
+      for (; x + 8 <= width; x += 8, src += 32, dest += 16)
+        {
+          __m128i p0, p1, r, g, b, a, words;
+
+          p0 = _mm_loadu_si128 ((const __m128i *) src);
+          p1 = _mm_loadu_si128 ((const __m128i *) (src + 16));
+
+          /* one channel of the 8 pixels per register, 16 bits per lane */
+          r = _mm_packs_epi32 (_mm_and_si128 (p0, mask),
+                               _mm_and_si128 (p1, mask));
+          g = _mm_packs_epi32 (_mm_and_si128 (_mm_srli_epi32 (p0, 8), mask),
+                               _mm_and_si128 (_mm_srli_epi32 (p1, 8), mask));
+          b = _mm_packs_epi32 (_mm_and_si128 (_mm_srli_epi32 (p0, 16), mask),
+                               _mm_and_si128 (_mm_srli_epi32 (p1, 16), mask));
+          a = _mm_packs_epi32 (_mm_srli_epi32 (p0, 24),
+                               _mm_srli_epi32 (p1, 24));
+
+          words = _mm_slli_epi16 (quantize_epi16<RB> (r), RS);
+          words = _mm_or_si128 (words,
+                                _mm_slli_epi16 (quantize_epi16<GB> (g), GS));
+          words = _mm_or_si128 (words,
+                                _mm_slli_epi16 (quantize_epi16<BB> (b), BS));
+          if (AB)
+            words = _mm_or_si128 (words,
+                                  _mm_slli_epi16 (quantize_epi16<AB> (a),
+                                                  AS));
+
+          _mm_storeu_si128 ((__m128i *) dest, words);
+        }
+    }
+#endif
+
+  for (; x < width; x++, src += n_channels, dest += Bpp)
+    {
+      guint32 word;
+      guint r, g, b, a, i;
+
+      r = src[0];
+      g = src[1];
+      b = src[2];
+      a = n_channels == 4 ? src[3] : 0xff;
+
+      if (Flags & UNPACK_PREMULTIPLIED)
+        {
+          r = (r * a + 127) / 255;
+          g = (g * a + 127) / 255;
+          b = (b * a + 127) / 255;
+        }
+
+      if (luminance)
+        r = g = b = (r * 77 + g * 150 + b * 29 + 128) >> 8;
+
+      word = quantize<RB> (r) << RS | quantize<GB> (g) << GS |
+             quantize<BB> (b) << BS;
+      if (AB)
+        word |= quantize<AB> (a) << AS;
+
+      for (i = 0; i < Bpp; i++)
+        dest[i] = word >> (i * 8);
+    }
+}
+
+template <guint Bpp,
+          guint RS, guint RB, guint GS, guint GB,
+          guint BS, guint BB, guint AS, guint AB,
+          guint Flags>
+static void
+pack (const PvrSurface *image,
+      guchar           *data,
+      guint             first_row,
+      guint             n_rows,
+      const guint8     *dirty,
+      PvrQuality        quality)
+{
+  gsize dest_stride;
+  guint x, y;
+
+  dest_stride = (gsize) image->width * Bpp;
+  data += first_row * dest_stride;
+
+  for (y = first_row; y < first_row + n_rows; y++, data += dest_stride)
+    {
+      const guint8 *src = image->pixels + (gssize) y * image->rowstride;
+
+      if (dirty == NULL)
+        {
+          pack_row<Bpp, RS, RB, GS, GB, BS, BB, AS, AB, Flags>
+            (src, image->n_channels, data, image->width);
+          continue;
+        }
+
+      /* a block is a pixel here */
+      for (x = 0; x < image->width; x++)
+        {
+          if (dirty[(gsize) y * image->width + x])
+            pack_row<Bpp, RS, RB, GS, GB, BS, BB, AS, AB, Flags>
+              (src + x * image->n_channels, image->n_channels,
+               data + x * Bpp, 1);
+        }
+    }
+}
+
+/* the layout already is what GdkPixbuf wants */
+template <guint Bpp>
+static void
+copy (const guchar     *data,
+      const PvrSurface *surface,
+      guint             first_row,
+      guint             n_rows)
+{
+  gsize src_stride;
+  guint x, y;
+
+  src_stride = (gsize) surface->width * Bpp;
+  data += first_row * src_stride;
+
+  for (y = first_row; y < first_row + n_rows; y++, data += src_stride)
+    {
+      guchar *dest = surface->pixels + (gssize) y * surface->rowstride;
+
+      if (surface->layout == PVR_SURFACE_RGBA)
+        {
+          memcpy (dest, data, src_stride);
+        }
+      else if (Bpp == 4)
+        {
+          pvr_premultiply_bgra (data, dest, surface->width);
+        }
+      else
+        {
+          for (x = 0; x < surface->width; x++, dest += 4)
+            {
+              dest[0] = data[x * 3 + 2];
+              dest[1] = data[x * 3 + 1];
+              dest[2] = data[x * 3];
+              dest[3] = 0xff;
+            }
+        }
+    }
+}
+
+/*
+ * Uncompressed levels flagged PVR_FLAG_TWIDDLE have their pixels in Morton
+ * order, like the blocks of PVRTC: the bits of x and y are interleaved up to
+ * the smaller dimension, the remaining bits of the bigger one come on top.
+ * The two halves of the index don't depend on each other so they are
+ * computed once per column and once per row. Returns the level in rows, or
+ * NULL if we are out of memory.
+ */
+guchar *
+pvr_unpack_untwiddle (const PvrFormatInfo *info,
+                      const guchar        *data,
+                      guint                width,
+                      guint                height)
+{
+  guchar *linear, *dest;
+  gsize *columns, *rows;
+  guint min_dimension, shift, bit, x, y;
+
+  linear = (guchar *) g_try_malloc ((gsize) width * height * info->block_size);
+  if (linear == NULL)
+    return NULL;
+
+  min_dimension = MIN (width, height);
+  for (shift = 0; (1u << shift) < min_dimension; shift++)
+    ;
+
+  columns = g_new0 (gsize, width);
+  for (x = 0; x < width; x++)
+    {
+      for (bit = 0; bit < shift; bit++)
+        columns[x] |= (gsize) ((x >> bit) & 1) << (2 * bit + 1);
+      if (width > height)
+        columns[x] |= (gsize) (x >> shift) << (2 * shift);
+    }
+
+  rows = g_new0 (gsize, height);
+  for (y = 0; y < height; y++)
+    {
+      for (bit = 0; bit < shift; bit++)
+        rows[y] |= (gsize) ((y >> bit) & 1) << (2 * bit);
+      if (height > width)
+        rows[y] |= (gsize) (y >> shift) << (2 * shift);
+    }
+
+  dest = linear;
+  for (y = 0; y < height; y++)
+    {
+      for (x = 0; x < width; x++, dest += info->block_size)
+        memcpy (dest, data + (columns[x] | rows[y]) * info->block_size,
+                info->block_size);
+    }
+
+  g_free (columns);
+  g_free (rows);
+
+  return linear;
+}
+
+/*
+ * PACKED (pixel type, bytes per pixel, shift and width of R, G, B and A,
+ *         unpack flags, format flags)
+ *
+ * Layouts with no alpha bits are flagged PVR_FORMAT_OPAQUE.
+ */
+#define PACKED(type, bpp, rs, rb, gs, gb, bs, bb, as, ab, uflags, flags)    \
+  { type, 1, 1, bpp, 1, 1, (flags) | ((ab) ? 0 : PVR_FORMAT_OPAQUE),      \
+    unpack<bpp, rs, rb, gs, gb, bs, bb, as, ab, uflags>,                  \
+    pack<bpp, rs, rb, gs, gb, bs, bb, as, ab, uflags> }
+#define COPY(type, bpp, flags)                                            \
+  { type, 1, 1, bpp, 1, 1, (flags) | PVR_FORMAT_PIXBUF_LAYOUT, copy<bpp> }
+
+#define PRE   UNPACK_PREMULTIPLIED
+#define SRGB  PVR_FORMAT_SRGB
+#define LIN   PVR_FORMAT_LINEAR
+#define RGB   PVR_FORMAT_OPAQUE
+
+const PvrFormatInfo pvr_unpack_formats[] =
+{
+  /* MGL pixel types are D3D like, ie. packed in little endian words */
+  PACKED (PVR_MGLPT_ARGB_4444, 2, 8, 4, 4, 4, 0, 4, 12, 4, 0, 0),
+  PACKED (PVR_MGLPT_ARGB_1555, 2, 10, 5, 5, 5, 0, 5, 15, 1, 0, 0),
+  PACKED (PVR_MGLPT_RGB_565, 2, 11, 5, 5, 6, 0, 5, 0, 0, 0, 0),
+  PACKED (PVR_MGLPT_RGB_555, 2, 10, 5, 5, 5, 0, 5, 0, 0, 0, 0),
+  PACKED (PVR_MGLPT_RGB_888, 3, 16, 8, 8, 8, 0, 8, 0, 0, 0, 0),
+  PACKED (PVR_MGLPT_ARGB_8888, 4, 16, 8, 8, 8, 0, 8, 24, 8, 0, 0),
+  PACKED (PVR_MGLPT_ARGB_8332, 2, 5, 3, 2, 3, 0, 2, 8, 8, 0, 0),
+  PACKED (PVR_MGLPT_I_8, 1, 0, 8, 0, 8, 0, 8, 0, 0, 0, 0),
+  PACKED (PVR_MGLPT_AI_88, 2, 0, 8, 0, 8, 0, 8, 8, 8, 0, 0),
+
+  /* OpenGL pixel types, the 16 bits ones are packed in a short */
+  PACKED (PVR_OGL_RGBA_4444, 2, 12, 4, 8, 4, 4, 4, 0, 4, 0, 0),
+  PACKED (PVR_OGL_RGBA_5551, 2, 11, 5, 6, 5, 1, 5, 0, 1, 0, 0),
+  COPY   (PVR_OGL_RGBA_8888, 4, 0),
+  PACKED (PVR_OGL_RGB_565, 2, 11, 5, 5, 6, 0, 5, 0, 0, 0, 0),
+  PACKED (PVR_OGL_RGB_555, 2, 10, 5, 5, 5, 0, 5, 0, 0, 0, 0),
+  COPY   (PVR_OGL_RGB_888, 3, RGB),
+  PACKED (PVR_OGL_I_8, 1, 0, 8, 0, 8, 0, 8, 0, 0, 0, 0),
+  PACKED (PVR_OGL_AI_88, 2, 0, 8, 0, 8, 0, 8, 8, 8, 0, 0),
+  PACKED (PVR_OGL_BGRA_8888, 4, 16, 8, 8, 8, 0, 8, 24, 8, 0, 0),
+  PACKED (PVR_OGL_A_8, 1, 0, 0, 0, 0, 0, 0, 0, 8, 0, 0),
+
+  PACKED (PVR_D3D_A8, 1, 0, 0, 0, 0, 0, 0, 0, 8, 0, 0),
+  PACKED (PVR_D3D_L8, 1, 0, 8, 0, 8, 0, 8, 0, 0, 0, 0),
+  PACKED (PVR_D3D_AL_88, 2, 0, 8, 0, 8, 0, 8, 8, 8, 0, 0),
+
+  COPY   (PVR_DX10_R8G8B8A8_UNORM, 4, 0),
+  COPY   (PVR_DX10_R8G8B8A8_UNORM_SRGB, 4, SRGB),
+  PACKED (PVR_DX10_A8_UNORM, 1, 0, 0, 0, 0, 0, 0, 0, 8, 0, 0),
+
+  /* OpenVG formats are packed in words, the channels named from the most
+   * significant bits, hence VG_sRGBA_8888 being ABGR in memory */
+  PACKED (PVR_VG_sRGBX_8888, 4, 24, 8, 16, 8, 8, 8, 0, 0, 0, SRGB),
+  PACKED (PVR_VG_sRGBA_8888, 4, 24, 8, 16, 8, 8, 8, 0, 8, 0, SRGB),
+  PACKED (PVR_VG_sRGBA_8888_PRE, 4, 24, 8, 16, 8, 8, 8, 0, 8, PRE, SRGB),
+  PACKED (PVR_VG_sRGB_565, 2, 11, 5, 5, 6, 0, 5, 0, 0, 0, SRGB),
+  PACKED (PVR_VG_sRGBA_5551, 2, 11, 5, 6, 5, 1, 5, 0, 1, 0, SRGB),
+  PACKED (PVR_VG_sRGBA_4444, 2, 12, 4, 8, 4, 4, 4, 0, 4, 0, SRGB),
+  PACKED (PVR_VG_sL_8, 1, 0, 8, 0, 8, 0, 8, 0, 0, 0, SRGB),
+  PACKED (PVR_VG_lRGBX_8888, 4, 24, 8, 16, 8, 8, 8, 0, 0, 0, LIN),
+  PACKED (PVR_VG_lRGBA_8888, 4, 24, 8, 16, 8, 8, 8, 0, 8, 0, LIN),
+  PACKED (PVR_VG_lRGBA_8888_PRE, 4, 24, 8, 16, 8, 8, 8, 0, 8, PRE, LIN),
+  PACKED (PVR_VG_lL_8, 1, 0, 8, 0, 8, 0, 8, 0, 0, 0, LIN),
+  PACKED (PVR_VG_A_8, 1, 0, 0, 0, 0, 0, 0, 0, 8, 0, 0),
+
+  PACKED (PVR_VG_sXRGB_8888, 4, 16, 8, 8, 8, 0, 8, 0, 0, 0, SRGB),
+  PACKED (PVR_VG_sARGB_8888, 4, 16, 8, 8, 8, 0, 8, 24, 8, 0, SRGB),
+  PACKED (PVR_VG_sARGB_8888_PRE, 4, 16, 8, 8, 8, 0, 8, 24, 8, PRE, SRGB),
+  PACKED (PVR_VG_sARGB_1555, 2, 10, 5, 5, 5, 0, 5, 15, 1, 0, SRGB),
+  PACKED (PVR_VG_sARGB_4444, 2, 8, 4, 4, 4, 0, 4, 12, 4, 0, SRGB),
+  PACKED (PVR_VG_lXRGB_8888, 4, 16, 8, 8, 8, 0, 8, 0, 0, 0, LIN),
+  PACKED (PVR_VG_lARGB_8888, 4, 16, 8, 8, 8, 0, 8, 24, 8, 0, LIN),
+  PACKED (PVR_VG_lARGB_8888_PRE, 4, 16, 8, 8, 8, 0, 8, 24, 8, PRE, LIN),
+
+  PACKED (PVR_VG_sBGRX_8888, 4, 8, 8, 16, 8, 24, 8, 0, 0, 0, SRGB),
+  PACKED (PVR_VG_sBGRA_8888, 4, 8, 8, 16, 8, 24, 8, 0, 8, 0, SRGB),
+  PACKED (PVR_VG_sBGRA_8888_PRE, 4, 8, 8, 16, 8, 24, 8, 0, 8, PRE, SRGB),
+  PACKED (PVR_VG_sBGR_565, 2, 0, 5, 5, 6, 11, 5, 0, 0, 0, SRGB),
+  PACKED (PVR_VG_sBGRA_5551, 2, 1, 5, 6, 5, 11, 5, 0, 1, 0, SRGB),
+  PACKED (PVR_VG_sBGRA_4444, 2, 4, 4, 8, 4, 12, 4, 0, 4, 0, SRGB),
+  PACKED (PVR_VG_lBGRX_8888, 4, 8, 8, 16, 8, 24, 8, 0, 0, 0, LIN),
+  PACKED (PVR_VG_lBGRA_8888, 4, 8, 8, 16, 8, 24, 8, 0, 8, 0, LIN),
+  PACKED (PVR_VG_lBGRA_8888_PRE, 4, 8, 8, 16, 8, 24, 8, 0, 8, PRE, LIN),
+
+  PACKED (PVR_VG_sXBGR_8888, 4, 0, 8, 8, 8, 16, 8, 0, 0, 0, SRGB),
+  COPY   (PVR_VG_sABGR_8888, 4, SRGB),
+  PACKED (PVR_VG_sABGR_8888_PRE, 4, 0, 8, 8, 8, 16, 8, 24, 8, PRE, SRGB),
+  PACKED (PVR_VG_sABGR_1555, 2, 0, 5, 5, 5, 10, 5, 15, 1, 0, SRGB),
+  PACKED (PVR_VG_sABGR_4444, 2, 0, 4, 4, 4, 8, 4, 12, 4, 0, SRGB),
+  PACKED (PVR_VG_lXBGR_8888, 4, 0, 8, 8, 8, 16, 8, 0, 0, 0, LIN),
+  COPY   (PVR_VG_lABGR_8888, 4, LIN),
+  PACKED (PVR_VG_lABGR_8888_PRE, 4, 0, 8, 8, 8, 16, 8, 24, 8, PRE, LIN),
+};
+
+const guint pvr_unpack_n_formats = G_N_ELEMENTS (pvr_unpack_formats);
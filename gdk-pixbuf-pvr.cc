@@ -15,12 +15,14 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <zlib.h>
 
 #define GDK_PIXBUF_ENABLE_BACKEND
 
 #include <gdk-pixbuf/gdk-pixbuf.h>
 
 #include "gdk-pixbuf-pvr.h"
+#include "gdk-pixbuf-pvr-codecs.h"
 #include "PVRTexLib.h"
 using namespace pvrtexlib;
 
@@ -29,6 +31,125 @@ typedef struct
   CPVRTexture *decompressed;
 } PvrContext;
 
+/*
+ * The module is declared thread safe so gdk-pixbuf doesn't serialize every
+ * load and save behind its own lock. Our decoders and encoders only touch
+ * the surfaces they are given, PVRTexLib makes no such promise: it is only
+ * ever used by one thread at a time. A PvrTexLibLocker at the top of a PVRTRY
+ * block holds the lock until the block is left, exceptions included.
+ */
+static GMutex pvrtexlib_lock;
+
+class PvrTexLibLocker
+{
+public:
+  PvrTexLibLocker () { g_mutex_lock (&pvrtexlib_lock); }
+  ~PvrTexLibLocker () { g_mutex_unlock (&pvrtexlib_lock); }
+};
+
+/*
+ * Tracing.
+ *
+ * When GDK_PIXBUF_PVR_TRACE is set in the environment, the duration of each
+ * stage of a load or a save and the number of bytes it went through are
+ * logged, as structured fields (PVR_STAGE, PVR_DURATION_US and PVR_BYTES) when
+ * GLib is recent enough. pvr_trace_begin() returns 0 when tracing is off so
+ * the hot paths don't even read the clock.
+ */
+
+#define PVR_LOG_DOMAIN "GdkPixbuf-PVR"
+
+static gboolean
+pvr_trace_enabled (void)
+{
+  static gsize initialized = 0;
+  static gboolean enabled;
+
+  if (g_once_init_enter (&initialized))
+    {
+      enabled = g_getenv ("GDK_PIXBUF_PVR_TRACE") != NULL;
+      g_once_init_leave (&initialized, 1);
+    }
+
+  return enabled;
+}
+
+static inline gint64
+pvr_trace_begin (void)
+{
+  return pvr_trace_enabled () ? g_get_monotonic_time () : 0;
+}
+
+static void
+pvr_trace_log (const gchar *stage,
+               gint64       duration,
+               guint64      n_bytes)
+{
+#if GLIB_CHECK_VERSION (2, 50, 0)
+  gchar duration_field[24], bytes_field[24];
+
+  g_snprintf (duration_field, sizeof (duration_field), "%" G_GINT64_FORMAT,
+              duration);
+  g_snprintf (bytes_field, sizeof (bytes_field), "%" G_GUINT64_FORMAT,
+              n_bytes);
+
+  g_log_structured (PVR_LOG_DOMAIN, G_LOG_LEVEL_MESSAGE,
+                    "PVR_STAGE", stage,
+                    "PVR_DURATION_US", duration_field,
+                    "PVR_BYTES", bytes_field,
+                    "MESSAGE", "%s: %" G_GINT64_FORMAT " us, %"
+                    G_GUINT64_FORMAT " bytes", stage, duration, n_bytes);
+#else
+  g_log (PVR_LOG_DOMAIN, G_LOG_LEVEL_MESSAGE,
+         "%s: %" G_GINT64_FORMAT " us, %" G_GUINT64_FORMAT " bytes",
+         stage, duration, n_bytes);
+#endif
+}
+
+static inline void
+pvr_trace_end (gint64       start,
+               const gchar *stage,
+               guint64      n_bytes)
+{
+  if (start)
+    pvr_trace_log (stage, g_get_monotonic_time () - start, n_bytes);
+}
+
+/*
+ * Pixel format.
+ *
+ * gdk-pixbuf has no way to pass options to a loader, so a process that hands
+ * every texture it loads to Cairo can set GDK_PIXBUF_PVR_PIXEL_FORMAT to
+ * "premultiplied-bgra" in its environment. The native decoders then write
+ * premultiplied BGRA pixels, CAIRO_FORMAT_ARGB32 on little endian machines,
+ * and the pixbufs always have an alpha channel. They are tagged with the
+ * "pvr::pixel-format" option so they can't be mistaken for regular ones.
+ */
+
+static PvrSurfaceLayout
+pvr_pixel_format (void)
+{
+  static gsize initialized = 0;
+  static PvrSurfaceLayout layout;
+
+  if (g_once_init_enter (&initialized))
+    {
+      layout = g_strcmp0 (g_getenv ("GDK_PIXBUF_PVR_PIXEL_FORMAT"),
+                          "premultiplied-bgra") == 0 ?
+               PVR_SURFACE_BGRA_PREMULTIPLIED : PVR_SURFACE_RGBA;
+      g_once_init_leave (&initialized, 1);
+    }
+
+  return layout;
+}
+
+static gboolean
+pixbuf_is_premultiplied_bgra (GdkPixbuf *pixbuf)
+{
+  return g_strcmp0 (gdk_pixbuf_get_option (pixbuf, "pvr::pixel-format"),
+                    "premultiplied-bgra") == 0;
+}
+
 static const gchar *
 standard_pixel_type_to_string (PixelType pixel_type)
 {
@@ -55,28 +176,68 @@ on_pixbuf_destroyed (guchar *pixels,
 {
   PvrContext *context = (PvrContext *) data;
 
+  g_mutex_lock (&pvrtexlib_lock);
   delete context->decompressed;
+  g_mutex_unlock (&pvrtexlib_lock);
   g_free (context);
 }
 
+/*
+ * We don't control where PVRTexLib writes the rows, swap them afterwards
+ * rather than allocating a flipped copy of the image.
+ */
+static void
+flip_rows_in_place (guchar *pixels,
+                    gint    rowstride,
+                    guint   height)
+{
+  guchar *top, *bottom, *tmp;
+
+  tmp = (guchar *) g_malloc (rowstride);
+  top = pixels;
+  bottom = pixels + (gsize) (height - 1) * rowstride;
+
+  for (; top < bottom; top += rowstride, bottom -= rowstride)
+    {
+      memcpy (tmp, top, rowstride);
+      memcpy (top, bottom, rowstride);
+      memcpy (bottom, tmp, rowstride);
+    }
+
+  g_free (tmp);
+}
+
 static GdkPixbuf *
-pvrtexlib_gdk_pixbuf_new_from_memory (const guchar  *data,
-                                      GError       **error)
+pvrtexlib_gdk_pixbuf_new_from_memory (const guchar     *data,
+                                      const PVRHeader  *header,
+                                      GError          **error)
 {
   CPVRTexture *decompressed;
   PvrContext *context;
   GdkPixbuf *pixbuf;
+  gint64 trace;
 
   PVRTRY
     {
+      PvrTexLibLocker locker;
       PVRTextureUtilities utils;
       PixelType pixel_type;
+      guchar *pixels;
+      guint width, height, y;
+      gboolean has_alpha;
+      gint rowstride;
+
+      trace = pvr_trace_begin ();
 
       CPVRTexture compressed (data);
 
       decompressed = new CPVRTexture();
       utils.DecompressPVR (compressed, *decompressed);
 
+      pvr_trace_end (trace, "pvrtexlib-decompress",
+                     (guint64) decompressed->getWidth () *
+                     decompressed->getHeight () * 4);
+
       pixel_type = decompressed->getPixelType ();
       if (pixel_type != eInt8StandardPixelType)
         {
@@ -94,30 +255,62 @@ pvrtexlib_gdk_pixbuf_new_from_memory (const guchar  *data,
 
       CPVRTextureData& data = decompressed->getData();
 
-      /* FIXME: The data resulting of the decompression will always have alpha.
-       * might worth repacking the pixbuf to RGB if the original texture did
-       * not have any alpha before handing the pixbuf back to the user */
+      pixels = data.getData();
+      width = decompressed->getWidth ();
+      height = decompressed->getHeight ();
+
+      /* The data resulting of the decompression always has alpha, repack the
+       * rows to RGB in place when the texture says it has none */
+      has_alpha = (header->flags & PVR_FLAG_ALPHA) ||
+                  pvr_pixel_format () != PVR_SURFACE_RGBA;
+      rowstride = width * (has_alpha ? 4 : 3);
+
+      if (!has_alpha)
+        {
+          trace = pvr_trace_begin ();
+          for (y = 0; y < height; y++)
+            pvr_rgba_to_rgb (pixels + (gsize) y * width * 4,
+                             pixels + (gsize) y * rowstride, width);
+          pvr_trace_end (trace, "repack", (guint64) width * height * 4);
+        }
 
       context = g_new0 (PvrContext, 1);
       context->decompressed = decompressed;
 
-      pixbuf = gdk_pixbuf_new_from_data (data.getData(),
+      trace = pvr_trace_begin ();
+      pixbuf = gdk_pixbuf_new_from_data (pixels,
                                          GDK_COLORSPACE_RGB,
-                                         TRUE,
+                                         has_alpha,
                                          8,
-                                         decompressed->getWidth (),
-                                         decompressed->getHeight (),
-                                         decompressed->getWidth () * 4,
+                                         width,
+                                         height,
+                                         rowstride,
                                          on_pixbuf_destroyed,
                                          context);
+      pvr_trace_end (trace, "pixbuf", 0);
 
       if (compressed.isFlipped ())
         {
-          GdkPixbuf *flipped;
+          trace = pvr_trace_begin ();
+          flip_rows_in_place (gdk_pixbuf_get_pixels (pixbuf),
+                              gdk_pixbuf_get_rowstride (pixbuf),
+                              gdk_pixbuf_get_height (pixbuf));
+          pvr_trace_end (trace, "flip",
+                         (guint64) gdk_pixbuf_get_rowstride (pixbuf) *
+                         gdk_pixbuf_get_height (pixbuf));
+        }
 
-          flipped = gdk_pixbuf_flip (pixbuf, FALSE);
-          g_object_unref (pixbuf);
-          pixbuf = flipped;
+      /* PVRTexLib only gives us RGBA, convert it in place */
+      if (pvr_pixel_format () == PVR_SURFACE_BGRA_PREMULTIPLIED)
+        {
+          trace = pvr_trace_begin ();
+          for (y = 0; y < height; y++)
+            pvr_premultiply_bgra (pixels + (gsize) y * rowstride,
+                                  pixels + (gsize) y * rowstride, width);
+          pvr_trace_end (trace, "premultiply", (guint64) rowstride * height);
+
+          gdk_pixbuf_set_option (pixbuf, "pvr::pixel-format",
+                                 "premultiplied-bgra");
         }
     }
   PVRCATCH(aaaahhh)
@@ -133,156 +326,2166 @@ pvrtexlib_gdk_pixbuf_new_from_memory (const guchar  *data,
   return pixbuf;
 }
 
-static GdkPixbuf *
-gdk_pixbuf__pvr_image_load (FILE    *f,
-                            GError **error)
+static bool
+is_p2 (unsigned int x)
 {
-  GdkPixbuf *pixbuf;
-  guchar *content;
-  GError *decompress_error = NULL;
-  struct stat st;
-  int fd;
+    return ((x != 0) && !(x & (x - 1)));
+}
 
-  fd = fileno (f);
-  if (fd == -1)
+/*
+ * Uncompressed pixel types can be twiddled too, PVR_FLAG_TWIDDLE tells. We
+ * put their pixels back in rows before unpacking them. PVRTC always is
+ * twiddled and the other block compressed formats ignore the flag.
+ */
+static gboolean
+pvr_header_needs_untwiddle (const PVRHeader     *header,
+                            const PvrFormatInfo *info)
+{
+  return (header->flags & PVR_FLAG_TWIDDLE) &&
+         !(info->flags & PVR_FORMAT_TWIDDLED) &&
+         info->block_width == 1 && info->block_height == 1;
+}
+
+/*
+ * KTX containers.
+ *
+ * KTX and KTX2 files carrying one of the block compressed formats we decode
+ * natively are read too. Their header is described as the equivalent PVR
+ * header would describe the texture, with header_size covering everything
+ * that comes before the level data: the key/value data of KTX files, the
+ * level index and the metadata of KTX2 ones. pvr_level_lookup() knows where
+ * the levels of each container are. The Zlib supercompression of KTX2 is
+ * flagged PVR_FLAG_DEFLATE, its levels are zlib streams like ours.
+ *
+ * Only 2D textures are supported, and the orientation is taken from the
+ * KTXorientation key. We write top-down textures, with the levels aligned to
+ * their block size in KTX2 files for them to be usable straight from a
+ * mapping.
+ */
+
+typedef enum
+{
+  PVR_CONTAINER_PVR,
+  PVR_CONTAINER_KTX,
+  PVR_CONTAINER_KTX2,
+} PvrContainer;
+
+#define KTX_HEADER_SIZE         64
+#define KTX_ENDIANNESS          0x04030201
+#define KTX2_HEADER_SIZE        80
+#define KTX2_LEVEL_INDEX_SIZE   24
+#define KTX2_SUPERCOMPRESSION_ZLIB 3
+
+static const guchar ktx_identifier[12] =
+{
+  0xab, 'K', 'T', 'X', ' ', '1', '1', 0xbb, '\r', '\n', 0x1a, '\n'
+};
+
+static const guchar ktx2_identifier[12] =
+{
+  0xab, 'K', 'T', 'X', ' ', '2', '0', 0xbb, '\r', '\n', 0x1a, '\n'
+};
+
+typedef struct
+{
+  PVRPixelType pixel_type;
+  guint32 gl_internal_format;
+  guint32 gl_base_internal_format;
+  guint32 vk_format;
+  guint8 color_model;           /* of the KTX2 data format descriptor */
+} KtxFormat;
+
+/*
+ * The first entry of a pixel type is the one we write. ETC1 has no Vulkan
+ * format, it is stored as ETC2 RGB with an ETC1 data format descriptor.
+ * Vulkan doesn't tell RGB and RGBA PVRTC apart, the GL only rows have a
+ * vk_format of 0.
+ */
+static const KtxFormat ktx_formats[] =
+{
+  { PVR_ETC_RGB_4BPP,        0x8d64, 0x1907, 147,        160 },
+  { PVR_ETC2_RGB,            0x9274, 0x1907, 147,        161 },
+  { PVR_ETC2_RGB_A1,         0x9276, 0x1908, 149,        161 },
+  { PVR_ETC2_RGBA,           0x9278, 0x1908, 151,        161 },
+  { PVR_OGL_PVRTC2,          0x8c03, 0x1908, 1000054000, 164 },
+  { PVR_OGL_PVRTC4,          0x8c02, 0x1908, 1000054001, 164 },
+  { PVR_OGL_PVRTC2,          0x8c01, 0x1907, 0,          164 },
+  { PVR_OGL_PVRTC4,          0x8c00, 0x1907, 0,          164 },
+  { PVR_PVRTC2_SRGB,         0x8a56, 0x1908, 1000054004, 164 },
+  { PVR_PVRTC4_SRGB,         0x8a57, 0x1908, 1000054005, 164 },
+  { PVR_PVRTC2_SRGB,         0x8a54, 0x1907, 0,          164 },
+  { PVR_PVRTC4_SRGB,         0x8a55, 0x1907, 0,          164 },
+  { PVR_D3D_DXT1,            0x83f1, 0x1908, 133,        128 },
+  { PVR_D3D_DXT1,            0x83f0, 0x1907, 131,        128 },
+  { PVR_DX10_BC1_UNORM_SRGB, 0x8c4d, 0x1908, 134,        128 },
+  { PVR_DX10_BC1_UNORM_SRGB, 0x8c4c, 0x1907, 132,        128 },
+  { PVR_D3D_DXT3,            0x83f2, 0x1908, 135,        129 },
+  { PVR_DX10_BC2_UNORM_SRGB, 0x8c4e, 0x1908, 136,        129 },
+  { PVR_D3D_DXT5,            0x83f3, 0x1908, 137,        130 },
+  { PVR_DX10_BC3_UNORM_SRGB, 0x8c4f, 0x1908, 138,        130 },
+};
+
+static const KtxFormat *
+ktx_format_lookup (PVRPixelType pixel_type)
+{
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (ktx_formats); i++)
     {
-      g_set_error_literal (error,
-                           GDK_PIXBUF_ERROR,
-                           GDK_PIXBUF_ERROR_FAILED,
-                           "Invalid FILE object");
-      return NULL;
+      if (ktx_formats[i].pixel_type == pixel_type)
+        return &ktx_formats[i];
     }
 
-  if (fstat (fd, &st) == -1)
-    {
-      g_set_error_literal (error,
-                           GDK_PIXBUF_ERROR,
-                           GDK_PIXBUF_ERROR_FAILED,
-                           "Failed to get attributes");
-      return NULL;
+  return NULL;
+}
+
+static PvrContainer
+pvr_container_identify (const guchar *data,
+                        gsize         size)
+{
+  if (size >= sizeof (ktx_identifier) &&
+      memcmp (data, ktx_identifier, sizeof (ktx_identifier)) == 0)
+    return PVR_CONTAINER_KTX;
+
+  if (size >= sizeof (ktx2_identifier) &&
+      memcmp (data, ktx2_identifier, sizeof (ktx2_identifier)) == 0)
+    return PVR_CONTAINER_KTX2;
+
+  return PVR_CONTAINER_PVR;
+}
 
+/* read the 32 bits words of the header of a KTX file, in host order */
+static gboolean
+ktx_read_words (const guchar *data,
+                guint32      *words,
+                guint         n_words)
+{
+  gboolean swap;
+  guint i;
+
+  memcpy (words, data + sizeof (ktx_identifier), n_words * sizeof (guint32));
+
+  swap = words[0] == GUINT32_SWAP_LE_BE (KTX_ENDIANNESS);
+  if (swap)
+    {
+      for (i = 0; i < n_words; i++)
+        words[i] = GUINT32_SWAP_LE_BE (words[i]);
     }
 
-  if (st.st_size == 0 || st.st_size > G_MAXSIZE)
+  return swap;
+}
+
+/*
+ * Number of bytes of the header of a KTX or KTX2 file, or of its fixed part
+ * if size is too small to tell. 0 for PVR files.
+ */
+static gsize
+ktx_header_get_size (const guchar *data,
+                     gsize         size)
+{
+  guint32 words[13];
+  gsize header_size;
+
+  switch (pvr_container_identify (data, size))
     {
-      content = NULL;
+    case PVR_CONTAINER_KTX:
+      if (size < KTX_HEADER_SIZE)
+        return KTX_HEADER_SIZE;
+
+      ktx_read_words (data, words, 13);
+      return KTX_HEADER_SIZE + (gsize) words[12];
+
+    case PVR_CONTAINER_KTX2:
+      if (size < KTX2_HEADER_SIZE)
+        return KTX2_HEADER_SIZE;
+
+      /* levelCount, then the offsets and sizes of the metadata */
+      memcpy (words, data + 12, 13 * sizeof (guint32));
+      header_size = KTX2_HEADER_SIZE +
+                    (gsize) MAX (1, GUINT32_FROM_LE (words[7])) *
+                    KTX2_LEVEL_INDEX_SIZE;
+      header_size = MAX (header_size, (gsize) GUINT32_FROM_LE (words[9]) +
+                                      GUINT32_FROM_LE (words[10]));
+      header_size = MAX (header_size, (gsize) GUINT32_FROM_LE (words[11]) +
+                                      GUINT32_FROM_LE (words[12]));
+      return header_size;
+
+    default:
+      return 0;
     }
-  else
+}
+
+/* find the value of key in the key/value data of a KTX or KTX2 file */
+static const gchar *
+ktx_kvd_lookup (const guchar *kvd,
+                gsize         kvd_size,
+                gboolean      swap,
+                const gchar  *key,
+                gsize        *value_size)
+{
+  gsize offset = 0, key_size;
+  guint32 entry_size;
+
+  key_size = strlen (key) + 1;
+
+  while (kvd_size - offset >= sizeof (guint32))
     {
-      content = (unsigned char *) mmap (NULL, st.st_size, PROT_READ,
-                                        MAP_PRIVATE, fd, 0);
+      memcpy (&entry_size, kvd + offset, sizeof (guint32));
+      entry_size = swap ? GUINT32_SWAP_LE_BE (entry_size)
+                        : GUINT32_FROM_LE (entry_size);
+      offset += sizeof (guint32);
+
+      if (entry_size > kvd_size - offset)
+        break;
+
+      if (entry_size >= key_size && memcmp (kvd + offset, key, key_size) == 0)
+        {
+          *value_size = entry_size - key_size;
+          return (const gchar *) kvd + offset + key_size;
+        }
+
+      offset += MIN ((gsize) (entry_size + 3) & ~3, kvd_size - offset);
     }
 
-  if (content == NULL || content == MAP_FAILED)
+  return NULL;
+}
+
+static gboolean
+ktx_header_read (const guchar  *data,
+                 gsize          size,
+                 PVRHeader     *header,
+                 GError       **error)
+{
+  const KtxFormat *format = NULL;
+  const gchar *orientation;
+  guint32 words[13];
+  gsize orientation_size;
+  gboolean swap;
+  guint i;
+
+  if (size < KTX_HEADER_SIZE || size < ktx_header_get_size (data, size))
+    goto truncated;
+
+  swap = ktx_read_words (data, words, 13);
+  if (words[0] != KTX_ENDIANNESS)
     {
       g_set_error_literal (error,
                            GDK_PIXBUF_ERROR,
-                           GDK_PIXBUF_ERROR_FAILED,
-                           "Failed to map file");
-      return NULL;
+                           GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                           "Invalid KTX endianness");
+      return FALSE;
     }
 
-  pixbuf = pvrtexlib_gdk_pixbuf_new_from_memory (content,
-                                                 &decompress_error);
-  if (decompress_error)
+  /* compressed formats have a glType of 0 */
+  for (i = 0; words[1] == 0 && i < G_N_ELEMENTS (ktx_formats); i++)
     {
-      g_propagate_error (error, decompress_error);
-      return NULL;
+      if (ktx_formats[i].gl_internal_format == words[4])
+        {
+          format = &ktx_formats[i];
+          break;
+        }
     }
 
-  return pixbuf;
-}
+  /* pixelDepth, numberOfArrayElements, numberOfFaces and mipmaps of 32 bits
+   * dimensions */
+  if (format == NULL || words[8] != 0 || words[9] != 0 || words[10] != 1 ||
+      words[11] > 32)
+    goto unsupported;
+
+  memset (header, 0, sizeof (PVRHeader));
+  header->header_size = KTX_HEADER_SIZE + words[12];
+  header->width = words[6];
+  header->height = words[7];
+  header->flags = format->pixel_type;
+  header->PVR = PVR_FLAG_IDENTIFIER;
+  header->n_surfaces = 1;
+
+  if (words[11] > 1)
+    {
+      header->flags |= PVR_FLAG_MIPMAP;
+      header->mipmap_count = words[11] - 1;
+    }
 
-static bool
-is_p2 (unsigned int x)
-{
-    return ((x != 0) && !(x & (x - 1)));
+  orientation = ktx_kvd_lookup (data + KTX_HEADER_SIZE, words[12], swap,
+                                "KTXorientation", &orientation_size);
+  if (orientation && g_strstr_len (orientation, orientation_size, "T=u"))
+    header->flags |= PVR_FLAG_VERTICAL_FLIP;
+
+  return TRUE;
+
+truncated:
+  g_set_error_literal (error,
+                       GDK_PIXBUF_ERROR,
+                       GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                       "Truncated KTX header");
+  return FALSE;
+
+unsupported:
+  g_set_error_literal (error,
+                       GDK_PIXBUF_ERROR,
+                       GDK_PIXBUF_ERROR_UNKNOWN_TYPE,
+                       "Unsupported KTX texture");
+  return FALSE;
 }
 
 static gboolean
-parse_format (const gchar *format,
-              PixelType   *type)
+ktx2_header_read (const guchar  *data,
+                  gsize          size,
+                  PVRHeader     *header,
+                  GError       **error)
 {
-  if (g_strcmp0 (format, "PVRTC2") == 0)
+  const KtxFormat *format = NULL;
+  const gchar *orientation;
+  guint32 words[13];
+  gsize orientation_size;
+  guint8 color_model = 0;
+  guint i;
+
+  if (size < KTX2_HEADER_SIZE || size < ktx_header_get_size (data, size))
     {
-      *type = OGL_PVRTC2;
-      return TRUE;
+      g_set_error_literal (error,
+                           GDK_PIXBUF_ERROR,
+                           GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                           "Truncated KTX2 header");
+      return FALSE;
     }
-  if (g_strcmp0 (format, "PVRTC4") == 0)
+
+  memcpy (words, data + sizeof (ktx2_identifier), sizeof (words));
+  for (i = 0; i < G_N_ELEMENTS (words); i++)
+    words[i] = GUINT32_FROM_LE (words[i]);
+
+  /* the colour model tells ETC1 and ETC2 apart */
+  if (words[10] >= 16)
+    color_model = data[words[9] + 12];
+
+  for (i = 0; i < G_N_ELEMENTS (ktx_formats); i++)
     {
-      *type = OGL_PVRTC4;
-      return TRUE;
+      if (ktx_formats[i].vk_format != 0 &&
+          ktx_formats[i].vk_format == words[0] &&
+          ktx_formats[i].color_model == color_model)
+        {
+          format = &ktx_formats[i];
+          break;
+        }
     }
-  if (g_strcmp0 (format, "ETC1") == 0)
+
+  /* pixelDepth, layerCount, faceCount, levelCount and
+   * supercompressionScheme */
+  if (format == NULL || words[4] != 0 || words[5] != 0 || words[6] != 1 ||
+      words[7] > 32 ||
+      (words[8] != 0 && words[8] != KTX2_SUPERCOMPRESSION_ZLIB))
     {
-      *type = ETC_RGB_4BPP;
-      return TRUE;
+      g_set_error_literal (error,
+                           GDK_PIXBUF_ERROR,
+                           GDK_PIXBUF_ERROR_UNKNOWN_TYPE,
+                           "Unsupported KTX2 texture");
+      return FALSE;
     }
 
-  *type = ETC_RGB_4BPP;
-  return FALSE;
+  memset (header, 0, sizeof (PVRHeader));
+  header->header_size = ktx_header_get_size (data, size);
+  header->width = words[2];
+  header->height = words[3];
+  header->flags = format->pixel_type;
+  header->PVR = PVR_FLAG_IDENTIFIER;
+  header->n_surfaces = 1;
+
+  if (words[7] > 1)
+    {
+      header->flags |= PVR_FLAG_MIPMAP;
+      header->mipmap_count = words[7] - 1;
+    }
+
+  if (words[8] == KTX2_SUPERCOMPRESSION_ZLIB)
+    header->flags |= PVR_FLAG_DEFLATE;
+
+  /* "rd" is the default, the second letter is the direction of y */
+  orientation = ktx_kvd_lookup (data + words[11], words[12], FALSE,
+                                "KTXorientation", &orientation_size);
+  if (orientation && orientation_size >= 2 && orientation[1] == 'u')
+    header->flags |= PVR_FLAG_VERTICAL_FLIP;
+
+  return TRUE;
 }
 
+/*
+ * Read and sanity check the header found at the start of data. Both the v1
+ * (44 bytes) and v2 (52 bytes) headers are accepted, and KTX headers are
+ * described as a PVR one.
+ */
 static gboolean
-validate_pixbuf_pvrtc (GdkPixbuf  *pixbuf,
-                       GError    **error)
+pvr_header_read (const guchar  *data,
+                 gsize          size,
+                 PVRHeader     *header,
+                 GError       **error)
 {
-  int width, height;
+  switch (pvr_container_identify (data, size))
+    {
+    case PVR_CONTAINER_KTX:
+      if (!ktx_header_read (data, size, header, error))
+        return FALSE;
+      goto check_dimensions;
+    case PVR_CONTAINER_KTX2:
+      if (!ktx2_header_read (data, size, header, error))
+        return FALSE;
+      goto check_dimensions;
+    default:
+      break;
+    }
 
-  width = gdk_pixbuf_get_width (pixbuf);
-  height = gdk_pixbuf_get_height (pixbuf);
+  if (size < PVR_FLAG_V1_HEADER_SIZE)
+    goto truncated;
 
-  if (!is_p2 (width))
+  memcpy (header, data, MIN (size, sizeof (PVRHeader)));
+
+  if (header->header_size == PVR_FLAG_V1_HEADER_SIZE)
+    {
+      header->PVR = PVR_FLAG_IDENTIFIER;
+      header->n_surfaces = 1;
+    }
+  else if (header->header_size != sizeof (PVRHeader) ||
+           header->PVR != PVR_FLAG_IDENTIFIER)
     {
       g_set_error_literal (error,
                            GDK_PIXBUF_ERROR,
-                           GDK_PIXBUF_ERROR_FAILED,
-                           "Width needs to be a power of 2");
+                           GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                           "Not a PVR file");
       return FALSE;
     }
 
-  if (!is_p2 (height))
+  if (size < header->header_size)
+    goto truncated;
+
+check_dimensions:
+  if (header->width == 0 || header->height == 0)
     {
       g_set_error_literal (error,
                            GDK_PIXBUF_ERROR,
-                           GDK_PIXBUF_ERROR_FAILED,
-                           "Height needs to be a power of 2");
+                           GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                           "Invalid image dimensions");
+      return FALSE;
+    }
+
+  /* dimensions are 32 bits, so are the chains of mipmaps we can see. The
+   * deflate table is sized from mipmap_count, don't trust anything bigger */
+  if ((header->flags & PVR_FLAG_DEFLATE) &&
+      (header->flags & PVR_FLAG_MIPMAP) && header->mipmap_count > 32)
+    {
+      g_set_error_literal (error,
+                           GDK_PIXBUF_ERROR,
+                           GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                           "Invalid number of mipmaps");
       return FALSE;
     }
 
   return TRUE;
+
+truncated:
+  g_set_error_literal (error,
+                       GDK_PIXBUF_ERROR,
+                       GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                       "Truncated PVR header");
+  return FALSE;
 }
 
-static gboolean
-gdk_pixbuf__pvr_image_save (FILE       *f,
-                            GdkPixbuf  *pixbuf,
-                            gchar     **param_keys,
-                            gchar     **param_values,
-                            GError    **error_out)
+/*
+ * Deflate supercompression.
+ *
+ * Block compressed payloads still deflate well, and on slow storage reading
+ * fewer bytes matters more than the time spent inflating them. This is our
+ * own extension of the container, flagged with PVR_FLAG_DEFLATE: the header
+ * is followed by a table of n_levels + 1 little endian 32 bits offsets,
+ * relative to the end of the table, of the zlib stream of each level and of
+ * the end of the last one. Levels are compressed separately so any of them
+ * can be inflated on its own, and data_size covers the table and the streams.
+ */
+
+/* rows of blocks inflated and decoded at a time */
+#define INFLATE_BAND_ROWS 16
+
+static guint
+pvr_header_get_n_levels (const PVRHeader *header)
 {
-  GdkPixbuf *with_alpha = NULL;
-  PixelType opt_format = ETC_RGB_4BPP;
-  gboolean valid;
-  GError *error = NULL;
+  if (header->flags & PVR_FLAG_MIPMAP)
+    return header->mipmap_count + 1;
 
-  /* parse the parameters */
-  if (param_keys)
+  return 1;
+}
+
+static gsize
+deflate_table_size (const PVRHeader *header)
+{
+  return (pvr_header_get_n_levels (header) + 1) * sizeof (guint32);
+}
+
+/*
+ * Find where the stream of level is in payload, the data following the
+ * header. Only the table has to be in payload.
+ */
+static gboolean
+deflate_table_lookup (const guchar     *payload,
+                      gsize             payload_size,
+                      const PVRHeader  *header,
+                      guint             level,
+                      gsize            *start,
+                      gsize            *end,
+                      GError          **error)
+{
+  guint32 offsets[2];
+  gsize table_size;
+
+  table_size = deflate_table_size (header);
+  if (payload_size < table_size)
+    {
+      g_set_error_literal (error,
+                           GDK_PIXBUF_ERROR,
+                           GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                           "Truncated PVR data");
+      return FALSE;
+    }
+
+  memcpy (offsets, payload + level * sizeof (guint32), sizeof (offsets));
+  *start = table_size + GUINT32_FROM_LE (offsets[0]);
+  *end = table_size + GUINT32_FROM_LE (offsets[1]);
+
+  if (*start > *end)
+    {
+      g_set_error_literal (error,
+                           GDK_PIXBUF_ERROR,
+                           GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                           "Invalid deflate table");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/*
+ * Inflate the stream of a level and decode it as it comes out, one band of
+ * rows of blocks at a time so the level is never fully held in memory.
+ * Twiddled levels need all of it in one go though.
+ */
+static gboolean
+inflate_decode (const guchar         *stream,
+                gsize                 stream_size,
+                const PvrFormatInfo  *info,
+                gboolean              untwiddle,
+                const PvrSurface     *surface,
+                GError              **error)
+{
+  z_stream z;
+  PvrSurface band;
+  guchar *buffer, *linear;
+  gsize row_size, buffer_size;
+  guint n_rows, band_rows, row, n_band_rows, y;
+  gboolean whole_level, success = TRUE;
+  int ret;
+
+  n_rows = pvr_format_info_get_n_rows (info, surface->height);
+  row_size = (gsize) info->block_size *
+             ((MAX (surface->width, info->min_width) + info->block_width - 1) /
+              info->block_width);
+
+  whole_level = untwiddle || (info->flags & PVR_FORMAT_TWIDDLED);
+  if (whole_level)
+    {
+      band_rows = n_rows;
+      buffer_size = pvr_format_info_get_level_size (info, surface->width,
+                                                    surface->height);
+    }
+  else
+    {
+      band_rows = INFLATE_BAND_ROWS;
+      buffer_size = row_size * band_rows;
+    }
+
+  memset (&z, 0, sizeof (z_stream));
+  buffer = (guchar *) g_try_malloc (buffer_size);
+  if (buffer == NULL || inflateInit (&z) != Z_OK)
+    {
+      g_set_error_literal (error,
+                           GDK_PIXBUF_ERROR,
+                           GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+                           "Not enough memory to decode the image");
+      g_free (buffer);
+      return FALSE;
+    }
+
+  z.next_in = (Bytef *) stream;
+  z.avail_in = stream_size;
+
+  for (row = 0; row < n_rows; row += n_band_rows)
+    {
+      n_band_rows = MIN (band_rows, n_rows - row);
+
+      z.next_out = buffer;
+      z.avail_out = whole_level ? buffer_size : n_band_rows * row_size;
+      do
+        ret = inflate (&z, Z_SYNC_FLUSH);
+      while (ret == Z_OK && z.avail_out > 0);
+
+      if (z.avail_out > 0)
+        {
+          g_set_error_literal (error,
+                               GDK_PIXBUF_ERROR,
+                               GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                               "Invalid deflate compressed data");
+          success = FALSE;
+          break;
+        }
+
+      y = row * info->block_height;
+      band = *surface;
+      band.pixels += (gssize) y * surface->rowstride;
+      band.height = MIN (n_band_rows * info->block_height,
+                         surface->height - y);
+
+      if (untwiddle)
+        {
+          linear = pvr_unpack_untwiddle (info, buffer, surface->width,
+                                         surface->height);
+          if (linear == NULL)
+            {
+              g_set_error_literal (error,
+                                   GDK_PIXBUF_ERROR,
+                                   GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+                                   "Not enough memory to decode the image");
+              success = FALSE;
+              break;
+            }
+
+          info->decode (linear, &band, 0, n_band_rows);
+          g_free (linear);
+        }
+      else
+        {
+          info->decode (buffer, &band, 0, n_band_rows);
+        }
+    }
+
+  /* go to the end of the stream for zlib to verify its checksum */
+  z.next_out = buffer;
+  z.avail_out = buffer_size;
+  if (success && inflate (&z, Z_FINISH) != Z_STREAM_END)
+    {
+      g_set_error_literal (error,
+                           GDK_PIXBUF_ERROR,
+                           GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                           "Invalid deflate compressed data");
+      success = FALSE;
+    }
+
+  inflateEnd (&z);
+  g_free (buffer);
+
+  return success;
+}
+
+/*
+ * Compress each level of data on its own, returning the table and the
+ * streams to write after the header, or NULL if size is not the size of
+ * the levels or we are out of memory.
+ */
+static guchar *
+deflate_levels (const PvrFormatInfo *info,
+                guint                width,
+                guint                height,
+                guint                n_levels,
+                const guchar        *data,
+                gsize                size,
+                gsize               *deflated_size)
+{
+  guint32 *table;
+  guchar *deflated;
+  gsize table_size, bound, level_size, chain_size, offset;
+  uLongf stream_size;
+  guint i, w, h;
+
+  table_size = (n_levels + 1) * sizeof (guint32);
+  bound = table_size;
+  chain_size = 0;
+  for (i = 0, w = width, h = height; i < n_levels; i++)
+    {
+      level_size = pvr_format_info_get_level_size (info, w, h);
+      bound += compressBound (level_size);
+      chain_size += level_size;
+      w = MAX (1, w / 2);
+      h = MAX (1, h / 2);
+    }
+
+  if (size != chain_size)
+    return NULL;
+
+  deflated = (guchar *) g_try_malloc (bound);
+  if (deflated == NULL)
+    return NULL;
+
+  table = g_new (guint32, n_levels + 1);
+  offset = 0;
+  for (i = 0, w = width, h = height; i < n_levels; i++)
+    {
+      level_size = pvr_format_info_get_level_size (info, w, h);
+      stream_size = bound - table_size - offset;
+
+      if (compress2 (deflated + table_size + offset, &stream_size, data,
+                     level_size, Z_BEST_COMPRESSION) != Z_OK)
+        {
+          g_free (deflated);
+          g_free (table);
+          return NULL;
+        }
+
+      table[i] = GUINT32_TO_LE (offset);
+      offset += stream_size;
+      data += level_size;
+      w = MAX (1, w / 2);
+      h = MAX (1, h / 2);
+    }
+  table[n_levels] = GUINT32_TO_LE (offset);
+
+  memcpy (deflated, table, table_size);
+  g_free (table);
+
+  *deflated_size = table_size + offset;
+
+  return deflated;
+}
+
+/*
+ * Find where the data of level starts and ends in the file header describes.
+ * data holds at least the header_size first bytes of the file and, for
+ * deflate compressed PVR textures, the table that follows.
+ */
+static gboolean
+pvr_level_lookup (const guchar         *data,
+                  gsize                 size,
+                  const PVRHeader      *header,
+                  const PvrFormatInfo  *info,
+                  guint                 level,
+                  gsize                *start,
+                  gsize                *end,
+                  GError              **error)
+{
+  guint64 entry[2];
+  guint width, height, i;
+  gsize level_size = 0;
+
+  switch (pvr_container_identify (data, size))
+    {
+    case PVR_CONTAINER_KTX2:
+      memcpy (entry, data + KTX2_HEADER_SIZE + level * KTX2_LEVEL_INDEX_SIZE,
+              sizeof (entry));
+      *start = GUINT64_FROM_LE (entry[0]);
+      *end = *start + GUINT64_FROM_LE (entry[1]);
+
+      if (*start < header->header_size || *end < *start)
+        {
+          g_set_error_literal (error,
+                               GDK_PIXBUF_ERROR,
+                               GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                               "Invalid KTX2 level index");
+          return FALSE;
+        }
+      return TRUE;
+
+    case PVR_CONTAINER_PVR:
+      if (header->flags & PVR_FLAG_DEFLATE)
+        {
+          if (!deflate_table_lookup (data + header->header_size,
+                                     size - header->header_size, header,
+                                     level, start, end, error))
+            return FALSE;
+
+          *start += header->header_size;
+          *end += header->header_size;
+          return TRUE;
+        }
+      break;
+
+    default:
+      break;
+    }
+
+  /* the levels follow each other, each one preceded by its size in KTX files.
+   * Blocks are at least 8 bytes so they are aligned to 4 bytes as they
+   * should */
+  *start = header->header_size;
+  width = header->width;
+  height = header->height;
+
+  for (i = 0; i <= level; i++)
+    {
+      level_size = pvr_format_info_get_level_size (info, width, height);
+
+      if (pvr_container_identify (data, size) == PVR_CONTAINER_KTX)
+        *start += sizeof (guint32);
+      if (i < level)
+        *start += level_size;
+
+      width = MAX (1, width / 2);
+      height = MAX (1, height / 2);
+    }
+
+  *end = *start + level_size;
+
+  return TRUE;
+}
+
+/*
+ * Copy the levels of the texture in data, whatever its container, one after
+ * the other into levels, inflating them if they are deflate compressed.
+ * levels_size has to be the size of the whole chain.
+ */
+static gboolean
+pvr_levels_read (const guchar        *data,
+                 gsize                size,
+                 const PVRHeader     *header,
+                 const PvrFormatInfo *info,
+                 guchar              *levels,
+                 gsize                levels_size)
+{
+  guint width, height, n_levels, i;
+  gsize start, end, level_size;
+  uLongf inflated_size;
+
+  width = header->width;
+  height = header->height;
+  n_levels = pvr_header_get_n_levels (header);
+
+  for (i = 0; i < n_levels; i++)
+    {
+      level_size = pvr_format_info_get_level_size (info, width, height);
+      if (level_size > levels_size ||
+          !pvr_level_lookup (data, size, header, info, i, &start, &end,
+                             NULL) ||
+          end > size)
+        return FALSE;
+
+      if (header->flags & PVR_FLAG_DEFLATE)
+        {
+          inflated_size = level_size;
+          if (uncompress (levels, &inflated_size, data + start,
+                          end - start) != Z_OK ||
+              inflated_size != level_size)
+            return FALSE;
+        }
+      else
+        {
+          if (end - start != level_size)
+            return FALSE;
+          memcpy (levels, data + start, level_size);
+        }
+
+      levels += level_size;
+      levels_size -= level_size;
+      width = MAX (1, width / 2);
+      height = MAX (1, height / 2);
+    }
+
+  return levels_size == 0;
+}
+
+/*
+ * Allocate the pixbuf a level described by header decodes into, and the
+ * surface pointing to its pixels.
+ */
+static GdkPixbuf *
+native_gdk_pixbuf_new (const PVRHeader      *header,
+                       const PvrFormatInfo  *info,
+                       PvrSurface           *surface,
+                       GError              **error)
+{
+  GdkPixbuf *pixbuf;
+  PvrSurfaceLayout layout;
+  gint64 trace;
+
+  if (((info->flags & PVR_FORMAT_TWIDDLED) ||
+       pvr_header_needs_untwiddle (header, info)) &&
+      (!is_p2 (header->width) || !is_p2 (header->height)))
+    {
+      g_set_error_literal (error,
+                           GDK_PIXBUF_ERROR,
+                           GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                           "Twiddled textures need power of 2 dimensions");
+      return NULL;
+    }
+
+  layout = pvr_pixel_format ();
+
+  trace = pvr_trace_begin ();
+  pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB,
+                           layout == PVR_SURFACE_BGRA_PREMULTIPLIED ||
+                           !(info->flags & PVR_FORMAT_OPAQUE), 8,
+                           header->width, header->height);
+  pvr_trace_end (trace, "pixbuf",
+                 pixbuf ? (guint64) gdk_pixbuf_get_rowstride (pixbuf) *
+                          header->height : 0);
+  if (pixbuf == NULL)
+    {
+      g_set_error_literal (error,
+                           GDK_PIXBUF_ERROR,
+                           GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+                           "Not enough memory to decode the image");
+      return NULL;
+    }
+
+  surface->pixels = gdk_pixbuf_get_pixels (pixbuf);
+  surface->rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+  surface->width = header->width;
+  surface->height = header->height;
+  surface->n_channels = gdk_pixbuf_get_n_channels (pixbuf);
+  surface->layout = layout;
+
+  if (header->flags & PVR_FLAG_VERTICAL_FLIP)
+    pvr_surface_flip (surface);
+
+  return pixbuf;
+}
+
+static void
+native_gdk_pixbuf_set_options (GdkPixbuf           *pixbuf,
+                               const PvrFormatInfo *info)
+{
+  /* let the user know the pixels are sRGB encoded, we don't convert them */
+  if (info->flags & PVR_FORMAT_SRGB)
+    gdk_pixbuf_set_option (pixbuf, "pvr::colorspace", "srgb");
+  else if (info->flags & PVR_FORMAT_LINEAR)
+    gdk_pixbuf_set_option (pixbuf, "pvr::colorspace", "linear");
+
+  if (pvr_pixel_format () == PVR_SURFACE_BGRA_PREMULTIPLIED)
+    gdk_pixbuf_set_option (pixbuf, "pvr::pixel-format", "premultiplied-bgra");
+}
+
+/*
+ * Decode the level described by header, the size bytes at data, with one of
+ * our own decoders writing the pixels straight into the pixbuf memory.
+ */
+static GdkPixbuf *
+native_gdk_pixbuf_new_from_level (const guchar         *data,
+                                  gsize                 size,
+                                  const PVRHeader      *header,
+                                  const PvrFormatInfo  *info,
+                                  GError              **error)
+{
+  GdkPixbuf *pixbuf;
+  PvrSurface surface;
+  guchar *linear = NULL;
+  gboolean untwiddle;
+  gsize level_size;
+  gint64 trace;
+
+  untwiddle = pvr_header_needs_untwiddle (header, info);
+  level_size = pvr_format_info_get_level_size (info, header->width,
+                                               header->height);
+  if (!(header->flags & PVR_FLAG_DEFLATE) && size < level_size)
+    {
+      g_set_error_literal (error,
+                           GDK_PIXBUF_ERROR,
+                           GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                           "Truncated PVR data");
+      return NULL;
+    }
+
+  pixbuf = native_gdk_pixbuf_new (header, info, &surface, error);
+  if (pixbuf == NULL)
+    return NULL;
+
+  /* this is also where the pages of a mapped file are faulted in */
+  trace = pvr_trace_begin ();
+  if (header->flags & PVR_FLAG_DEFLATE)
+    {
+      if (!inflate_decode (data, size, info, untwiddle, &surface, error))
+        {
+          g_object_unref (pixbuf);
+          return NULL;
+        }
+      pvr_trace_end (trace, "inflate-decode", size);
+    }
+  else
+    {
+      if (untwiddle)
+        {
+          linear = pvr_unpack_untwiddle (info, data, header->width,
+                                         header->height);
+          if (linear == NULL)
+            {
+              g_set_error_literal (error,
+                                   GDK_PIXBUF_ERROR,
+                                   GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+                                   "Not enough memory to decode the image");
+              g_object_unref (pixbuf);
+              return NULL;
+            }
+          data = linear;
+        }
+
+      info->decode (data, &surface,
+                    0, pvr_format_info_get_n_rows (info, header->height));
+      g_free (linear);
+      pvr_trace_end (trace, "decode", level_size);
+    }
+
+  native_gdk_pixbuf_set_options (pixbuf, info);
+
+  return pixbuf;
+}
+
+/* decode level 0 of the texture in data */
+static GdkPixbuf *
+native_gdk_pixbuf_new_from_memory (const guchar         *data,
+                                   gsize                 size,
+                                   const PVRHeader      *header,
+                                   const PvrFormatInfo  *info,
+                                   GError              **error)
+{
+  gsize start, end;
+
+  if (!pvr_level_lookup (data, size, header, info, 0, &start, &end, error))
+    return NULL;
+
+  if (end > size)
+    {
+      g_set_error_literal (error,
+                           GDK_PIXBUF_ERROR,
+                           GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                           "Truncated PVR data");
+      return NULL;
+    }
+
+  return native_gdk_pixbuf_new_from_level (data + start, end - start, header,
+                                           info, error);
+}
+
+static GdkPixbuf *
+pvr_gdk_pixbuf_new_from_memory (const guchar  *data,
+                                gsize          size,
+                                GError       **error)
+{
+  const PvrFormatInfo *info;
+  PVRHeader header;
+
+  if (!pvr_header_read (data, size, &header, error))
+    return NULL;
+
+  info = pvr_format_info_lookup ((PVRPixelType)
+                                 (header.flags & PVR_FLAG_PIXELTYPE));
+  if (info == NULL && (header.flags & PVR_FLAG_DEFLATE))
+    {
+      /* we never write those, PVRTexLib would not know what to do anyway */
+      g_set_error_literal (error,
+                           GDK_PIXBUF_ERROR,
+                           GDK_PIXBUF_ERROR_UNKNOWN_TYPE,
+                           "Unsupported deflate compressed pixel type");
+      return NULL;
+    }
+  if (info == NULL)
+    return pvrtexlib_gdk_pixbuf_new_from_memory (data, &header, error);
+
+  return native_gdk_pixbuf_new_from_memory (data, size, &header, info, error);
+}
+
+typedef struct
+{
+  gpointer address;
+  gsize length;
+} PvrMapping;
+
+static void
+on_mapping_destroyed (guchar   *pixels,
+                      gpointer  data)
+{
+  PvrMapping *mapping = (PvrMapping *) data;
+
+  munmap (mapping->address, mapping->length);
+  g_free (mapping);
+}
+
+/*
+ * When level 0 is stored exactly like GdkPixbuf wants its pixels, wrap the
+ * mapped file instead of copying it. The pixbuf then owns the mapping.
+ * Returns NULL if the texture can't be used in place.
+ */
+static GdkPixbuf *
+mapped_gdk_pixbuf_new (guchar *content,
+                       gsize   size)
+{
+  const PvrFormatInfo *info;
+  PvrMapping *mapping;
+  GdkPixbuf *pixbuf;
+  PVRHeader header;
+
+  /* the file is RGBA, not what the user asked for */
+  if (pvr_pixel_format () != PVR_SURFACE_RGBA)
+    return NULL;
+
+  if (!pvr_header_read (content, size, &header, NULL))
+    return NULL;
+
+  info = pvr_format_info_lookup ((PVRPixelType)
+                                 (header.flags & PVR_FLAG_PIXELTYPE));
+  if (info == NULL || !(info->flags & PVR_FORMAT_PIXBUF_LAYOUT) ||
+      (header.flags & (PVR_FLAG_VERTICAL_FLIP | PVR_FLAG_DEFLATE |
+                       PVR_FLAG_TWIDDLE)) ||
+      header.header_size % 4 != 0 ||
+      size - header.header_size <
+      pvr_format_info_get_level_size (info, header.width, header.height))
+    return NULL;
+
+  mapping = g_new (PvrMapping, 1);
+  mapping->address = content;
+  mapping->length = size;
+
+  pixbuf = gdk_pixbuf_new_from_data (content + header.header_size,
+                                     GDK_COLORSPACE_RGB,
+                                     !(info->flags & PVR_FORMAT_OPAQUE),
+                                     8,
+                                     header.width,
+                                     header.height,
+                                     header.width * info->block_size,
+                                     on_mapping_destroyed,
+                                     mapping);
+
+  native_gdk_pixbuf_set_options (pixbuf, info);
+
+  return pixbuf;
+}
+
+static GdkPixbuf *
+gdk_pixbuf__pvr_image_load (FILE    *f,
+                            GError **error)
+{
+  GdkPixbuf *pixbuf;
+  guchar *content;
+  GError *decompress_error = NULL;
+  struct stat st;
+  gint64 trace_load, trace;
+  int fd;
+
+  trace_load = pvr_trace_begin ();
+
+  fd = fileno (f);
+  if (fd == -1)
+    {
+      g_set_error_literal (error,
+                           GDK_PIXBUF_ERROR,
+                           GDK_PIXBUF_ERROR_FAILED,
+                           "Invalid FILE object");
+      return NULL;
+    }
+
+  if (fstat (fd, &st) == -1)
+    {
+      g_set_error_literal (error,
+                           GDK_PIXBUF_ERROR,
+                           GDK_PIXBUF_ERROR_FAILED,
+                           "Failed to get attributes");
+      return NULL;
+
+    }
+
+  /* the mapping is private and writable so it can back a pixbuf the user is
+   * free to modify, pages are only copied if that happens */
+  if (st.st_size == 0 || st.st_size > G_MAXSIZE)
+    {
+      content = NULL;
+    }
+  else
+    {
+      trace = pvr_trace_begin ();
+      content = (unsigned char *) mmap (NULL, st.st_size,
+                                        PROT_READ | PROT_WRITE,
+                                        MAP_PRIVATE, fd, 0);
+      pvr_trace_end (trace, "mmap", st.st_size);
+    }
+
+  if (content == NULL || content == MAP_FAILED)
+    {
+      g_set_error_literal (error,
+                           GDK_PIXBUF_ERROR,
+                           GDK_PIXBUF_ERROR_FAILED,
+                           "Failed to map file");
+      return NULL;
+    }
+
+  trace = pvr_trace_begin ();
+  pixbuf = mapped_gdk_pixbuf_new (content, st.st_size);
+  if (pixbuf)
+    {
+      pvr_trace_end (trace, "wrap", st.st_size);
+      pvr_trace_end (trace_load, "load", st.st_size);
+      return pixbuf;
+    }
+
+  pixbuf = pvr_gdk_pixbuf_new_from_memory (content, st.st_size,
+                                           &decompress_error);
+  munmap (content, st.st_size);
+
+  if (decompress_error)
+    {
+      g_propagate_error (error, decompress_error);
+      return NULL;
+    }
+
+  pvr_trace_end (trace_load, "load", st.st_size);
+
+  return pixbuf;
+}
+
+static gboolean
+parse_format (const gchar *format,
+              PixelType   *type)
+{
+  if (g_strcmp0 (format, "PVRTC2") == 0)
+    {
+      *type = OGL_PVRTC2;
+      return TRUE;
+    }
+  if (g_strcmp0 (format, "PVRTC4") == 0)
+    {
+      *type = OGL_PVRTC4;
+      return TRUE;
+    }
+  if (g_strcmp0 (format, "ETC1") == 0)
+    {
+      *type = ETC_RGB_4BPP;
+      return TRUE;
+    }
+  /* PVRTexLib doesn't know about ETC2, we encode it ourselves */
+  if (g_strcmp0 (format, "ETC2_RGB") == 0)
+    {
+      *type = (PixelType) PVR_ETC2_RGB;
+      return TRUE;
+    }
+  if (g_strcmp0 (format, "ETC2_RGB_A1") == 0)
+    {
+      *type = (PixelType) PVR_ETC2_RGB_A1;
+      return TRUE;
+    }
+  if (g_strcmp0 (format, "ETC2_RGBA") == 0)
+    {
+      *type = (PixelType) PVR_ETC2_RGBA;
+      return TRUE;
+    }
+  if (g_strcmp0 (format, "RGB565") == 0)
+    {
+      *type = OGL_RGB_565;
+      return TRUE;
+    }
+  if (g_strcmp0 (format, "RGBA4444") == 0)
+    {
+      *type = OGL_RGBA_4444;
+      return TRUE;
+    }
+
+  *type = ETC_RGB_4BPP;
+  return FALSE;
+}
+
+static gboolean
+parse_boolean (const gchar *value,
+               gboolean    *result)
+{
+  if (g_strcmp0 (value, "yes") == 0 || g_strcmp0 (value, "true") == 0)
+    {
+      *result = TRUE;
+      return TRUE;
+    }
+  if (g_strcmp0 (value, "no") == 0 || g_strcmp0 (value, "false") == 0)
+    {
+      *result = FALSE;
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+static gboolean
+parse_quality (const gchar *quality,
+               PvrQuality  *level)
+{
+  if (g_strcmp0 (quality, "fast") == 0)
+    {
+      *level = PVR_QUALITY_FAST;
+      return TRUE;
+    }
+  if (g_strcmp0 (quality, "normal") == 0)
+    {
+      *level = PVR_QUALITY_NORMAL;
+      return TRUE;
+    }
+  if (g_strcmp0 (quality, "exhaustive") == 0)
+    {
+      *level = PVR_QUALITY_EXHAUSTIVE;
+      return TRUE;
+    }
+
+  *level = PVR_QUALITY_NORMAL;
+  return FALSE;
+}
+
+static gboolean
+validate_pixbuf_pvrtc (GdkPixbuf  *pixbuf,
+                       GError    **error)
+{
+  int width, height;
+
+  width = gdk_pixbuf_get_width (pixbuf);
+  height = gdk_pixbuf_get_height (pixbuf);
+
+  if (!is_p2 (width))
+    {
+      g_set_error_literal (error,
+                           GDK_PIXBUF_ERROR,
+                           GDK_PIXBUF_ERROR_FAILED,
+                           "Width needs to be a power of 2");
+      return FALSE;
+    }
+
+  if (!is_p2 (height))
+    {
+      g_set_error_literal (error,
+                           GDK_PIXBUF_ERROR,
+                           GDK_PIXBUF_ERROR_FAILED,
+                           "Height needs to be a power of 2");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/*
+ * Incremental updates.
+ *
+ * With the block-hashes option, the saver writes a sidecar file holding a hash
+ * of the source pixels of each level 0 block, along with a hash of the texture
+ * data it produced. When saving again with the previous texture as reference,
+ * only the blocks whose source pixels changed (and the blocks of the smaller
+ * levels they end up in) are encoded again, the others are copied from the
+ * reference. This needs encoders whose blocks are independent of each other,
+ * which is the case of ETC1 but not of PVRTC, for instance.
+ *
+ * The sidecar is a little endian file: "PVRH", a version, the number of
+ * blocks per row and per column, the quality and a padding word (all 32
+ * bits), then the 64 bits hash of the texture data followed by the hashes of
+ * the blocks, row by row. The reference is only used if everything matches.
+ */
+
+#define BLOCK_HASHES_MAGIC    0x48525650    /* "PVRH" */
+#define BLOCK_HASHES_VERSION  1
+#define BLOCK_HASHES_HEADER   32
+
+/* hash the source pixels of each block of image, row padding excluded */
+static guint64 *
+hash_source_blocks (const PvrSurface    *image,
+                    const PvrFormatInfo *info)
+{
+  guint64 *hashes, *hash;
+  guint blocks_x, blocks_y, bx, by, x, y, width, height;
+
+  blocks_x = (image->width + info->block_width - 1) / info->block_width;
+  blocks_y = pvr_format_info_get_n_rows (info, image->height);
+  hashes = hash = g_new (guint64, (gsize) blocks_x * blocks_y);
+
+  for (by = 0; by < blocks_y; by++)
+    {
+      y = by * info->block_height;
+      height = MIN (info->block_height, image->height - y);
+
+      for (bx = 0; bx < blocks_x; bx++, hash++)
+        {
+          const guchar *row;
+          guint i;
+
+          x = bx * info->block_width;
+          width = MIN (info->block_width, image->width - x);
+
+          row = image->pixels + (gssize) y * image->rowstride +
+                x * image->n_channels;
+
+          *hash = image->n_channels;
+          for (i = 0; i < height; i++, row += image->rowstride)
+            *hash = pvr_hash_bytes (*hash, row, width * image->n_channels);
+        }
+    }
+
+  return hashes;
+}
+
+static void
+block_hashes_free (guint8 **dirty,
+                   guint    n_levels)
+{
+  guint i;
+
+  for (i = 0; i < n_levels; i++)
+    g_free (dirty[i]);
+  g_free (dirty);
+}
+
+/*
+ * Compare hashes to the ones of the block_hashes sidecar and, if the
+ * reference texture is the one the sidecar describes, copy its data and
+ * return the masks of the blocks to encode again. NULL means everything has
+ * to be encoded.
+ */
+static guint8 **
+block_hashes_load (const gchar         *reference,
+                   const gchar         *block_hashes,
+                   const PvrFormatInfo *info,
+                   const PvrSurface    *levels,
+                   guint                n_levels,
+                   PvrQuality           quality,
+                   const guint64       *hashes,
+                   guchar              *data,
+                   gsize                size)
+{
+  PVRHeader header;
+  guint8 **dirty = NULL, *changed;
+  gchar *sidecar = NULL, *texture = NULL;
+  gsize sidecar_size, texture_size;
+  guint32 words[6];
+  guint64 h;
+  guint blocks_x, blocks_y, n_blocks, i, bx, by;
+
+  blocks_x = (levels[0].width + info->block_width - 1) / info->block_width;
+  blocks_y = pvr_format_info_get_n_rows (info, levels[0].height);
+  n_blocks = blocks_x * blocks_y;
+
+  /* the sidecar has to describe a level 0 of the same size, encoded with the
+   * same quality */
+  if (!g_file_get_contents (block_hashes, &sidecar, &sidecar_size, NULL) ||
+      sidecar_size != BLOCK_HASHES_HEADER + (gsize) n_blocks * 8)
+    goto out;
+
+  memcpy (words, sidecar, sizeof (words));
+  if (GUINT32_FROM_LE (words[0]) != BLOCK_HASHES_MAGIC ||
+      GUINT32_FROM_LE (words[1]) != BLOCK_HASHES_VERSION ||
+      GUINT32_FROM_LE (words[2]) != blocks_x ||
+      GUINT32_FROM_LE (words[3]) != blocks_y ||
+      GUINT32_FROM_LE (words[4]) != (guint32) quality)
+    goto out;
+
+  /* and the reference has to be the texture it was written with */
+  if (!g_file_get_contents (reference, &texture, &texture_size, NULL) ||
+      !pvr_header_read ((const guchar *) texture, texture_size, &header,
+                        NULL))
+    goto out;
+
+  if ((header.flags & PVR_FLAG_PIXELTYPE) != info->pixel_type ||
+      (header.flags & (PVR_FLAG_TWIDDLE | PVR_FLAG_VERTICAL_FLIP)) ||
+      header.width != levels[0].width || header.height != levels[0].height ||
+      header.mipmap_count != n_levels - 1)
+    goto out;
+
+  /* data is encoded from scratch if we bail out after that */
+  if (!pvr_levels_read ((const guchar *) texture, texture_size, &header, info,
+                        data, size))
+    goto out;
+
+  memcpy (&h, sidecar + 24, 8);
+  if (GUINT64_FROM_LE (h) != pvr_hash_bytes (0, data, size))
+    goto out;
+
+  changed = g_new (guint8, n_blocks);
+  for (i = 0; i < n_blocks; i++)
+    {
+      memcpy (&h, sidecar + BLOCK_HASHES_HEADER + i * 8, 8);
+      changed[i] = GUINT64_FROM_LE (h) != hashes[i];
+    }
+
+  /* a level i block covers 2^i x 2^i blocks of level 0, see the box filter
+   * of gdk-pixbuf-pvr-mipmap.cc */
+  dirty = g_new (guint8 *, n_levels);
+  for (i = 0; i < n_levels; i++)
+    {
+      guint level_x, level_y;
+
+      level_x = (levels[i].width + info->block_width - 1) / info->block_width;
+      level_y = pvr_format_info_get_n_rows (info, levels[i].height);
+      dirty[i] = g_new0 (guint8, level_x * level_y);
+
+      for (by = 0; by < blocks_y; by++)
+        for (bx = 0; bx < blocks_x; bx++)
+          {
+            if (changed[by * blocks_x + bx])
+              dirty[i][MIN (by >> i, level_y - 1) * level_x +
+                       MIN (bx >> i, level_x - 1)] = 1;
+          }
+    }
+
+  g_free (changed);
+
+out:
+  g_free (sidecar);
+  g_free (texture);
+
+  return dirty;
+}
+
+static gboolean
+block_hashes_save (const gchar          *block_hashes,
+                   const PvrFormatInfo  *info,
+                   const PvrSurface     *image,
+                   PvrQuality            quality,
+                   const guint64        *hashes,
+                   const guchar         *data,
+                   gsize                 size,
+                   GError              **error)
+{
+  guint32 words[6];
+  guint64 *contents;
+  guint blocks_x, blocks_y, n_blocks, i;
+  gboolean success;
+
+  blocks_x = (image->width + info->block_width - 1) / info->block_width;
+  blocks_y = pvr_format_info_get_n_rows (info, image->height);
+  n_blocks = blocks_x * blocks_y;
+
+  words[0] = GUINT32_TO_LE (BLOCK_HASHES_MAGIC);
+  words[1] = GUINT32_TO_LE (BLOCK_HASHES_VERSION);
+  words[2] = GUINT32_TO_LE (blocks_x);
+  words[3] = GUINT32_TO_LE (blocks_y);
+  words[4] = GUINT32_TO_LE ((guint32) quality);
+  words[5] = 0;
+
+  contents = g_new (guint64, BLOCK_HASHES_HEADER / 8 + n_blocks);
+  memcpy (contents, words, sizeof (words));
+  contents[3] = GUINT64_TO_LE (pvr_hash_bytes (0, data, size));
+  for (i = 0; i < n_blocks; i++)
+    contents[BLOCK_HASHES_HEADER / 8 + i] = GUINT64_TO_LE (hashes[i]);
+
+  success = g_file_set_contents (block_hashes, (const gchar *) contents,
+                                 BLOCK_HASHES_HEADER + (gsize) n_blocks * 8,
+                                 error);
+  g_free (contents);
+
+  return success;
+}
+
+/*
+ * Write the levels of a texture of a format found in ktx_formats, described
+ * by header, as a KTX file.
+ */
+static gboolean
+ktx_write (FILE                *f,
+           const PVRHeader     *header,
+           const PvrFormatInfo *info,
+           const guchar        *data)
+{
+  static const gchar orientation[] = "KTXorientation\0S=r,T=d";
+  const KtxFormat *format;
+  guint32 words[13], image_size;
+  guchar kvd[4 + ((sizeof (orientation) + 3) & ~3)];
+  guint width, height, i;
+
+  format = ktx_format_lookup (info->pixel_type);
+
+  /* an orientation key, padded to 4 bytes */
+  memset (kvd, 0, sizeof (kvd));
+  image_size = sizeof (orientation);
+  memcpy (kvd, &image_size, sizeof (guint32));
+  memcpy (kvd + sizeof (guint32), orientation, sizeof (orientation));
+
+  /* the endianness field tells readers the words are in host order */
+  words[0] = KTX_ENDIANNESS;
+  words[1] = 0;                 /* glType, 0 for compressed formats */
+  words[2] = 1;                 /* glTypeSize */
+  words[3] = 0;                 /* glFormat */
+  words[4] = format->gl_internal_format;
+  words[5] = format->gl_base_internal_format;
+  words[6] = header->width;
+  words[7] = header->height;
+  words[8] = 0;                 /* pixelDepth */
+  words[9] = 0;                 /* numberOfArrayElements */
+  words[10] = 1;                /* numberOfFaces */
+  words[11] = header->mipmap_count + 1;
+  words[12] = sizeof (kvd);
+
+  if (fwrite (ktx_identifier, sizeof (ktx_identifier), 1, f) != 1 ||
+      fwrite (words, sizeof (words), 1, f) != 1 ||
+      fwrite (kvd, sizeof (kvd), 1, f) != 1)
+    return FALSE;
+
+  width = header->width;
+  height = header->height;
+
+  for (i = 0; i <= header->mipmap_count; i++)
+    {
+      image_size = pvr_format_info_get_level_size (info, width, height);
+
+      if (fwrite (&image_size, sizeof (guint32), 1, f) != 1 ||
+          fwrite (data, image_size, 1, f) != 1)
+        return FALSE;
+
+      data += image_size;
+      width = MAX (1, width / 2);
+      height = MAX (1, height / 2);
+    }
+
+  return TRUE;
+}
+
+/* append a key/value pair to the KTX2 key/value data in kvd */
+static void
+ktx2_kvd_append (GByteArray  *kvd,
+                 const gchar *key,
+                 const gchar *value)
+{
+  static const guint8 padding[3] = { 0, };
+  guint32 entry_size;
+
+  entry_size = strlen (key) + 1 + strlen (value) + 1;
+  entry_size = GUINT32_TO_LE (entry_size);
+
+  g_byte_array_append (kvd, (const guint8 *) &entry_size, sizeof (guint32));
+  g_byte_array_append (kvd, (const guint8 *) key, strlen (key) + 1);
+  g_byte_array_append (kvd, (const guint8 *) value, strlen (value) + 1);
+  g_byte_array_append (kvd, padding, (4 - kvd->len % 4) % 4);
+}
+
+/*
+ * Write the levels of a texture of a format found in ktx_formats, described
+ * by header, as a KTX2 file. The levels are stored from the smallest one and
+ * aligned to the block size, unless they are deflate compressed.
+ */
+static gboolean
+ktx2_write (FILE                *f,
+            const PVRHeader     *header,
+            const PvrFormatInfo *info,
+            const guchar        *data,
+            gsize                size,
+            gboolean             deflate)
+{
+  static const guint8 zeros[16] = { 0, };
+  const KtxFormat *format;
+  GByteArray *kvd;
+  const guchar **levels;
+  guint32 words[17], dfd[15], dfd_size, *table;
+  guint64 *index;
+  guchar *deflated = NULL;
+  gsize table_size, offset, alignment, deflated_size;
+  guint n_levels, width, height, i;
+  gboolean success = FALSE;
+
+  format = ktx_format_lookup (info->pixel_type);
+  n_levels = header->mipmap_count + 1;
+
+  /* the level index, with the size and uncompressed size of each level */
+  index = g_new0 (guint64, n_levels * 3);
+  levels = g_new (const guchar *, n_levels);
+  width = header->width;
+  height = header->height;
+  for (i = 0, offset = 0; i < n_levels; i++)
+    {
+      index[i * 3 + 1] = pvr_format_info_get_level_size (info, width, height);
+      index[i * 3 + 2] = index[i * 3 + 1];
+      levels[i] = data + offset;
+
+      offset += index[i * 3 + 1];
+      width = MAX (1, width / 2);
+      height = MAX (1, height / 2);
+    }
+
+  /* reuse our deflate table to find the zlib stream of each level */
+  if (deflate)
+    {
+      deflated = deflate_levels (info, header->width, header->height,
+                                 n_levels, data, size, &deflated_size);
+      if (deflated == NULL)
+        goto out;
+
+      table = g_new (guint32, n_levels + 1);
+      table_size = (n_levels + 1) * sizeof (guint32);
+      memcpy (table, deflated, table_size);
+
+      for (i = 0; i < n_levels; i++)
+        {
+          levels[i] = deflated + table_size + GUINT32_FROM_LE (table[i]);
+          index[i * 3 + 1] = GUINT32_FROM_LE (table[i + 1]) -
+                             GUINT32_FROM_LE (table[i]);
+        }
+
+      g_free (table);
+    }
+
+  /* the basic data format descriptor, with a single sample covering the
+   * whole block, except for ETC2 RGBA blocks where the EAC alpha comes
+   * before the colour */
+  dfd[1] = 0;                                   /* Khronos, basic */
+  dfd[3] = format->color_model | 1 << 8 | 1 << 16;  /* BT.709, linear */
+  dfd[4] = (info->block_width - 1) | (info->block_height - 1) << 8;
+  dfd[5] = info->block_size;                    /* bytesPlane0 */
+  dfd[6] = 0;
+  if (format->color_model == 161 && info->block_size == 16)
+    {
+      dfd[7] = 63 << 16 | 15 << 24;             /* bitLength, alpha */
+      dfd[11] = 64 | 63 << 16 | 2 << 24;        /* offset, length, colour */
+      dfd_size = sizeof (dfd);
+    }
+  else
+    {
+      /* the colour channel of ETC2 is 2, 0 for the other models */
+      dfd[7] = (info->block_size * 8 - 1) << 16 |
+               (format->color_model == 161 ? 2 : 0) << 24;
+      dfd_size = sizeof (dfd) - 4 * sizeof (guint32);
+    }
+  dfd[8] = dfd[12] = 0;
+  dfd[9] = dfd[13] = 0;
+  dfd[10] = dfd[14] = 0xffffffff;
+  dfd[0] = dfd_size;
+  dfd[2] = 2 | (dfd_size - 4) << 16;            /* version 1.3, size */
+  for (i = 0; i < G_N_ELEMENTS (dfd); i++)
+    dfd[i] = GUINT32_TO_LE (dfd[i]);
+
+  kvd = g_byte_array_new ();
+  ktx2_kvd_append (kvd, "KTXorientation", "rd");
+  ktx2_kvd_append (kvd, "KTXwriter", "gdk-pixbuf-pvr");
+
+  words[0] = format->vk_format;
+  words[1] = 1;                                 /* typeSize */
+  words[2] = header->width;
+  words[3] = header->height;
+  words[4] = 0;                                 /* pixelDepth */
+  words[5] = 0;                                 /* layerCount */
+  words[6] = 1;                                 /* faceCount */
+  words[7] = n_levels;
+  words[8] = deflate ? KTX2_SUPERCOMPRESSION_ZLIB : 0;
+  words[9] = KTX2_HEADER_SIZE + n_levels * KTX2_LEVEL_INDEX_SIZE;
+  words[10] = dfd_size;
+  words[11] = words[9] + words[10];
+  words[12] = kvd->len;
+  memset (words + 13, 0, 4 * sizeof (guint32)); /* no global data */
+
+  /* the levels go from the smallest one */
+  alignment = deflate ? 1 : info->block_size;
+  offset = words[11] + words[12];
+  for (i = n_levels; i-- > 0;)
+    {
+      offset = (offset + alignment - 1) / alignment * alignment;
+      index[i * 3] = offset;
+      offset += index[i * 3 + 1];
+    }
+
+  for (i = 0; i < G_N_ELEMENTS (words); i++)
+    words[i] = GUINT32_TO_LE (words[i]);
+  for (i = 0; i < n_levels * 3; i++)
+    index[i] = GUINT64_TO_LE (index[i]);
+
+  if (fwrite (ktx2_identifier, sizeof (ktx2_identifier), 1, f) != 1 ||
+      fwrite (words, sizeof (words), 1, f) != 1 ||
+      fwrite (index, sizeof (guint64), n_levels * 3, f) != n_levels * 3 ||
+      fwrite (dfd, dfd_size, 1, f) != 1 ||
+      fwrite (kvd->data, 1, kvd->len, f) != kvd->len)
+    goto free_kvd;
+
+  offset = GUINT32_FROM_LE (words[11]) + GUINT32_FROM_LE (words[12]);
+  for (i = n_levels; i-- > 0;)
+    {
+      gsize start, length;
+
+      start = GUINT64_FROM_LE (index[i * 3]);
+      length = GUINT64_FROM_LE (index[i * 3 + 1]);
+
+      if (fwrite (zeros, 1, start - offset, f) != start - offset ||
+          fwrite (levels[i], 1, length, f) != length)
+        goto free_kvd;
+
+      offset = start + length;
+    }
+
+  success = TRUE;
+
+free_kvd:
+  g_byte_array_free (kvd, TRUE);
+out:
+  g_free (deflated);
+  g_free (levels);
+  g_free (index);
+
+  return success;
+}
+
+static void
+pvr_header_init (PVRHeader           *header,
+                 const PvrFormatInfo *info,
+                 guint                width,
+                 guint                height,
+                 guint                n_levels)
+{
+  memset (header, 0, sizeof (PVRHeader));
+  header->header_size = sizeof (PVRHeader);
+  header->height = height;
+  header->width = width;
+  header->mipmap_count = n_levels - 1;
+  header->flags = info->pixel_type;
+  if (n_levels > 1)
+    header->flags |= PVR_FLAG_MIPMAP;
+  if (info->flags & PVR_FORMAT_TWIDDLED)
+    header->flags |= PVR_FLAG_TWIDDLE;
+  header->bit_count = info->block_size * 8 /
+                      (info->block_width * info->block_height);
+  header->PVR = PVR_FLAG_IDENTIFIER;
+  header->n_surfaces = 1;
+}
+
+/*
+ * Write header followed by the size bytes of the levels it describes,
+ * deflate compressed if asked to. data_size is filled in here. KTX files get
+ * their own header describing the same texture, see ktx_formats for the
+ * formats they can hold.
+ */
+static gboolean
+pvr_texture_write (FILE                 *f,
+                   PvrContainer          container,
+                   PVRHeader            *header,
+                   const PvrFormatInfo  *info,
+                   const guchar         *data,
+                   gsize                 size,
+                   gboolean              deflate,
+                   GError              **error)
+{
+  guchar *deflated = NULL;
+  gsize levels_size = 0;
+  guint width, height, i;
+  gboolean success;
+  gint64 trace;
+
+  if (container != PVR_CONTAINER_PVR)
+    {
+      width = header->width;
+      height = header->height;
+      for (i = 0; i <= header->mipmap_count; i++)
+        {
+          levels_size += pvr_format_info_get_level_size (info, width, height);
+          width = MAX (1, width / 2);
+          height = MAX (1, height / 2);
+        }
+
+      trace = pvr_trace_begin ();
+      if (container == PVR_CONTAINER_KTX)
+        success = levels_size == size && ktx_write (f, header, info, data);
+      else
+        success = levels_size == size &&
+                  ktx2_write (f, header, info, data, size, deflate);
+
+      if (!success)
+        {
+          g_set_error_literal (error,
+                               GDK_PIXBUF_ERROR,
+                               GDK_PIXBUF_ERROR_FAILED,
+                               "Failed to write the texture");
+          return FALSE;
+        }
+      pvr_trace_end (trace, "write", size);
+
+      return TRUE;
+    }
+
+  if (deflate)
+    {
+      trace = pvr_trace_begin ();
+      deflated = deflate_levels (info, header->width, header->height,
+                                 header->mipmap_count + 1, data, size,
+                                 &size);
+      if (deflated == NULL)
+        {
+          g_set_error_literal (error,
+                               GDK_PIXBUF_ERROR,
+                               GDK_PIXBUF_ERROR_FAILED,
+                               "Failed to deflate the texture");
+          return FALSE;
+        }
+      pvr_trace_end (trace, "deflate", size);
+
+      header->flags |= PVR_FLAG_DEFLATE;
+      data = deflated;
+    }
+
+  header->data_size = size;
+
+  trace = pvr_trace_begin ();
+  if (fwrite (header, sizeof (PVRHeader), 1, f) != 1 ||
+      fwrite (data, size, 1, f) != 1)
+    {
+      g_set_error_literal (error,
+                           GDK_PIXBUF_ERROR,
+                           GDK_PIXBUF_ERROR_FAILED,
+                           "Failed to write the texture");
+      g_free (deflated);
+      return FALSE;
+    }
+  pvr_trace_end (trace, "write", sizeof (PVRHeader) + size);
+
+  g_free (deflated);
+
+  return TRUE;
+}
+
+/*
+ * Encode pixbuf with one of our own encoders. Those read the pixbuf in place
+ * so, contrary to PVRTexLib, any row stride and RGB pixbufs are fine.
+ * reference and block_hashes can be NULL, see the incremental updates above.
+ */
+static gboolean
+native_image_save (FILE                 *f,
+                   GdkPixbuf            *pixbuf,
+                   const PvrFormatInfo  *info,
+                   PvrQuality            quality,
+                   gboolean              mipmaps,
+                   PvrContainer          container,
+                   gboolean              deflate,
+                   guint                 n_threads,
+                   const gchar          *reference,
+                   const gchar          *block_hashes,
+                   GError              **error)
+{
+  PVRHeader header;
+  PvrSurface *levels;
+  guchar *chain = NULL, *data = NULL;
+  guint8 **dirty = NULL;
+  guint64 *hashes = NULL;
+  gboolean success = TRUE;
+  gsize size, chain_size;
+  guint n_levels, i;
+  gint64 trace;
+
+  n_levels = 1;
+  if (mipmaps)
+    n_levels = pvr_mipmap_get_n_levels (gdk_pixbuf_get_width (pixbuf),
+                                        gdk_pixbuf_get_height (pixbuf));
+
+  levels = g_new (PvrSurface, n_levels);
+  levels[0].pixels = gdk_pixbuf_get_pixels (pixbuf);
+  levels[0].rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+  levels[0].width = gdk_pixbuf_get_width (pixbuf);
+  levels[0].height = gdk_pixbuf_get_height (pixbuf);
+  levels[0].n_channels = gdk_pixbuf_get_n_channels (pixbuf);
+  levels[0].layout = PVR_SURFACE_RGBA;
+
+  if (n_levels > 1)
+    {
+      chain_size = pvr_mipmap_chain_layout (levels, n_levels, NULL);
+      chain = (guchar *) g_try_malloc (chain_size);
+      if (chain == NULL)
+        goto oom;
+
+      trace = pvr_trace_begin ();
+      pvr_mipmap_chain_layout (levels, n_levels, chain);
+      pvr_mipmap_chain_generate (levels, n_levels);
+      pvr_trace_end (trace, "mipmaps", chain_size);
+    }
+
+  size = 0;
+  for (i = 0; i < n_levels; i++)
+    size += pvr_format_info_get_level_size (info, levels[i].width,
+                                            levels[i].height);
+
+  data = (guchar *) g_try_malloc (size);
+  if (data == NULL)
+    goto oom;
+
+  /* uncompressed formats are a plain conversion, there is nothing to save by
+   * tracking their pixels one by one */
+  if (info->block_width == 1 && info->block_height == 1)
+    block_hashes = NULL;
+
+  if (block_hashes)
+    {
+      hashes = hash_source_blocks (&levels[0], info);
+
+      if (reference)
+        dirty = block_hashes_load (reference, block_hashes, info, levels,
+                                   n_levels, quality, hashes, data, size);
+    }
+
+  trace = pvr_trace_begin ();
+  pvr_format_info_encode_levels (info, levels, n_levels, data, dirty, quality,
+                                 n_threads);
+  pvr_trace_end (trace, "encode", size);
+
+  if (dirty)
+    block_hashes_free (dirty, n_levels);
+
+  g_free (chain);
+
+  pvr_header_init (&header, info, levels[0].width, levels[0].height,
+                   n_levels);
+  success = pvr_texture_write (f, container, &header, info, data, size,
+                              deflate, error);
+
+  if (success && block_hashes)
+    {
+      success = block_hashes_save (block_hashes, info, &levels[0], quality,
+                                   hashes, data, size, error);
+    }
+
+  g_free (levels);
+  g_free (hashes);
+  g_free (data);
+
+  return success;
+
+oom:
+  g_set_error_literal (error,
+                       GDK_PIXBUF_ERROR,
+                       GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+                       "Not enough memory to encode the image");
+  g_free (levels);
+  g_free (chain);
+  return FALSE;
+}
+
+/* write the pixels of pixbuf as RGBA 8888 rows without padding */
+static void
+pack_rgba (GdkPixbuf *pixbuf,
+           guchar    *dest)
+{
+  const guchar *row;
+  guint width, height, n_channels, x, y;
+  gint rowstride;
+
+  width = gdk_pixbuf_get_width (pixbuf);
+  height = gdk_pixbuf_get_height (pixbuf);
+  n_channels = gdk_pixbuf_get_n_channels (pixbuf);
+  rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+  row = gdk_pixbuf_get_pixels (pixbuf);
+
+  for (y = 0; y < height; y++, row += rowstride)
+    {
+      if (n_channels == 4)
+        {
+          memcpy (dest, row, width * 4);
+          dest += width * 4;
+          continue;
+        }
+
+      for (x = 0; x < width; x++, dest += 4)
+        {
+          dest[0] = row[x * 3];
+          dest[1] = row[x * 3 + 1];
+          dest[2] = row[x * 3 + 2];
+          dest[3] = 0xff;
+        }
+    }
+}
+
+static gboolean
+gdk_pixbuf__pvr_image_save (FILE       *f,
+                            GdkPixbuf  *pixbuf,
+                            gchar     **param_keys,
+                            gchar     **param_values,
+                            GError    **error_out)
+{
+  PixelType opt_format = ETC_RGB_4BPP;
+  PvrQuality opt_quality = PVR_QUALITY_NORMAL;
+  guint opt_threads = 0;
+  gboolean opt_mipmaps = FALSE, opt_deflate = FALSE;
+  PvrContainer opt_container = PVR_CONTAINER_PVR;
+  const gchar *opt_reference = NULL, *opt_block_hashes = NULL;
+  guchar *rgba = NULL;
+  const PvrFormatInfo *info;
+  gboolean valid;
+  GError *error = NULL;
+  gint64 trace_save, trace;
+
+  trace_save = pvr_trace_begin ();
+
+  /* parse the parameters */
+  if (param_keys)
     {
       gchar **key_p = param_keys, **value_p = param_values;
 
-      while (*key_p)
-        {
-          if (g_strcmp0 (*key_p, "format") == 0)
+      while (*key_p)
+        {
+          if (g_strcmp0 (*key_p, "format") == 0)
+            {
+              if (!parse_format (*value_p, &opt_format))
+                {
+                  g_set_error (error_out,
+                               GDK_PIXBUF_ERROR,
+                               GDK_PIXBUF_ERROR_FAILED,
+                               "Invalid format %s", *value_p);
+                  return FALSE;
+                }
+            }
+          else if (g_strcmp0 (*key_p, "quality") == 0)
+            {
+              if (!parse_quality (*value_p, &opt_quality))
+                {
+                  g_set_error (error_out,
+                               GDK_PIXBUF_ERROR,
+                               GDK_PIXBUF_ERROR_FAILED,
+                               "Invalid quality %s", *value_p);
+                  return FALSE;
+                }
+            }
+          else if (g_strcmp0 (*key_p, "mipmaps") == 0)
+            {
+              if (!parse_boolean (*value_p, &opt_mipmaps))
+                {
+                  g_set_error (error_out,
+                               GDK_PIXBUF_ERROR,
+                               GDK_PIXBUF_ERROR_FAILED,
+                               "Invalid mipmaps value %s", *value_p);
+                  return FALSE;
+                }
+            }
+          else if (g_strcmp0 (*key_p, "threads") == 0)
+            {
+              gchar *end;
+
+              /* 0, the default, means one thread per processor */
+              opt_threads = g_ascii_strtoull (*value_p, &end, 10);
+              if (*value_p == end || *end != '\0')
+                {
+                  g_set_error (error_out,
+                               GDK_PIXBUF_ERROR,
+                               GDK_PIXBUF_ERROR_FAILED,
+                               "Invalid number of threads %s", *value_p);
+                  return FALSE;
+                }
+            }
+          else if (g_strcmp0 (*key_p, "container") == 0)
             {
-              if (!parse_format (*value_p, &opt_format))
+              if (g_strcmp0 (*value_p, "pvr") == 0)
+                opt_container = PVR_CONTAINER_PVR;
+              else if (g_strcmp0 (*value_p, "ktx") == 0)
+                opt_container = PVR_CONTAINER_KTX;
+              else if (g_strcmp0 (*value_p, "ktx2") == 0)
+                opt_container = PVR_CONTAINER_KTX2;
+              else
                 {
                   g_set_error (error_out,
                                GDK_PIXBUF_ERROR,
                                GDK_PIXBUF_ERROR_FAILED,
-                               "Invalid format %s", *value_p);
+                               "Invalid container %s", *value_p);
+                  return FALSE;
+                }
+            }
+          else if (g_strcmp0 (*key_p, "supercompression") == 0)
+            {
+              if (g_strcmp0 (*value_p, "deflate") == 0)
+                opt_deflate = TRUE;
+              else if (g_strcmp0 (*value_p, "none") == 0)
+                opt_deflate = FALSE;
+              else
+                {
+                  g_set_error (error_out,
+                               GDK_PIXBUF_ERROR,
+                               GDK_PIXBUF_ERROR_FAILED,
+                               "Invalid supercompression %s", *value_p);
                   return FALSE;
                 }
             }
+          else if (g_strcmp0 (*key_p, "reference") == 0)
+            {
+              /* the previous version of the texture */
+              opt_reference = *value_p;
+            }
+          else if (g_strcmp0 (*key_p, "block-hashes") == 0)
+            {
+              opt_block_hashes = *value_p;
+            }
           else
             {
               g_warning ("Unknown option %s", *key_p);
@@ -310,41 +2513,145 @@ gdk_pixbuf__pvr_image_save (FILE       *f,
       return FALSE;
     }
 
+  /* the encoders take straight alpha RGBA, see pvr_pixel_format() */
+  if (pixbuf_is_premultiplied_bgra (pixbuf))
+    {
+      g_set_error_literal (error_out,
+                           GDK_PIXBUF_ERROR,
+                           GDK_PIXBUF_ERROR_FAILED,
+                           "Premultiplied BGRA pixbufs can't be saved");
+      return FALSE;
+    }
+
+  /* the loader has to decode deflate compressed textures on its own */
+  info = pvr_format_info_lookup ((PVRPixelType) opt_format);
+  if (opt_deflate && info == NULL)
+    {
+      g_set_error_literal (error_out,
+                           GDK_PIXBUF_ERROR,
+                           GDK_PIXBUF_ERROR_FAILED,
+                           "This format can't be deflate compressed");
+      return FALSE;
+    }
+
+  if (opt_container != PVR_CONTAINER_PVR &&
+      (info == NULL || ktx_format_lookup (info->pixel_type) == NULL))
+    {
+      g_set_error_literal (error_out,
+                           GDK_PIXBUF_ERROR,
+                           GDK_PIXBUF_ERROR_FAILED,
+                           "This format can't be saved in a KTX container");
+      return FALSE;
+    }
+
+  /* our pixel types past the PVR ones would make files only we can read */
+  if (opt_container == PVR_CONTAINER_PVR && info &&
+      info->pixel_type >= PVR_N_PIXEL_TYPES)
+    {
+      g_set_error_literal (error_out,
+                           GDK_PIXBUF_ERROR,
+                           GDK_PIXBUF_ERROR_FAILED,
+                           "This format can only be saved in a KTX "
+                           "container");
+      return FALSE;
+    }
+
+  if (opt_container == PVR_CONTAINER_KTX && opt_deflate)
+    {
+      g_set_error_literal (error_out,
+                           GDK_PIXBUF_ERROR,
+                           GDK_PIXBUF_ERROR_FAILED,
+                           "KTX files can't be deflate compressed, "
+                           "use KTX2");
+      return FALSE;
+    }
+
+  if (info && info->encode)
+    {
+      if (!native_image_save (f, pixbuf, info, opt_quality, opt_mipmaps,
+                              opt_container, opt_deflate, opt_threads,
+                              opt_reference, opt_block_hashes, error_out))
+        return FALSE;
+
+      pvr_trace_end (trace_save, "save",
+                     (guint64) gdk_pixbuf_get_width (pixbuf) *
+                     gdk_pixbuf_get_height (pixbuf) *
+                     gdk_pixbuf_get_n_channels (pixbuf));
+      return TRUE;
+    }
+
+  /* PVRTexLib encodes everything in one go and PVRTC blocks depend on their
+   * neighbours anyway, reference and block-hashes are ignored */
+
   PVRTRY
     {
+      PvrTexLibLocker locker;
       PVRTextureUtilities utils;
       int width, height;
+      guint n_levels = 1;
+      gsize size, chain_size = 0;
+      PvrSurface *levels;
       guchar *pixels;
 
       width = gdk_pixbuf_get_width (pixbuf);
       height = gdk_pixbuf_get_height (pixbuf);
 
-      /* The standard format that PVRTexLib takes is RGBA 8888 so we need
-       * to add an alpha channel if the original image does not have one */
-      if (!gdk_pixbuf_get_has_alpha (pixbuf))
+      if (opt_mipmaps)
+        n_levels = pvr_mipmap_get_n_levels (width, height);
+
+      levels = g_new (PvrSurface, n_levels);
+      levels[0].rowstride = width * 4;
+      levels[0].width = width;
+      levels[0].height = height;
+      levels[0].n_channels = 4;
+      levels[0].layout = PVR_SURFACE_RGBA;
+
+      /* The standard format that PVRTexLib takes is RGBA 8888 without any
+       * padding, with the mipmaps following level 0 in the same buffer. Use
+       * the pixbuf as is when it fits, repack it in a single pass otherwise */
+      size = (gsize) width * height * 4;
+      if (n_levels > 1)
+        chain_size = pvr_mipmap_chain_layout (levels, n_levels, NULL);
+
+      if (n_levels == 1 && gdk_pixbuf_get_has_alpha (pixbuf) &&
+          gdk_pixbuf_get_rowstride (pixbuf) == width * 4)
         {
-          with_alpha = gdk_pixbuf_add_alpha (pixbuf, FALSE, 0, 0, 0);
-          pixbuf = with_alpha;
+          pixels = gdk_pixbuf_get_pixels (pixbuf);
         }
-
-      if (gdk_pixbuf_get_rowstride (pixbuf) != 4 * width)
+      else
         {
-          g_set_error_literal (error_out,
-                               GDK_PIXBUF_ERROR,
-                               GDK_PIXBUF_ERROR_FAILED,
-                               "A row stride larger than the width is not "
-                               "allowed");
-          if (with_alpha)
-            g_object_unref (with_alpha);
+          rgba = (guchar *) g_try_malloc (size + chain_size);
+          if (rgba == NULL)
+            {
+              g_set_error_literal (error_out,
+                                   GDK_PIXBUF_ERROR,
+                                   GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+                                   "Not enough memory to encode the image");
+              g_free (levels);
+              return FALSE;
+            }
 
-          return FALSE;
+          trace = pvr_trace_begin ();
+          pack_rgba (pixbuf, rgba);
+          pvr_trace_end (trace, "pack", size);
+          pixels = rgba;
+        }
+
+      if (n_levels > 1)
+        {
+          trace = pvr_trace_begin ();
+          levels[0].pixels = pixels;
+          pvr_mipmap_chain_layout (levels, n_levels, pixels + size);
+          pvr_mipmap_chain_generate (levels, n_levels);
+          pvr_trace_end (trace, "mipmaps", chain_size);
         }
 
+      g_free (levels);
+
       /* make a CPVRTexture instance from the GdkPixbuf */
-      pixels = gdk_pixbuf_get_pixels (pixbuf);
       CPVRTexture uncompressed (width,
                                height,
-                               0,                       /* u32MipMapCount */
+                               n_levels - 1,            /* u32MipMapCount */
                                1,                       /* u32NumSurfaces */
                                false,                   /* bBorder */
                                false,                   /* bTwiddled */
@@ -362,22 +2669,41 @@ gdk_pixbuf__pvr_image_save (FILE       *f,
 
       /* FIXME: Remove the alpha channel from the compressed texture is the
        * original GdkPixbuf does not have alpha (But we still need to create
-       * the uncompressed texture with hasAlpha to TRUE as the pixbuf is 4
+       * the uncompressed texture with hasAlpha to TRUE as the data is 4
        * bytes per pixel anyway */
 
-      /* TODO: Add support for generating the mipmaps */
-
-      /* TODO: Add support for selection with compression we want */
-
       /* set required encoded pixel type */
       compressed.setPixelType (opt_format);
 
       /* encode texture */
+      trace = pvr_trace_begin ();
       utils.CompressPVR (uncompressed, compressed);
+      pvr_trace_end (trace, "pvrtexlib-compress", size + chain_size);
+
+      /* write to file, with our own header when it has to be flagged as
+       * deflate compressed or for KTX containers */
+      if (opt_deflate || opt_container != PVR_CONTAINER_PVR)
+        {
+          PVRHeader header;
 
-      /* write to file */
-      compressed.getHeader().writeToFile (f);
-      compressed.getData().writeToFile (f);
+          pvr_header_init (&header, info, width, height, n_levels);
+          if (!pvr_texture_write (f, opt_container, &header, info,
+                                  compressed.getData().getData(),
+                                  compressed.getData().getDataSize(),
+                                  opt_deflate, error_out))
+            {
+              g_free (rgba);
+              return FALSE;
+            }
+        }
+      else
+        {
+          trace = pvr_trace_begin ();
+          compressed.getHeader().writeToFile (f);
+          compressed.getData().writeToFile (f);
+          pvr_trace_end (trace, "write",
+                         compressed.getData().getDataSize());
+        }
     }
   PVRCATCH(aaaahhh)
     {
@@ -386,27 +2712,42 @@ gdk_pixbuf__pvr_image_save (FILE       *f,
                            GDK_PIXBUF_ERROR_FAILED,
                            aaaahhh.what());
 
-      if (with_alpha)
-        g_object_unref (with_alpha);
+      g_free (rgba);
 
       return FALSE;
     }
 
-  if (with_alpha)
-    g_object_unref (with_alpha);
+  g_free (rgba);
+
+  pvr_trace_end (trace_save, "save",
+                 (guint64) gdk_pixbuf_get_width (pixbuf) *
+                 gdk_pixbuf_get_height (pixbuf) *
+                 gdk_pixbuf_get_n_channels (pixbuf));
 
   return TRUE;
 }
 
 /*
- * Note: The library provided by Imagination does not seem to provide anything
- * that would allow us to support "incremental loading". What we can do though
- * is to fake incremental loading by accumulating the data inside an array and
- * decode it at the end. This allows us to work with GdkPixbufLoader (which a
- * lot of apps use) at the very least we can signal the size of the level 0
- * mipmap after having read the header.
+ * Incremental loading.
+ *
+ * Once the header is there, we know the size of the level we are going to
+ * decode and preallocate the buffer accumulating it. size_func is called with
+ * the size of level 0, and when the texture has mipmaps and we can decode it
+ * ourselves, the size it asks for selects the smallest level that is still at
+ * least that big. Only that level is kept, the rest of the payload is skipped
+ * as it arrives.
+ *
+ * Formats we decode natively and whose blocks are stored row by row are
+ * decoded progressively: the pixbuf is handed to prepared_func right after the
+ * header and each complete row of blocks is decoded as soon as its bytes
+ * arrive, followed by an updated_func call. Twiddled textures, and the ones
+ * that need PVRTexLib (which does not seem to provide anything that would
+ * allow us to decode partial data), are decoded in stop_load.
  */
 
+/* don't trust the header size for more than this when preallocating */
+#define MAX_PREALLOCATION (64 * 1024 * 1024)
+
 typedef struct
 {
   GdkPixbufModuleSizeFunc size_func;
@@ -416,7 +2757,32 @@ typedef struct
 
   GArray *buffer;
 
+  PVRHeader header;
+  const PvrFormatInfo *info;
+
+  gsize offset;           /* number of bytes of the file received so far */
+  gsize level_start;      /* range of the file we keep after the header */
+  gsize level_end;
+
+  /* progressive decoding */
+  GdkPixbuf *pixbuf;
+  PvrSurface surface;
+  gsize row_size;
+  guint n_rows;
+  guint n_rows_decoded;
+
+  /* deflate compressed textures are inflated into buffer as they arrive */
+  z_stream inflate;
+  gsize level_size;
+
+  /* tracing, the decode calls are summed up and logged in stop_load */
+  gint64 trace_load;
+  gint64 decode_time;
+  gsize decode_bytes;
+
   guint got_header : 1;
+  guint inflating : 1;
+  guint inflated : 1;
 } PvrIncContext;
 
 static gpointer
@@ -433,14 +2799,86 @@ gdk_pixbuf__pvr_begin_load (GdkPixbufModuleSizeFunc       size_func,
   context->prepared_func = prepared_func;
   context->updated_func  = updated_func;
   context->user_data = user_data;
+  context->trace_load = pvr_trace_begin ();
 
-  /* initialized so can contain a 512x512 image with 4 bits per pixel without
-   * the need to reallocate the buffer */
-  context->buffer = g_array_sized_new (FALSE, FALSE, 1, 512 * 512 / 2);
+  /* big enough for the header, resized when we know the payload size */
+  context->buffer = g_array_sized_new (FALSE, FALSE, 1, sizeof (PVRHeader));
 
   return context;
 }
 
+static void
+pvr_inc_context_free (PvrIncContext *context)
+{
+  if (context->pixbuf)
+    g_object_unref (context->pixbuf);
+  if (context->inflating)
+    inflateEnd (&context->inflate);
+  g_array_free (context->buffer, TRUE);
+  g_free (context);
+}
+
+static void
+pvr_inc_context_reserve (PvrIncContext *context,
+                         gsize          size)
+{
+  GArray *buffer;
+
+  size = MIN (size, MAX_PREALLOCATION);
+  if (size <= context->buffer->len)
+    return;
+
+  buffer = g_array_sized_new (FALSE, FALSE, 1, size);
+  g_array_append_vals (buffer, context->buffer->data, context->buffer->len);
+  g_array_free (context->buffer, TRUE);
+  context->buffer = buffer;
+}
+
+/* decode the rows of blocks that have fully arrived since the last call */
+static void
+pvr_inc_context_decode_rows (PvrIncContext *context)
+{
+  const PVRHeader *header = &context->header;
+  guint n_rows, first_y, last_y;
+  gint64 trace;
+
+  n_rows = (context->buffer->len - header->header_size) / context->row_size;
+  n_rows = MIN (n_rows, context->n_rows);
+  if (n_rows <= context->n_rows_decoded)
+    return;
+
+  trace = pvr_trace_begin ();
+  context->info->decode ((guchar *) context->buffer->data +
+                         header->header_size,
+                         &context->surface,
+                         context->n_rows_decoded,
+                         n_rows - context->n_rows_decoded);
+  if (trace)
+    {
+      context->decode_time += g_get_monotonic_time () - trace;
+      context->decode_bytes += (n_rows - context->n_rows_decoded) *
+                               context->row_size;
+    }
+
+  first_y = context->n_rows_decoded * context->info->block_height;
+  last_y = MIN (n_rows * context->info->block_height, header->height);
+  context->n_rows_decoded = n_rows;
+
+  /* flipped textures fill the pixbuf from the bottom */
+  if (header->flags & PVR_FLAG_VERTICAL_FLIP)
+    {
+      guint y = first_y;
+
+      first_y = header->height - last_y;
+      last_y = header->height - y;
+    }
+
+  if (context->updated_func)
+    context->updated_func (context->pixbuf, 0, first_y,
+                           header->width, last_y - first_y,
+                           context->user_data);
+}
+
 static gboolean
 gdk_pixbuf__pvr_stop_load (gpointer   contextp,
                            GError   **error)
@@ -449,62 +2887,377 @@ gdk_pixbuf__pvr_stop_load (gpointer   contextp,
   GdkPixbuf *pixbuf;
   GError *decompress_error = NULL;
 
-  pixbuf =
-    pvrtexlib_gdk_pixbuf_new_from_memory ((guchar *)context->buffer->data,
-                                          &decompress_error);
+  if (context->pixbuf)
+    {
+      gboolean complete;
+
+      /* with the checksum of the stream verified when there is one */
+      complete = context->n_rows_decoded == context->n_rows &&
+                 (!context->inflating || context->inflated);
+      if (!complete)
+        g_set_error_literal (error,
+                             GDK_PIXBUF_ERROR,
+                             GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                             "Truncated PVR data");
+
+      if (context->trace_load)
+        {
+          pvr_trace_log ("decode", context->decode_time,
+                         context->decode_bytes);
+          pvr_trace_end (context->trace_load, "incremental-load",
+                         context->offset);
+        }
+
+      pvr_inc_context_free (context);
+      return complete;
+    }
+
+  if (context->inflating && !context->inflated)
+    {
+      g_set_error_literal (error,
+                           GDK_PIXBUF_ERROR,
+                           GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                           "Truncated PVR data");
+      pvr_inc_context_free (context);
+      return FALSE;
+    }
+
+  /* context->header describes the level we kept, after the header */
+  if (context->info)
+    pixbuf = native_gdk_pixbuf_new_from_level ((guchar *)
+                                               context->buffer->data +
+                                               context->header.header_size,
+                                               context->buffer->len -
+                                               context->header.header_size,
+                                               &context->header,
+                                               context->info,
+                                               &decompress_error);
+  else
+    pixbuf = pvr_gdk_pixbuf_new_from_memory ((guchar *) context->buffer->data,
+                                             context->buffer->len,
+                                             &decompress_error);
   if (decompress_error)
     {
       g_propagate_error (error, decompress_error);
+      pvr_inc_context_free (context);
       return FALSE;
     }
 
   if (context->prepared_func)
     context->prepared_func (pixbuf, NULL, context->user_data);
 
-  g_free (context);
+  if (context->updated_func)
+    context->updated_func (pixbuf, 0, 0,
+                           gdk_pixbuf_get_width (pixbuf),
+                           gdk_pixbuf_get_height (pixbuf),
+                           context->user_data);
+
+  g_object_unref (pixbuf);
+  pvr_trace_end (context->trace_load, "incremental-load", context->offset);
+  pvr_inc_context_free (context);
 
   return TRUE;
 }
 
+/*
+ * Pick the smallest level that is still at least width x height and update
+ * header to describe it.
+ */
+static void
+pvr_header_select_level (PVRHeader           *header,
+                         const PvrFormatInfo *info,
+                         gint                 width,
+                         gint                 height,
+                         guint               *level,
+                         gsize               *level_size)
+{
+  *level = 0;
+  *level_size = pvr_format_info_get_level_size (info, header->width,
+                                                header->height);
+
+  if (!(header->flags & PVR_FLAG_MIPMAP))
+    return;
+
+  while (*level < header->mipmap_count &&
+         (header->width > 1 || header->height > 1))
+    {
+      guint next_width, next_height;
+
+      next_width = MAX (1, header->width / 2);
+      next_height = MAX (1, header->height / 2);
+
+      if ((gint) next_width < width || (gint) next_height < height)
+        break;
+
+      *level_size = pvr_format_info_get_level_size (info, next_width,
+                                                    next_height);
+      header->width = next_width;
+      header->height = next_height;
+      (*level)++;
+    }
+}
+
+/*
+ * Inflate compressed bytes of the level we decode at the end of buffer. What
+ * would go past the size of the level is dropped.
+ */
 static gboolean
-gdk_pixbuf__pvr_load_increment (gpointer       contextp,
-                                const guchar  *buf,
-                                guint          size,
-                                GError       **error)
+pvr_inc_context_inflate (PvrIncContext  *context,
+                         const guchar   *buf,
+                         gsize           size,
+                         GError        **error)
 {
-  PvrIncContext *context = (PvrIncContext *) contextp;
+  z_stream *z = &context->inflate;
+  guchar chunk[16 * 1024];
+  gsize max_len;
+  int ret;
 
-  g_array_append_vals (context->buffer, buf, size);
+  max_len = context->header.header_size + context->level_size;
 
-  if (!context->got_header && context->buffer->len >= sizeof (PVRHeader))
+  z->next_in = (Bytef *) buf;
+  z->avail_in = size;
+
+  do
+    {
+      z->next_out = chunk;
+      z->avail_out = MIN (sizeof (chunk), max_len - context->buffer->len);
+
+      /* no progress with input left means the level is full and the stream
+       * wants to output more */
+      ret = inflate (z, Z_NO_FLUSH);
+      if ((ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) ||
+          (ret == Z_BUF_ERROR && z->avail_in > 0))
+        {
+          g_set_error_literal (error,
+                               GDK_PIXBUF_ERROR,
+                               GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                               "Invalid deflate compressed data");
+          return FALSE;
+        }
+
+      g_array_append_vals (context->buffer, chunk,
+                           z->next_out - (Bytef *) chunk);
+    }
+  while (ret == Z_OK && (z->avail_in > 0 || z->avail_out == 0));
+
+  if (ret == Z_STREAM_END)
+    context->inflated = TRUE;
+
+  return TRUE;
+}
+
+/* append the part of buf that is either the header or the level we decode */
+static gboolean
+pvr_inc_context_append (PvrIncContext  *context,
+                        const guchar   *buf,
+                        gsize           size,
+                        GError        **error)
+{
+  gboolean success = TRUE;
+  gsize start, end;
+
+  if (!context->got_header)
+    {
+      g_array_append_vals (context->buffer, buf, size);
+    }
+  else
+    {
+      start = MAX (context->offset, context->level_start);
+      end = MIN (context->offset + size, context->level_end);
+
+      if (start < end && context->inflating)
+        success = pvr_inc_context_inflate (context,
+                                           buf + start - context->offset,
+                                           end - start, error);
+      else if (start < end)
+        g_array_append_vals (context->buffer, buf + start - context->offset,
+                             end - start);
+    }
+
+  context->offset += size;
+
+  return success;
+}
+
+/*
+ * Create the pixbuf and hand it to prepared_func if the level can be decoded
+ * as it arrives.
+ */
+static gboolean
+pvr_inc_context_start_progressive (PvrIncContext  *context,
+                                   GError        **error)
+{
+  const PvrFormatInfo *info = context->info;
+  const PVRHeader *header = &context->header;
+  guint blocks_x;
+
+  if ((info->flags & PVR_FORMAT_TWIDDLED) ||
+      pvr_header_needs_untwiddle (header, info))
+    return TRUE;
+
+  context->pixbuf = native_gdk_pixbuf_new (header, info, &context->surface,
+                                           error);
+  if (context->pixbuf == NULL)
+    return FALSE;
+
+  native_gdk_pixbuf_set_options (context->pixbuf, info);
+
+  /* what has not arrived yet will show as transparent black */
+  memset (gdk_pixbuf_get_pixels (context->pixbuf), 0,
+          (gsize) gdk_pixbuf_get_rowstride (context->pixbuf) *
+          (header->height - 1) +
+          header->width * gdk_pixbuf_get_n_channels (context->pixbuf));
+
+  blocks_x = (MAX (header->width, info->min_width) + info->block_width - 1) /
+             info->block_width;
+  context->row_size = (gsize) blocks_x * info->block_size;
+  context->n_rows = pvr_format_info_get_n_rows (info, header->height);
+
+  if (context->prepared_func)
+    context->prepared_func (context->pixbuf, NULL, context->user_data);
+
+  return TRUE;
+}
+
+static gboolean
+pvr_inc_context_read_header (PvrIncContext  *context,
+                             GError        **error)
+{
+  PVRHeader *header = &context->header, original;
+  gsize level_size;
+  gint width, height;
+  GArray *received;
+  guint level;
+  gboolean success;
+
+  /* KTX headers are bigger than PVR ones and of variable size */
+  if (context->buffer->len < ktx_header_get_size ((guchar *)
+                                                  context->buffer->data,
+                                                  context->buffer->len))
+    return TRUE;
+
+  if (!pvr_header_read ((guchar *) context->buffer->data,
+                        context->buffer->len, header, error))
+    return FALSE;
+
+  /* we need the deflate table as well to know where the level we keep is */
+  if ((header->flags & PVR_FLAG_DEFLATE) &&
+      context->buffer->len < header->header_size + deflate_table_size (header))
+    return TRUE;
+
+  width = header->width;
+  height = header->height;
+
+  if (context->size_func)
     {
-      context->got_header = TRUE;
+      (*context->size_func) (&width, &height, context->user_data);
 
-      if (context->size_func)
+      if (width == 0 || height == 0)
         {
-          gint width, height;
-          PVRHeader *header;
+          /* used to signal we are going to stop loading the image, return
+           * an error for good measure and not fall in the case we return
+           * FALSE without an error set */
+          g_set_error_literal (error,
+                               GDK_PIXBUF_ERROR,
+                               GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                               "Zero width or height requested");
+          return FALSE;
+        }
+    }
+
+  context->got_header = TRUE;
 
-          header = (PVRHeader *) context->buffer->data;
-          width = header->width;
-          height = header->height;
+  context->info = pvr_format_info_lookup ((PVRPixelType)
+                                          (header->flags &
+                                           PVR_FLAG_PIXELTYPE));
+  if (context->info == NULL && (header->flags & PVR_FLAG_DEFLATE))
+    {
+      g_set_error_literal (error,
+                           GDK_PIXBUF_ERROR,
+                           GDK_PIXBUF_ERROR_UNKNOWN_TYPE,
+                           "Unsupported deflate compressed pixel type");
+      return FALSE;
+    }
 
-          (*context->size_func) (&width, &height, context->user_data);
+  if (context->info == NULL)
+    {
+      /* PVRTexLib needs the whole file */
+      context->level_start = 0;
+      context->level_end = G_MAXSIZE;
+      pvr_inc_context_reserve (context,
+                               (gsize) header->header_size +
+                               header->data_size);
+      return TRUE;
+    }
 
-          if (width == 0 || height == 0)
-            {
-              /* used to signal we are going to stop loading the image, return
-               * an error for good measure and not fall in the case we return
-               * FALSE without an error set */
-              g_set_error_literal (error,
-                                   GDK_PIXBUF_ERROR,
-                                   GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
-                                   "Zero width or height requested");
-              return FALSE;
-            }
+  original = *header;
+  pvr_header_select_level (header, context->info, width, height, &level,
+                           &level_size);
+  if (!pvr_level_lookup ((guchar *) context->buffer->data,
+                         context->buffer->len, &original, context->info,
+                         level, &context->level_start, &context->level_end,
+                         error))
+    return FALSE;
+
+  /* from there on, buffer holds the level inflated as if it had never been
+   * compressed */
+  if (header->flags & PVR_FLAG_DEFLATE)
+    {
+      if (inflateInit (&context->inflate) != Z_OK)
+        {
+          g_set_error_literal (error,
+                               GDK_PIXBUF_ERROR,
+                               GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+                               "Not enough memory to decode the image");
+          return FALSE;
         }
+
+      context->inflating = TRUE;
+      context->level_size = level_size;
+      header->flags &= ~PVR_FLAG_DEFLATE;
     }
 
+  if (!pvr_inc_context_start_progressive (context, error))
+    return FALSE;
+
+  /* filter the payload we already have into a new buffer, keeping the
+   * header only */
+  received = context->buffer;
+  context->buffer = g_array_sized_new (FALSE, FALSE, 1, header->header_size);
+  g_array_append_vals (context->buffer, received->data, header->header_size);
+  pvr_inc_context_reserve (context, header->header_size + level_size);
+  context->offset = header->header_size;
+  success = pvr_inc_context_append (context,
+                                    (guchar *) received->data +
+                                    header->header_size,
+                                    received->len - header->header_size,
+                                    error);
+
+  g_array_free (received, TRUE);
+
+  return success;
+}
+
+static gboolean
+gdk_pixbuf__pvr_load_increment (gpointer       contextp,
+                                const guchar  *buf,
+                                guint          size,
+                                GError       **error)
+{
+  PvrIncContext *context = (PvrIncContext *) contextp;
+
+  if (!pvr_inc_context_append (context, buf, size, error))
+    return FALSE;
+
+  if (!context->got_header && context->buffer->len >= sizeof (PVRHeader))
+    {
+      if (!pvr_inc_context_read_header (context, error))
+        return FALSE;
+    }
+
+  if (context->pixbuf)
+    pvr_inc_context_decode_rows (context);
+
   return TRUE;
 }
 
@@ -524,18 +3277,31 @@ fill_vtable (GdkPixbufModule *module)
 G_MODULE_EXPORT void
 fill_info (GdkPixbufFormat *info)
 {
+  /* the header size comes first, 52 ('4') for v2 headers, followed by the
+   * 'PVR!' identifier at offset 44, and 44 (',') for v1 headers that don't
+   * have any identifier. KTX files start with their own identifier */
   static GdkPixbufModulePattern signature_new[] = {
+        { "4xxx" "xxxxxxxxxx" "xxxxxxxxxx" "xxxxxxxxxx" "xxxxxxxxxx" "PVR!",
+          " zzz" "xxxxxxxxxx" "xxxxxxxxxx" "xxxxxxxxxx" "xxxxxxxxxx" "    ",
+          100 },
+        { ",xxx", " zzz", 10 },
+        { "\xabKTX 11\xbb\r\n\x1a\n", NULL, 100 },
+        { "\xabKTX 20\xbb\r\n\x1a\n", NULL, 100 },
         { NULL, NULL, 0 }
   };
 
   static gchar *mime_types[] =
     {
       "image/x-pvr",
+      "image/ktx",
+      "image/ktx2",
       NULL
     };
   static gchar *extensions[] =
     {
       "pvr",
+      "ktx",
+      "ktx2",
       NULL
     };
 
@@ -544,7 +3310,8 @@ fill_info (GdkPixbufFormat *info)
   info->signature = signature_new;
   info->mime_types  = mime_types;
   info->extensions  = extensions;
-  info->flags       = GDK_PIXBUF_FORMAT_WRITABLE;
+  info->flags       = GDK_PIXBUF_FORMAT_WRITABLE |
+                      GDK_PIXBUF_FORMAT_THREADSAFE;
   info->license     = "BSD";
 }
 
@@ -238,6 +238,16 @@ typedef enum
 
   PVR_N_PIXEL_TYPES,
 
+  /* not part of the PVR format, v2 files predate ETC2. KTX files are the
+   * portable way to store them */
+  PVR_ETC2_RGB = 0xf0,
+  PVR_ETC2_RGB_A1,
+  PVR_ETC2_RGBA,
+
+  /* sRGB PVRTC, only found in KTX files */
+  PVR_PVRTC2_SRGB,
+  PVR_PVRTC4_SRGB,
+
 } PVRPixelType;
 
 #define PVR_FLAG_MIPMAP           (1<<8)      /* has mip map levels */
@@ -253,6 +263,10 @@ typedef enum
                                                  info in the texture */
 #define PVR_FLAG_VERTICAL_FLIP    (1<<16)     /* v2.1 is the texture vertically
                                                  flipped */
+#define PVR_FLAG_DEFLATE          (1<<17)     /* not part of the PVR format,
+                                                 the levels are deflate
+                                                 compressed, see
+                                                 gdk-pixbuf-pvr.cc */
 
 #define PVR_FLAG_PIXELTYPE        0xff        /* pixel type is always in the
                                                  last 16bits of the flags */
@@ -0,0 +1,548 @@
+/*
+ * gdk-pixbuf-texture-bench - Measure the PVR loader and encoders
+ *
+ * Copyright © 2011 Intel Corporation
+ *
+ * This software is licensed under the BSD 3-Clause license. See the COPYING
+ * file for the full text of the license.
+ *
+ */
+
+/*
+ * Saves synthetic images of a few sizes in each format the loader can encode,
+ * then loads them back through gdk_pixbuf_new_from_file(), from a mapping of
+ * the file given to a GdkPixbufLoader in one write, and through a
+ * GdkPixbufLoader fed small chunks. The results are printed as JSON, one entry
+ * per image, size, format and operation.
+ *
+ * The loader is found through GDK_PIXBUF_MODULE_FILE, "make bench" points it
+ * to a loaders.cache describing the freshly built module.
+ */
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <math.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+/* what a network or a slow disk would give us at a time */
+#define INCREMENTAL_CHUNK_SIZE 4096
+
+typedef enum
+{
+  IMAGE_GRADIENT,
+  IMAGE_PHOTO,
+  IMAGE_NOISE,
+} ImageKind;
+
+static const gchar *image_names[] =
+{
+  "gradient",
+  "photo",
+  "noise"
+};
+
+static const gchar *formats[] =
+{
+  "ETC1",
+  "ETC2_RGB",
+  "ETC2_RGB_A1",
+  "ETC2_RGBA",
+  "PVRTC2",
+  "PVRTC4"
+};
+
+typedef gboolean (*BenchFunc) (const gchar  *filename,
+                               GdkPixbuf    *source,
+                               const gchar  *format,
+                               GError      **error);
+
+static gint opt_iterations = 10;
+static gchar *opt_sizes = "256,1024,2048";
+static gchar *opt_quality = "normal";
+static gchar *opt_output;
+
+static GOptionEntry entries[] =
+{
+  { "iterations", 'n', 0, G_OPTION_ARG_INT, &opt_iterations,
+    "Number of measured calls per operation (default: 10)", "N" },
+  { "output", 'o', 0, G_OPTION_ARG_FILENAME, &opt_output,
+    "Write the JSON results to this file instead of stdout", "FILE" },
+  { "quality", 'q', 0, G_OPTION_ARG_STRING, &opt_quality,
+    "Compression quality: fast, normal or exhaustive", "QUALITY" },
+  { "sizes", 's', 0, G_OPTION_ARG_STRING, &opt_sizes,
+    "Comma separated list of image sizes (default: 256,1024,2048)",
+    "SIZES" },
+  { NULL }
+};
+
+/*
+ * Synthetic images.
+ *
+ * gradient is the easy case for block encoders, noise the worst one. photo
+ * tries to look like real content: smooth shading, a few hard edged shapes
+ * and some sensor-like noise on top.
+ */
+static GdkPixbuf *
+create_image (ImageKind kind,
+              gint      size)
+{
+  GdkPixbuf *pixbuf;
+  GRand *rand;
+  guchar *row, *p;
+  gint rowstride, n_channels, x, y;
+
+  pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, kind == IMAGE_NOISE, 8,
+                           size, size);
+  rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+  n_channels = gdk_pixbuf_get_n_channels (pixbuf);
+  row = gdk_pixbuf_get_pixels (pixbuf);
+  rand = g_rand_new_with_seed (size);
+
+  for (y = 0; y < size; y++, row += rowstride)
+    {
+      for (x = 0, p = row; x < size; x++, p += n_channels)
+        {
+          gdouble u = x / (gdouble) size, v = y / (gdouble) size;
+          gint c, noise;
+
+          switch (kind)
+            {
+            case IMAGE_GRADIENT:
+              p[0] = u * 255;
+              p[1] = v * 255;
+              p[2] = (1 - u) * v * 255;
+              break;
+
+            case IMAGE_PHOTO:
+              p[0] = 128 + 90 * sin (u * 5 + v * 2);
+              p[1] = 110 + 80 * sin (v * 7 - u * 3);
+              p[2] = 100 + 60 * cos (u * 4 * v + 1);
+
+              /* a disc and a few stripes */
+              if ((u - 0.6) * (u - 0.6) + (v - 0.4) * (v - 0.4) < 0.04)
+                {
+                  p[0] = 230;
+                  p[1] = 60;
+                  p[2] = 40;
+                }
+              else if (v > 0.75 && ((x * 8 / size) & 1))
+                {
+                  p[0] = 30;
+                  p[1] = 30;
+                  p[2] = 50;
+                }
+
+              noise = g_rand_int_range (rand, -6, 7);
+              for (c = 0; c < 3; c++)
+                p[c] = CLAMP (p[c] + noise, 0, 255);
+              break;
+
+            case IMAGE_NOISE:
+              for (c = 0; c < n_channels; c++)
+                p[c] = g_rand_int_range (rand, 0, 256);
+              break;
+            }
+        }
+    }
+
+  g_rand_free (rand);
+
+  return pixbuf;
+}
+
+/* PVR files have no pixel type for ETC2, those go in KTX2 files */
+static const gchar *
+format_get_container (const gchar *format)
+{
+  return g_str_has_prefix (format, "ETC2") ? "ktx2" : "pvr";
+}
+
+static gboolean
+bench_save (const gchar  *filename,
+            GdkPixbuf    *source,
+            const gchar  *format,
+            GError      **error)
+{
+  return gdk_pixbuf_save (source, filename, "pvr", error,
+                          "format", format,
+                          "quality", opt_quality,
+                          "container", format_get_container (format),
+                          NULL);
+}
+
+static gboolean
+bench_load_file (const gchar  *filename,
+                 GdkPixbuf    *source,
+                 const gchar  *format,
+                 GError      **error)
+{
+  GdkPixbuf *pixbuf;
+
+  pixbuf = gdk_pixbuf_new_from_file (filename, error);
+  if (pixbuf == NULL)
+    return FALSE;
+
+  g_object_unref (pixbuf);
+
+  return TRUE;
+}
+
+/* feed the loader with data, chunk_size bytes at a time */
+static gboolean
+load_with_loader (const guchar  *data,
+                  gsize          size,
+                  gsize          chunk_size,
+                  GError       **error)
+{
+  GdkPixbufLoader *loader;
+  gboolean success = TRUE;
+  gsize offset;
+
+  loader = gdk_pixbuf_loader_new_with_type ("pvr", error);
+  if (loader == NULL)
+    return FALSE;
+
+  for (offset = 0; success && offset < size; offset += chunk_size)
+    success = gdk_pixbuf_loader_write (loader, data + offset,
+                                       MIN (chunk_size, size - offset),
+                                       error);
+
+  if (success)
+    success = gdk_pixbuf_loader_close (loader, error);
+  else
+    gdk_pixbuf_loader_close (loader, NULL);
+
+  if (success && gdk_pixbuf_loader_get_pixbuf (loader) == NULL)
+    {
+      g_set_error_literal (error,
+                           GDK_PIXBUF_ERROR,
+                           GDK_PIXBUF_ERROR_FAILED,
+                           "The loader did not produce a pixbuf");
+      success = FALSE;
+    }
+
+  g_object_unref (loader);
+
+  return success;
+}
+
+static gboolean
+bench_load_mmap (const gchar  *filename,
+                 GdkPixbuf    *source,
+                 const gchar  *format,
+                 GError      **error)
+{
+  struct stat st;
+  gpointer data;
+  gboolean success;
+  int fd;
+
+  fd = open (filename, O_RDONLY);
+  if (fd == -1 || fstat (fd, &st) == -1)
+    {
+      g_set_error (error,
+                   G_FILE_ERROR,
+                   G_FILE_ERROR_FAILED,
+                   "Could not open %s", filename);
+      if (fd != -1)
+        close (fd);
+      return FALSE;
+    }
+
+  data = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (data == MAP_FAILED)
+    {
+      g_set_error (error,
+                   G_FILE_ERROR,
+                   G_FILE_ERROR_FAILED,
+                   "Could not map %s", filename);
+      return FALSE;
+    }
+
+  success = load_with_loader ((const guchar *) data, st.st_size, st.st_size,
+                              error);
+  munmap (data, st.st_size);
+
+  return success;
+}
+
+static gboolean
+bench_load_incremental (const gchar  *filename,
+                        GdkPixbuf    *source,
+                        const gchar  *format,
+                        GError      **error)
+{
+  gchar *data;
+  gsize size;
+  gboolean success;
+
+  /* reading the file is not what we measure, but it's small compared to
+   * decoding and keeps the same I/O as the other two paths */
+  if (!g_file_get_contents (filename, &data, &size, error))
+    return FALSE;
+
+  success = load_with_loader ((const guchar *) data, size,
+                              INCREMENTAL_CHUNK_SIZE, error);
+  g_free (data);
+
+  return success;
+}
+
+static gint
+compare_doubles (gconstpointer a,
+                 gconstpointer b)
+{
+  gdouble da = *(const gdouble *) a, db = *(const gdouble *) b;
+
+  return da < db ? -1 : da > db;
+}
+
+/* nearest rank percentile of the sorted latencies */
+static gdouble
+percentile (const gdouble *sorted,
+            guint          n,
+            guint          p)
+{
+  guint rank;
+
+  rank = (p * n + 99) / 100;
+
+  return sorted[CLAMP (rank, 1, n) - 1];
+}
+
+static glong
+get_peak_rss (void)
+{
+  struct rusage usage;
+
+  if (getrusage (RUSAGE_SELF, &usage) == -1)
+    return -1;
+
+  /* in KiB on Linux */
+  return usage.ru_maxrss;
+}
+
+/*
+ * Run func once to warm the caches up then opt_iterations times, and append
+ * the measurements to json. The peak RSS is the one of the whole process so
+ * far, the biggest images are benchmarked last for it to stay meaningful.
+ */
+static gboolean
+run_bench (GString     *json,
+           const gchar *operation,
+           BenchFunc    func,
+           const gchar *filename,
+           GdkPixbuf   *source,
+           const gchar *image,
+           const gchar *format)
+{
+  GError *error = NULL;
+  gdouble *latencies, total = 0;
+  guint64 n_pixels;
+  gint i;
+
+  n_pixels = (guint64) gdk_pixbuf_get_width (source) *
+             gdk_pixbuf_get_height (source);
+  latencies = g_new (gdouble, opt_iterations);
+
+  for (i = -1; i < opt_iterations; i++)
+    {
+      gint64 start = g_get_monotonic_time ();
+
+      if (!func (filename, source, format, &error))
+        {
+          g_printerr ("%s %s %s failed: %s\n", operation, image, format,
+                      error->message);
+          g_error_free (error);
+          g_free (latencies);
+          return FALSE;
+        }
+
+      if (i >= 0)
+        {
+          latencies[i] = (g_get_monotonic_time () - start) / 1000.0;
+          total += latencies[i];
+        }
+    }
+
+  qsort (latencies, opt_iterations, sizeof (gdouble), compare_doubles);
+
+  if (json->str[json->len - 1] == '}')
+    g_string_append (json, ",");
+  g_string_append_printf (json,
+                          "\n    { \"image\": \"%s\", \"width\": %d, "
+                          "\"height\": %d, \"format\": \"%s\", "
+                          "\"operation\": \"%s\",\n"
+                          "      \"iterations\": %d, "
+                          "\"mpixels_per_s\": %.3f,\n"
+                          "      \"latency_ms\": { \"min\": %.3f, "
+                          "\"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, "
+                          "\"max\": %.3f },\n"
+                          "      \"peak_rss_kib\": %ld }",
+                          image,
+                          gdk_pixbuf_get_width (source),
+                          gdk_pixbuf_get_height (source),
+                          format, operation, opt_iterations,
+                          total > 0 ? n_pixels * opt_iterations /
+                                      (total * 1000.0) : 0,
+                          latencies[0],
+                          percentile (latencies, opt_iterations, 50),
+                          percentile (latencies, opt_iterations, 90),
+                          percentile (latencies, opt_iterations, 99),
+                          latencies[opt_iterations - 1],
+                          get_peak_rss ());
+
+  g_free (latencies);
+
+  return TRUE;
+}
+
+static gboolean
+have_pvr_loader (void)
+{
+  GSList *formats_list, *l;
+  gboolean found = FALSE;
+
+  formats_list = gdk_pixbuf_get_formats ();
+  for (l = formats_list; l; l = l->next)
+    {
+      gchar *name = gdk_pixbuf_format_get_name ((GdkPixbufFormat *) l->data);
+
+      found |= g_strcmp0 (name, "pvr") == 0;
+      g_free (name);
+    }
+  g_slist_free (formats_list);
+
+  return found;
+}
+
+int
+main(int   argc,
+     char *argv[])
+{
+  GError *error = NULL;
+  GOptionContext *context;
+  GString *json;
+  gchar **sizes, *dir;
+  gboolean success = TRUE;
+  guint s, f, k;
+
+  context = g_option_context_new ("- Benchmark the PVR loader and encoders");
+
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_print ("Failed to parse options: %s\n", error->message);
+      return EXIT_FAILURE;
+    }
+
+  if (opt_iterations <= 0)
+    {
+      g_printerr ("The number of iterations needs to be positive\n");
+      return EXIT_FAILURE;
+    }
+
+  if (!have_pvr_loader ())
+    {
+      g_printerr ("The pvr loader was not found, set GDK_PIXBUF_MODULE_FILE "
+                  "to a loaders.cache that lists it\n");
+      return EXIT_FAILURE;
+    }
+
+  dir = g_dir_make_tmp ("texture-bench-XXXXXX", &error);
+  if (dir == NULL)
+    {
+      g_printerr ("Could not create a temporary directory: %s\n",
+                  error->message);
+      return EXIT_FAILURE;
+    }
+
+  json = g_string_new (NULL);
+  g_string_append_printf (json, "{\n  \"quality\": \"%s\",\n"
+                          "  \"results\": [", opt_quality);
+
+  sizes = g_strsplit (opt_sizes, ",", -1);
+  for (s = 0; sizes[s]; s++)
+    {
+      gint size = atoi (sizes[s]);
+
+      if (size <= 0)
+        {
+          g_printerr ("Invalid size '%s'\n", sizes[s]);
+          success = FALSE;
+          continue;
+        }
+
+      for (k = 0; k < G_N_ELEMENTS (image_names); k++)
+        {
+          GdkPixbuf *source = create_image ((ImageKind) k, size);
+
+          for (f = 0; f < G_N_ELEMENTS (formats); f++)
+            {
+              gchar *name, *filename;
+
+              name = g_strdup_printf ("%s-%d-%s.%s", image_names[k], size,
+                                      formats[f],
+                                      format_get_container (formats[f]));
+              filename = g_build_filename (dir, name, NULL);
+
+              /* the loads need the file the save wrote */
+              if (run_bench (json, "save", bench_save, filename, source,
+                             image_names[k], formats[f]))
+                {
+                  success &= run_bench (json, "load-file", bench_load_file,
+                                        filename, source, image_names[k],
+                                        formats[f]);
+                  success &= run_bench (json, "load-mmap", bench_load_mmap,
+                                        filename, source, image_names[k],
+                                        formats[f]);
+                  success &= run_bench (json, "load-incremental",
+                                        bench_load_incremental, filename,
+                                        source, image_names[k], formats[f]);
+                }
+              else
+                {
+                  success = FALSE;
+                }
+
+              unlink (filename);
+              g_free (filename);
+              g_free (name);
+            }
+
+          g_object_unref (source);
+        }
+    }
+  g_strfreev (sizes);
+
+  g_string_append_printf (json, "\n  ],\n  \"peak_rss_kib\": %ld\n}\n",
+                          get_peak_rss ());
+
+  if (opt_output)
+    {
+      if (!g_file_set_contents (opt_output, json->str, json->len, &error))
+        {
+          g_printerr ("Could not write %s: %s\n", opt_output, error->message);
+          success = FALSE;
+        }
+    }
+  else
+    {
+      fputs (json->str, stdout);
+    }
+
+  g_string_free (json, TRUE);
+  rmdir (dir);
+  g_free (dir);
+
+  return !success;
+}
@@ -10,52 +10,191 @@
  *
  */
 
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <unistd.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include <gdk-pixbuf/gdk-pixbuf.h>
 
-#define FORMAT_ETC1       0
-#define FORMAT_PRVTC2     1
-#define FORMAT_PRVTC4     2
+#include "gdk-pixbuf-pvr.h"
+#include "gdk-pixbuf-pvr-codecs.h"
+
+#define FORMAT_ETC1         0
+#define FORMAT_PRVTC2       1
+#define FORMAT_PRVTC4       2
+#define FORMAT_RGB565       3
+#define FORMAT_RGBA4444     4
+#define FORMAT_ETC2_RGB     5
+#define FORMAT_ETC2_RGB_A1  6
+#define FORMAT_ETC2_RGBA    7
 
 const char *formats[] =
 {
   "ETC1",
   "PVRTC2",
-  "PVRTC4"
+  "PVRTC4",
+  "RGB565",
+  "RGBA4444",
+  "ETC2_RGB",
+  "ETC2_RGB_A1",
+  "ETC2_RGBA"
+};
+
+/* pixel type of the formats above */
+static const PVRPixelType format_pixel_types[] =
+{
+  PVR_ETC_RGB_4BPP,
+  PVR_OGL_PVRTC2,
+  PVR_OGL_PVRTC4,
+  PVR_OGL_RGB_565,
+  PVR_OGL_RGBA_4444,
+  PVR_ETC2_RGB,
+  PVR_ETC2_RGB_A1,
+  PVR_ETC2_RGBA
+};
+
+/* block size of the formats above, in pixels */
+static const guint format_blocks[][2] =
+{
+  { 4, 4 },
+  { 8, 4 },
+  { 4, 4 },
+  { 1, 1 },
+  { 1, 1 },
+  { 4, 4 },
+  { 4, 4 },
+  { 4, 4 }
+};
+
+static gboolean
+format_is_etc2 (guint format)
+{
+  return format == FORMAT_ETC2_RGB || format == FORMAT_ETC2_RGB_A1 ||
+         format == FORMAT_ETC2_RGBA;
+}
+
+/* the formats --auto-format tries, smallest first, with their bits per pixel.
+ * The ones with the same size are all tried and the best one is kept, see
+ * auto_format_fits_container() for the ones skipped */
+static const guint auto_formats[][2] =
+{
+  { FORMAT_PRVTC2, 2 },
+  { FORMAT_PRVTC4, 4 },
+  { FORMAT_ETC1, 4 },
+  { FORMAT_ETC2_RGB, 4 },
+  { FORMAT_ETC2_RGBA, 8 },
+  { FORMAT_RGB565, 16 },
+  { FORMAT_RGBA4444, 16 }
 };
 
 static gchar *opt_output = "output.pvr";
+static gchar *opt_output_dir;
 static gchar *opt_format = "ETC1";
+static gchar *opt_quality = "normal";
+static gchar *opt_supercompression = "none";
+static gchar *opt_container = "pvr";
+static gint opt_jobs = 1;
+static gboolean opt_mipmaps = FALSE;
 static gboolean opt_list_formats = FALSE;
+static gboolean opt_info = FALSE;
+static gchar *opt_atlas;
+static gint opt_atlas_size = 2048;
+static gchar *opt_cache_dir;
+static gboolean opt_update = FALSE;
+static gboolean opt_auto_format = FALSE;
+static gboolean opt_stream = FALSE;
+static gdouble opt_min_psnr = 35.0;
 static gchar **opt_files;
 
+/* number of threads each encode is allowed to use, as a save option */
+static gchar *encoder_threads;
+
+/* batch statistics, updated by the jobs */
+G_LOCK_DEFINE_STATIC (stats);
+static guint n_done;
+static guint64 n_pixels;
+static guint n_cache_hits;
+static GPtrArray *failed_files;
+
 static GOptionEntry entries[] =
 {
+  { "atlas", 'a', 0, G_OPTION_ARG_FILENAME, &opt_atlas,
+    "Pack the inputs into NAME-<page>.pvr (or .ktx, .ktx2) textures "
+    "described by NAME.atlas",
+    "NAME" },
+  { "container", 0, 0, G_OPTION_ARG_STRING, &opt_container,
+    "File format of the textures: pvr, ktx or ktx2. KTX files can only "
+    "hold the ETC and PVRTC formats", "CONTAINER" },
+  { "auto-format", 0, 0, G_OPTION_ARG_NONE, &opt_auto_format,
+    "Pick the smallest format that reaches the --min-psnr quality", NULL },
+  { "atlas-size", 0, 0, G_OPTION_ARG_INT, &opt_atlas_size,
+    "Maximum width and height of the atlas pages (default: 2048)", "SIZE" },
+  { "cache-dir", 'c', 0, G_OPTION_ARG_FILENAME, &opt_cache_dir,
+    "Reuse the compressed files stored in this directory when the pixels "
+    "and options did not change", "DIR" },
   { "format", 'f', 0, G_OPTION_ARG_STRING, &opt_format,
     "Select the output format", NULL },
+  { "jobs", 'j', 0, G_OPTION_ARG_INT, &opt_jobs,
+    "Number of files to compress in parallel (0 for one per processor)",
+    "N" },
+  { "info", 'i', 0, G_OPTION_ARG_NONE, &opt_info,
+    "Print the header information of PVR files", NULL },
   { "list-formats", 0, 0, G_OPTION_ARG_NONE, &opt_list_formats,
     "List the valid formats", NULL },
+  { "min-psnr", 0, 0, G_OPTION_ARG_DOUBLE, &opt_min_psnr,
+    "Minimum PSNR, in dB, of the formats --auto-format can pick "
+    "(default: 35)", "DB" },
+  { "mipmaps", 'm', 0, G_OPTION_ARG_NONE, &opt_mipmaps,
+    "Generate the mipmap levels", NULL },
   { "output", 'o', 0, G_OPTION_ARG_STRING, &opt_output,
-    "Give the output file name", NULL },
+    "Give the output file name, %s is replaced by the input file name "
+    "without extension", NULL },
+  { "output-dir", 'd', 0, G_OPTION_ARG_FILENAME, &opt_output_dir,
+    "Write <input name>.pvr (or .ktx, .ktx2) files in this directory",
+    "DIR" },
+  { "quality", 'q', 0, G_OPTION_ARG_STRING, &opt_quality,
+    "Compression quality: fast, normal or exhaustive", "QUALITY" },
+  { "stream", 0, 0, G_OPTION_ARG_NONE, &opt_stream,
+    "Compress the images band by band as they are decoded, without "
+    "mipmaps and only in the formats encoded by the tool itself", NULL },
+  { "supercompression", 'z', 0, G_OPTION_ARG_STRING, &opt_supercompression,
+    "Compress the texture data further for smaller files, none or deflate. "
+    "Only this loader can read deflate compressed files", "METHOD" },
+  { "update", 'u', 0, G_OPTION_ARG_NONE, &opt_update,
+    "Only re-encode the blocks that changed since the output was written, "
+    "tracked in <output>.blocks", NULL },
   { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &opt_files,
     "input files...", NULL },
   { NULL }
 };
 
-static gboolean
-validate_format (const gchar *format)
+static gint
+lookup_format (const gchar *format)
 {
   gint i;
 
   for (i = 0; i < G_N_ELEMENTS (formats); i++)
     {
       if (strcmp (format, formats[i]) == 0)
-          return TRUE;
+          return i;
     }
 
-  return FALSE;
+  return -1;
 }
 
 static void
@@ -68,79 +207,1745 @@ do_list_formats (void)
     g_print ("  %s\n", formats[i]);
 }
 
+#define PIXEL_TYPE(type) case PVR_##type: return #type
+
+static const gchar *
+pixel_type_to_string (guint pixel_type)
+{
+  switch (pixel_type)
+    {
+    PIXEL_TYPE (MGLPT_ARGB_4444);
+    PIXEL_TYPE (MGLPT_ARGB_1555);
+    PIXEL_TYPE (MGLPT_RGB_565);
+    PIXEL_TYPE (MGLPT_RGB_555);
+    PIXEL_TYPE (MGLPT_RGB_888);
+    PIXEL_TYPE (MGLPT_ARGB_8888);
+    PIXEL_TYPE (MGLPT_PVRTC2);
+    PIXEL_TYPE (MGLPT_PVRTC4);
+    PIXEL_TYPE (OGL_RGBA_4444);
+    PIXEL_TYPE (OGL_RGBA_5551);
+    PIXEL_TYPE (OGL_RGBA_8888);
+    PIXEL_TYPE (OGL_RGB_565);
+    PIXEL_TYPE (OGL_RGB_555);
+    PIXEL_TYPE (OGL_RGB_888);
+    PIXEL_TYPE (OGL_I_8);
+    PIXEL_TYPE (OGL_AI_88);
+    PIXEL_TYPE (OGL_PVRTC2);
+    PIXEL_TYPE (OGL_PVRTC4);
+    PIXEL_TYPE (OGL_BGRA_8888);
+    PIXEL_TYPE (OGL_A_8);
+    PIXEL_TYPE (D3D_DXT1);
+    PIXEL_TYPE (D3D_DXT2);
+    PIXEL_TYPE (D3D_DXT3);
+    PIXEL_TYPE (D3D_DXT4);
+    PIXEL_TYPE (D3D_DXT5);
+    PIXEL_TYPE (ETC_RGB_4BPP);
+    PIXEL_TYPE (ETC2_RGB);
+    PIXEL_TYPE (ETC2_RGB_A1);
+    PIXEL_TYPE (ETC2_RGBA);
+    PIXEL_TYPE (PVRTC2_SRGB);
+    PIXEL_TYPE (PVRTC4_SRGB);
+    PIXEL_TYPE (DX10_R8G8B8A8_UNORM);
+    PIXEL_TYPE (DX10_R8G8B8A8_UNORM_SRGB);
+    PIXEL_TYPE (DX10_BC1_UNORM);
+    PIXEL_TYPE (DX10_BC1_UNORM_SRGB);
+    PIXEL_TYPE (DX10_BC2_UNORM);
+    PIXEL_TYPE (DX10_BC2_UNORM_SRGB);
+    PIXEL_TYPE (DX10_BC3_UNORM);
+    PIXEL_TYPE (DX10_BC3_UNORM_SRGB);
+    default:
+      return NULL;
+    }
+}
+
+#undef PIXEL_TYPE
+
+/*
+ * Only read the header, we don't want to touch the payload when scanning
+ * large numbers of files.
+ */
 static gboolean
-do_compress_file (gchar *filename)
+do_info_file (const gchar *filename)
 {
-  GdkPixbuf *source;
-  GError *error = NULL;
-  gboolean success = TRUE;
+  PVRHeader header;
+  const gchar *type;
+  ssize_t n_read;
+  guint n_levels;
+  int fd;
 
-  source = gdk_pixbuf_new_from_file (filename, &error);
-  if (error)
+  fd = open (filename, O_RDONLY);
+  if (fd == -1)
     {
-      g_print ("Could not open file %s: %s\n", filename, error->message);
-      success = FALSE;
-      goto open_failed;
+      g_printerr ("Could not open file %s: %s\n", filename,
+                  g_strerror (errno));
+      return FALSE;
     }
 
-  gdk_pixbuf_save (source, opt_output, "pvr", &error,
-                   "format", opt_format,
-                   NULL);
-  if (error)
+  memset (&header, 0, sizeof (PVRHeader));
+  n_read = pread (fd, &header, sizeof (PVRHeader), 0);
+  close (fd);
+
+  if (n_read >= PVR_FLAG_V1_HEADER_SIZE &&
+      header.header_size == PVR_FLAG_V1_HEADER_SIZE)
     {
-      g_print ("Could not save file %s: %s\n", opt_output, error->message);
-      success = FALSE;
-      goto save_failed;
+      header.PVR = PVR_FLAG_IDENTIFIER;
+      header.n_surfaces = 1;
     }
 
-save_failed:
-  g_object_unref (source);
-open_failed:
+  if (n_read < header.header_size ||
+      header.header_size < PVR_FLAG_V1_HEADER_SIZE ||
+      header.PVR != PVR_FLAG_IDENTIFIER)
+    {
+      g_printerr ("%s: not a PVR file\n", filename);
+      return FALSE;
+    }
+
+  n_levels = header.flags & PVR_FLAG_MIPMAP ? header.mipmap_count + 1 : 1;
+  type = pixel_type_to_string (header.flags & PVR_FLAG_PIXELTYPE);
+
+  g_print ("%s: %ux%u, ", filename, header.width, header.height);
+  if (type)
+    g_print ("%s", type);
+  else
+    g_print ("pixel type 0x%02x", header.flags & PVR_FLAG_PIXELTYPE);
+  g_print (", %u level%s, %u surface%s, %u bytes%s%s%s%s\n",
+           n_levels, n_levels > 1 ? "s" : "",
+           header.n_surfaces, header.n_surfaces > 1 ? "s" : "",
+           header.data_size,
+           header.flags & PVR_FLAG_TWIDDLE ? ", twiddled" : "",
+           header.flags & PVR_FLAG_CUBEMAP ? ", cubemap" : "",
+           header.flags & PVR_FLAG_VERTICAL_FLIP ? ", flipped" : "",
+           header.flags & PVR_FLAG_DEFLATE ? ", deflate" : "");
+
+  return TRUE;
+}
+
+/*
+ * Compression cache.
+ *
+ * Compressed files are stored in the cache directory under a 64 bits hash of
+ * the decoded pixels and of the options that change the output, see
+ * pvr_hash_bytes(). Bump CACHE_VERSION when the encoders produce different
+ * output for the same input.
+ */
+
+#define CACHE_VERSION 1
+
+static guint64
+hash_pixbuf (GdkPixbuf *pixbuf)
+{
+  const guchar *row;
+  gchar *options, *format;
+  guint64 h;
+  gsize row_size;
+  gint rowstride, width, height, y;
+
+  width = gdk_pixbuf_get_width (pixbuf);
+  height = gdk_pixbuf_get_height (pixbuf);
+  rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+  row_size = (gsize) width * gdk_pixbuf_get_n_channels (pixbuf);
+
+  if (opt_auto_format)
+    format = g_strdup_printf ("auto %g", opt_min_psnr);
+  else
+    format = g_strdup (opt_format);
+
+  options = g_strdup_printf ("%d %s %s %s %s %s %d %d %d", CACHE_VERSION,
+                             format, opt_quality, opt_supercompression,
+                             opt_container, opt_mipmaps ? "mipmaps" : "",
+                             width, height,
+                             gdk_pixbuf_get_n_channels (pixbuf));
+  h = pvr_hash_bytes (0, (const guchar *) options, strlen (options));
+  g_free (options);
+  g_free (format);
+
+  /* skip the row padding, it can hold anything */
+  row = gdk_pixbuf_get_pixels (pixbuf);
+  for (y = 0; y < height; y++, row += rowstride)
+    h = pvr_hash_bytes (h, row, row_size);
+
+  /* finalizer from MurmurHash3 */
+  h ^= h >> 33;
+  h *= G_GUINT64_CONSTANT (0xff51afd7ed558ccd);
+  h ^= h >> 33;
+  h *= G_GUINT64_CONSTANT (0xc4ceb9fe1a85ec53);
+  h ^= h >> 33;
+
+  return h;
+}
+
+/*
+ * Copy src to dest, sharing the blocks of the file when the file system can
+ * clone them (btrfs, XFS, ...).
+ */
+static gboolean
+copy_file (const gchar *src,
+           const gchar *dest)
+{
+  gchar buffer[64 * 1024];
+  gboolean success = FALSE;
+  ssize_t n_read;
+  int in, out;
+
+  in = open (src, O_RDONLY);
+  if (in == -1)
+    return FALSE;
+
+  out = open (dest, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out == -1)
+    {
+      close (in);
+      return FALSE;
+    }
+
+#ifdef FICLONE
+  if (ioctl (out, FICLONE, in) == 0)
+    {
+      success = TRUE;
+      goto out;
+    }
+#endif
+
+  while ((n_read = read (in, buffer, sizeof (buffer))) > 0)
+    {
+      if (write (out, buffer, n_read) != n_read)
+        goto out;
+    }
+
+  success = n_read == 0;
+
+out:
+  close (in);
+  if (close (out) == -1)
+    success = FALSE;
+
   return success;
 }
 
-int
-main(int   argc,
-     char *argv[])
+static gchar *
+get_cache_filename (GdkPixbuf *pixbuf)
 {
-  GError *error = NULL;
-  GOptionContext *context;
-  gboolean success = TRUE;
-  guint i;
+  gchar name[22];
 
-  g_type_init ();
+  /* the container names are also their extensions */
+  g_snprintf (name, sizeof (name), "%016" G_GINT64_MODIFIER "x.%s",
+              hash_pixbuf (pixbuf), opt_container);
 
-  context = g_option_context_new ("- A tool to manipulate textures");
+  return g_build_filename (opt_cache_dir, name, NULL);
+}
 
-  g_option_context_add_main_entries (context, entries, NULL);
-  if (!g_option_context_parse (context, &argc, &argv, &error))
+/* add output to the cache, other jobs can be doing the same with the same
+ * key so go through a temporary file to never expose a partial entry */
+static void
+cache_store (const gchar *output,
+             const gchar *cached)
+{
+  gchar *tmp;
+
+  tmp = g_strdup_printf ("%s.%08x.tmp", cached, g_random_int ());
+
+  if (!copy_file (output, tmp) || rename (tmp, cached) == -1)
     {
-      g_print ("Failed to parse options: %s\n", error->message);
-      return EXIT_FAILURE;
+      g_printerr ("Could not add %s to the cache\n", output);
+      unlink (tmp);
     }
 
-  if (opt_list_formats)
+  g_free (tmp);
+}
+
+/*
+ * Quality metrics.
+ *
+ * Both images are converted to RGBA one row at a time. The PSNR covers the
+ * colour channels, and alpha when the source has an alpha channel. The SSIM
+ * is computed on the luma of non-overlapping 8x8 windows, a cheaper variant
+ * of the usual gaussian weighted one that ranks formats the same way.
+ */
+
+#define SSIM_WINDOW 8
+
+/* convert a row of pixbuf to RGBA, and to its Rec. 601 luma */
+static void
+convert_row (const guchar *row,
+             gint          n_channels,
+             gint          width,
+             gboolean      keep_alpha,
+             guint8       *rgba,
+             guint8       *luma)
+{
+  gint x;
+
+  for (x = 0; x < width; x++, row += n_channels, rgba += 4)
     {
-      do_list_formats ();
-      return EXIT_SUCCESS;
+      rgba[0] = row[0];
+      rgba[1] = row[1];
+      rgba[2] = row[2];
+      rgba[3] = keep_alpha && n_channels == 4 ? row[3] : 0xff;
+
+      luma[x] = (row[0] * 77 + row[1] * 150 + row[2] * 29 + 128) >> 8;
     }
+}
+
+static guint64
+squared_error (const guint8 *a,
+               const guint8 *b,
+               gsize         n)
+{
+  guint64 sum = 0;
+  gsize i = 0;
 
-  if (!validate_format (opt_format))
+#ifdef __SSE2__
+  __m128i zero, acc;
+  guint64 lanes[2];
+
+  zero = _mm_setzero_si128 ();
+  acc = _mm_setzero_si128 ();
+
+  for (; i + 16 <= n; i += 16)
     {
-      g_printerr ("Invalid format '%s'\n", opt_format);
-      return EXIT_FAILURE;
+      __m128i va, vb, lo, hi, sq;
+
+      va = _mm_loadu_si128 ((const __m128i *) (a + i));
+      vb = _mm_loadu_si128 ((const __m128i *) (b + i));
+
+      lo = _mm_sub_epi16 (_mm_unpacklo_epi8 (va, zero),
+                          _mm_unpacklo_epi8 (vb, zero));
+      hi = _mm_sub_epi16 (_mm_unpackhi_epi8 (va, zero),
+                          _mm_unpackhi_epi8 (vb, zero));
+
+      /* 4 sums of 4 squares, at most 260100 each, widened to 64 bits right
+       * away so rows of any width are fine */
+      sq = _mm_add_epi32 (_mm_madd_epi16 (lo, lo), _mm_madd_epi16 (hi, hi));
+      acc = _mm_add_epi64 (acc, _mm_unpacklo_epi32 (sq, zero));
+      acc = _mm_add_epi64 (acc, _mm_unpackhi_epi32 (sq, zero));
     }
 
-  if (opt_files == NULL)
+  _mm_storeu_si128 ((__m128i *) lanes, acc);
+  sum = lanes[0] + lanes[1];
+#endif
+
+  for (; i < n; i++)
     {
-      g_printerr ("You need to give at least one file to operate on\n");
-      return EXIT_FAILURE;
+      gint d = a[i] - b[i];
+
+      sum += d * d;
     }
 
-  for (i = 0; opt_files[i]; i++)
+  return sum;
+}
+
+/* sums of x, y, x², y² and xy over a window of luma */
+static void
+window_sums (const guint8 *a,
+             const guint8 *b,
+             gint          stride,
+             gint          width,
+             gint          height,
+             guint32      *sums)
+{
+  gint x, y;
+
+  memset (sums, 0, 5 * sizeof (guint32));
+
+#ifdef __SSE2__
+  if (width == 8)
+    {
+      __m128i zero, sx, sy, sxx, syy, sxy;
+      guint32 lanes[4];
+      guint16 words[8];
+
+      zero = _mm_setzero_si128 ();
+      sx = sy = sxx = syy = sxy = _mm_setzero_si128 ();
+
+      for (y = 0; y < height; y++, a += stride, b += stride)
+        {
+          __m128i va, vb;
+
+          va = _mm_unpacklo_epi8 (_mm_loadl_epi64 ((const __m128i *) a),
+                                  zero);
+          vb = _mm_unpacklo_epi8 (_mm_loadl_epi64 ((const __m128i *) b),
+                                  zero);
+
+          sx = _mm_add_epi16 (sx, va);
+          sy = _mm_add_epi16 (sy, vb);
+          sxx = _mm_add_epi32 (sxx, _mm_madd_epi16 (va, va));
+          syy = _mm_add_epi32 (syy, _mm_madd_epi16 (vb, vb));
+          sxy = _mm_add_epi32 (sxy, _mm_madd_epi16 (va, vb));
+        }
+
+      _mm_storeu_si128 ((__m128i *) words, sx);
+      for (x = 0; x < 8; x++)
+        sums[0] += words[x];
+      _mm_storeu_si128 ((__m128i *) words, sy);
+      for (x = 0; x < 8; x++)
+        sums[1] += words[x];
+
+      _mm_storeu_si128 ((__m128i *) lanes, sxx);
+      sums[2] = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+      _mm_storeu_si128 ((__m128i *) lanes, syy);
+      sums[3] = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+      _mm_storeu_si128 ((__m128i *) lanes, sxy);
+      sums[4] = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+
+      return;
+    }
+#endif
+
+  for (y = 0; y < height; y++, a += stride, b += stride)
+    {
+      for (x = 0; x < width; x++)
+        {
+          sums[0] += a[x];
+          sums[1] += b[x];
+          sums[2] += a[x] * a[x];
+          sums[3] += b[x] * b[x];
+          sums[4] += a[x] * b[x];
+        }
+    }
+}
+
+static gdouble
+compute_ssim (const guint8 *a,
+              const guint8 *b,
+              gint          width,
+              gint          height)
+{
+  const gdouble c1 = (0.01 * 255) * (0.01 * 255);
+  const gdouble c2 = (0.03 * 255) * (0.03 * 255);
+  gdouble total = 0;
+  gint window_width, window_height, x, y, n_windows = 0;
+
+  /* images smaller than a window are one window */
+  window_width = MIN (SSIM_WINDOW, width);
+  window_height = MIN (SSIM_WINDOW, height);
+
+  for (y = 0; y + window_height <= height; y += window_height)
+    {
+      for (x = 0; x + window_width <= width; x += window_width)
+        {
+          guint32 sums[5];
+          gdouble n, mx, my, vx, vy, cov;
+
+          window_sums (a + (gsize) y * width + x, b + (gsize) y * width + x,
+                       width, window_width, window_height, sums);
+
+          n = window_width * window_height;
+          mx = sums[0] / n;
+          my = sums[1] / n;
+          vx = sums[2] / n - mx * mx;
+          vy = sums[3] / n - my * my;
+          cov = sums[4] / n - mx * my;
+
+          total += ((2 * mx * my + c1) * (2 * cov + c2)) /
+                   ((mx * mx + my * my + c1) * (vx + vy + c2));
+          n_windows++;
+        }
+    }
+
+  return total / n_windows;
+}
+
+static gboolean
+compare_pixbufs (GdkPixbuf *source,
+                 GdkPixbuf *decoded,
+                 gdouble   *psnr,
+                 gdouble   *ssim)
+{
+  const guchar *row_a, *row_b;
+  guint8 *rgba_a, *rgba_b, *luma_a, *luma_b;
+  gboolean has_alpha;
+  guint64 error = 0;
+  gint width, height, y;
+
+  width = gdk_pixbuf_get_width (source);
+  height = gdk_pixbuf_get_height (source);
+  if (gdk_pixbuf_get_width (decoded) != width ||
+      gdk_pixbuf_get_height (decoded) != height)
+    return FALSE;
+
+  has_alpha = gdk_pixbuf_get_has_alpha (source);
+  rgba_a = g_new (guint8, width * 4);
+  rgba_b = g_new (guint8, width * 4);
+  luma_a = g_new (guint8, (gsize) width * height);
+  luma_b = g_new (guint8, (gsize) width * height);
+
+  row_a = gdk_pixbuf_get_pixels (source);
+  row_b = gdk_pixbuf_get_pixels (decoded);
+  for (y = 0; y < height; y++)
+    {
+      convert_row (row_a, gdk_pixbuf_get_n_channels (source), width,
+                   has_alpha, rgba_a, luma_a + (gsize) y * width);
+      convert_row (row_b, gdk_pixbuf_get_n_channels (decoded), width,
+                   has_alpha, rgba_b, luma_b + (gsize) y * width);
+
+      error += squared_error (rgba_a, rgba_b, width * 4);
+
+      row_a += gdk_pixbuf_get_rowstride (source);
+      row_b += gdk_pixbuf_get_rowstride (decoded);
+    }
+
+  if (error == 0)
+    *psnr = INFINITY;
+  else
+    *psnr = 10 * log10 (255.0 * 255.0 * width * height * (has_alpha ? 4 : 3) /
+                        error);
+  *ssim = compute_ssim (luma_a, luma_b, width, height);
+
+  g_free (rgba_a);
+  g_free (rgba_b);
+  g_free (luma_a);
+  g_free (luma_b);
+
+  return TRUE;
+}
+
+static GdkPixbuf *
+decode_buffer (const gchar  *buffer,
+               gsize         size,
+               GError      **error)
+{
+  GdkPixbufLoader *loader;
+  GdkPixbuf *pixbuf = NULL;
+
+  loader = gdk_pixbuf_loader_new_with_type ("pvr", error);
+  if (loader == NULL)
+    return NULL;
+
+  if (gdk_pixbuf_loader_write (loader, (const guchar *) buffer, size, error) &&
+      gdk_pixbuf_loader_close (loader, error))
+    pixbuf = g_object_ref (gdk_pixbuf_loader_get_pixbuf (loader));
+  else
+    gdk_pixbuf_loader_close (loader, NULL);
+
+  g_object_unref (loader);
+
+  return pixbuf;
+}
+
+/*
+ * ETC2 in a PVR file would need a private pixel type only our loader reads,
+ * the saver refuses it. The uncompressed formats have no KTX equivalent here
+ * and are only picked for PVR files.
+ */
+static gboolean
+auto_format_fits_container (guint format)
+{
+  gboolean pvr = strcmp (opt_container, "pvr") == 0;
+
+  if (format_is_etc2 (format))
+    return !pvr;
+
+  switch (format)
+    {
+    case FORMAT_RGB565:
+    case FORMAT_RGBA4444:
+      return pvr;
+    default:
+      return TRUE;
+    }
+}
+
+/*
+ * Encode source in each of the auto_formats, smallest first, and write the
+ * first one reaching opt_min_psnr to output. When several formats have the
+ * same size, the one with the best PSNR wins. If none is good enough, the
+ * best one is used anyway. keys and values are the save options, the first
+ * one being the format.
+ */
+static gboolean
+save_auto_format (GdkPixbuf    *source,
+                  const gchar  *input,
+                  const gchar  *output,
+                  gchar       **keys,
+                  gchar       **values,
+                  GError      **error)
+{
+  gchar *best = NULL, *buffer;
+  gsize best_size = 0, size;
+  gdouble best_psnr = -1, best_ssim = 0, psnr, ssim;
+  gint best_format = -1;
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (auto_formats); i++)
+    {
+      GdkPixbuf *decoded;
+      guint format = auto_formats[i][0];
+
+      /* a smaller format made it, don't try the bigger ones */
+      if (i > 0 && best_psnr >= opt_min_psnr &&
+          auto_formats[i][1] != auto_formats[i - 1][1])
+        break;
+
+      if (!auto_format_fits_container (format))
+        continue;
+
+      /* eg. PVRTC and non power of 2 images, move on to the next format */
+      values[0] = (gchar *) formats[format];
+      if (!gdk_pixbuf_save_to_bufferv (source, &buffer, &size, "pvr",
+                                       keys, values, NULL))
+        continue;
+
+      decoded = decode_buffer (buffer, size, NULL);
+      if (decoded == NULL || !compare_pixbufs (source, decoded, &psnr, &ssim))
+        {
+          if (decoded)
+            g_object_unref (decoded);
+          g_free (buffer);
+          continue;
+        }
+      g_object_unref (decoded);
+
+      /* anything reaching the threshold beats the smaller formats that did
+       * not, and we stop before the bigger ones */
+      if (psnr > best_psnr)
+        {
+          g_free (best);
+          best = buffer;
+          best_size = size;
+          best_psnr = psnr;
+          best_ssim = ssim;
+          best_format = format;
+        }
+      else
+        {
+          g_free (buffer);
+        }
+    }
+
+  if (best == NULL)
+    {
+      g_set_error_literal (error,
+                           GDK_PIXBUF_ERROR,
+                           GDK_PIXBUF_ERROR_FAILED,
+                           "None of the formats could encode the image");
+      return FALSE;
+    }
+
+  g_print ("%s: %s, PSNR %.2f dB, SSIM %.4f%s\n", input,
+           formats[best_format], best_psnr, best_ssim,
+           best_psnr < opt_min_psnr ? " (below --min-psnr)" : "");
+
+  if (!g_file_set_contents (output, best, best_size, error))
+    {
+      g_free (best);
+      return FALSE;
+    }
+
+  g_free (best);
+
+  return TRUE;
+}
+
+/*
+ * Streaming compression.
+ *
+ * The source is fed to a GdkPixbufLoader a chunk at a time. Each band of
+ * STREAM_BAND_ROWS rows of blocks is encoded and written as soon as the
+ * loader reports its pixels, after a header that is rewritten once the
+ * payload is complete. This avoids the copies the saver makes and the
+ * compressed image is never held in memory, but the loader still allocates a
+ * pixbuf for the whole source and that is what bounds the peak memory.
+ *
+ * Loaders that update rows more than once, like the ones of interlaced PNGs,
+ * are detected and the payload is then encoded again from the final pixels.
+ * Only the formats we encode natively can be streamed, without mipmaps.
+ */
+
+#define STREAM_CHUNK_SIZE (64 * 1024)
+#define STREAM_BAND_ROWS  16
+
+typedef struct
+{
+  const PvrFormatInfo *info;
+  PvrQuality quality;
+  guint n_threads;
+  FILE *f;
+
+  guchar *band;
+  gsize row_size;           /* compressed size of a row of blocks */
+  guint n_rows;             /* rows of blocks in the image */
+  guint n_rows_written;
+  guint n_lines_ready;      /* rows of pixels complete, from the top */
+  gboolean rewrite;         /* rows already written were updated */
+  gboolean failed;
+} StreamContext;
+
+static gboolean
+lookup_quality (const gchar *quality,
+                PvrQuality  *level)
+{
+  if (strcmp (quality, "fast") == 0)
+    *level = PVR_QUALITY_FAST;
+  else if (strcmp (quality, "normal") == 0)
+    *level = PVR_QUALITY_NORMAL;
+  else if (strcmp (quality, "exhaustive") == 0)
+    *level = PVR_QUALITY_EXHAUSTIVE;
+  else
+    return FALSE;
+
+  return TRUE;
+}
+
+/* encode and write the rows of blocks up to n_rows, one band at a time */
+static void
+stream_write_rows (StreamContext *stream,
+                   GdkPixbuf     *pixbuf,
+                   guint          n_rows)
+{
+  const PvrFormatInfo *info = stream->info;
+  guint height = gdk_pixbuf_get_height (pixbuf);
+
+  while (!stream->failed && stream->n_rows_written < n_rows)
     {
-      success = do_compress_file (opt_files[i]);
+      PvrSurface band;
+      guint n_band_rows, y;
+
+      n_band_rows = MIN (STREAM_BAND_ROWS, n_rows - stream->n_rows_written);
+      y = stream->n_rows_written * info->block_height;
+
+      band.pixels = gdk_pixbuf_get_pixels (pixbuf) +
+                    (gsize) y * gdk_pixbuf_get_rowstride (pixbuf);
+      band.rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+      band.width = gdk_pixbuf_get_width (pixbuf);
+      band.height = MIN (n_band_rows * info->block_height, height - y);
+      band.n_channels = gdk_pixbuf_get_n_channels (pixbuf);
+      band.layout = PVR_SURFACE_RGBA;
+
+      pvr_format_info_encode (info, &band, stream->band, stream->quality,
+                              stream->n_threads);
+
+      if (fwrite (stream->band, stream->row_size * n_band_rows, 1,
+                  stream->f) != 1)
+        stream->failed = TRUE;
+
+      stream->n_rows_written += n_band_rows;
     }
+}
+
+static void
+on_area_prepared (GdkPixbufLoader *loader,
+                  StreamContext   *stream)
+{
+  const PvrFormatInfo *info = stream->info;
+  GdkPixbuf *pixbuf;
+  guint blocks_x;
+
+  pixbuf = gdk_pixbuf_loader_get_pixbuf (loader);
+
+  blocks_x = (MAX (gdk_pixbuf_get_width (pixbuf), info->min_width) +
+              info->block_width - 1) / info->block_width;
+  stream->row_size = (gsize) blocks_x * info->block_size;
+  stream->n_rows = (gdk_pixbuf_get_height (pixbuf) + info->block_height - 1) /
+                   info->block_height;
+  stream->band = g_new (guchar, stream->row_size * STREAM_BAND_ROWS);
+}
+
+static void
+on_area_updated (GdkPixbufLoader *loader,
+                 gint             x,
+                 gint             y,
+                 gint             width,
+                 gint             height,
+                 StreamContext   *stream)
+{
+  GdkPixbuf *pixbuf;
+  guint n_rows;
+
+  pixbuf = gdk_pixbuf_loader_get_pixbuf (loader);
+
+  if ((guint) y < stream->n_rows_written * stream->info->block_height)
+    stream->rewrite = TRUE;
+
+  /* only full rows growing the complete part from the top count */
+  if (x == 0 && width == gdk_pixbuf_get_width (pixbuf) &&
+      (guint) y <= stream->n_lines_ready)
+    stream->n_lines_ready = MAX (stream->n_lines_ready, (guint) (y + height));
+
+  if (stream->rewrite || stream->failed)
+    return;
+
+  /* whole bands, unless it's the end of the image */
+  if (stream->n_lines_ready == (guint) gdk_pixbuf_get_height (pixbuf))
+    n_rows = stream->n_rows;
+  else
+    n_rows = stream->n_lines_ready / stream->info->block_height /
+             STREAM_BAND_ROWS * STREAM_BAND_ROWS;
+
+  stream_write_rows (stream, pixbuf, n_rows);
+}
+
+static gboolean
+stream_compress_file (const gchar *input,
+                      const gchar *output,
+                      guint64     *n_pixels)
+{
+  StreamContext stream;
+  GdkPixbufLoader *loader;
+  GdkPixbuf *pixbuf;
+  PVRHeader header;
+  GError *error = NULL;
+  guchar *chunk;
+  FILE *in;
+  gsize n_read;
+  gboolean success = FALSE;
+
+  memset (&stream, 0, sizeof (StreamContext));
+  stream.info = pvr_format_info_lookup (format_pixel_types[lookup_format
+                                                           (opt_format)]);
+  lookup_quality (opt_quality, &stream.quality);
+  stream.n_threads = atoi (encoder_threads);
+
+  in = fopen (input, "rb");
+  if (in == NULL)
+    {
+      g_printerr ("Could not open file %s: %s\n", input, g_strerror (errno));
+      return FALSE;
+    }
+
+  stream.f = fopen (output, "wb");
+  if (stream.f == NULL)
+    {
+      g_printerr ("Could not save file %s: %s\n", output, g_strerror (errno));
+      fclose (in);
+      return FALSE;
+    }
+
+  /* the real header is written once we know everything */
+  memset (&header, 0, sizeof (PVRHeader));
+  if (fwrite (&header, sizeof (PVRHeader), 1, stream.f) != 1)
+    stream.failed = TRUE;
+
+  loader = gdk_pixbuf_loader_new ();
+  g_signal_connect (loader, "area-prepared",
+                    G_CALLBACK (on_area_prepared), &stream);
+  g_signal_connect (loader, "area-updated",
+                    G_CALLBACK (on_area_updated), &stream);
+
+  chunk = g_new (guchar, STREAM_CHUNK_SIZE);
+  while (!stream.failed &&
+         (n_read = fread (chunk, 1, STREAM_CHUNK_SIZE, in)) > 0)
+    {
+      if (!gdk_pixbuf_loader_write (loader, chunk, n_read, &error))
+        break;
+    }
+  g_free (chunk);
+
+  if (error == NULL && ferror (in))
+    g_set_error (&error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                 "%s", g_strerror (errno));
+
+  if (error)
+    gdk_pixbuf_loader_close (loader, NULL);
+  else
+    gdk_pixbuf_loader_close (loader, &error);
+
+  pixbuf = gdk_pixbuf_loader_get_pixbuf (loader);
+  if (error || pixbuf == NULL)
+    {
+      g_printerr ("Could not open file %s: %s\n", input,
+                  error ? error->message : "no image");
+      g_clear_error (&error);
+      goto out;
+    }
+
+  /* encode what is left, or everything again if rows changed after we
+   * wrote them */
+  if (stream.rewrite)
+    {
+      stream.n_rows_written = 0;
+      if (fseek (stream.f, sizeof (PVRHeader), SEEK_SET) == -1)
+        stream.failed = TRUE;
+    }
+  stream_write_rows (&stream, pixbuf, stream.n_rows);
+
+  header.header_size = sizeof (PVRHeader);
+  header.height = gdk_pixbuf_get_height (pixbuf);
+  header.width = gdk_pixbuf_get_width (pixbuf);
+  header.flags = stream.info->pixel_type;
+  header.data_size = stream.row_size * stream.n_rows;
+  header.bit_count = stream.info->block_size * 8 /
+                     (stream.info->block_width * stream.info->block_height);
+  header.PVR = PVR_FLAG_IDENTIFIER;
+  header.n_surfaces = 1;
+
+  if (stream.failed || fseek (stream.f, 0, SEEK_SET) == -1 ||
+      fwrite (&header, sizeof (PVRHeader), 1, stream.f) != 1)
+    {
+      g_printerr ("Could not save file %s: failed to write the texture\n",
+                  output);
+      goto out;
+    }
+
+  *n_pixels = (guint64) header.width * header.height;
+  success = TRUE;
+
+out:
+  g_object_unref (loader);
+  g_free (stream.band);
+  fclose (in);
+
+  if (fclose (stream.f) != 0 && success)
+    {
+      g_printerr ("Could not save file %s: %s\n", output, g_strerror (errno));
+      success = FALSE;
+    }
+  if (!success)
+    unlink (output);
+
+  return success;
+}
+
+/*
+ * Derive the name of the file to write from the input file name, either
+ * <output dir>/<name>.<container> or the --output template with %s replaced
+ * by the input name without its extension.
+ */
+static gchar *
+get_output_filename (const gchar *input)
+{
+  gchar *basename, *dot, *output;
+
+  basename = g_path_get_basename (input);
+  dot = strrchr (basename, '.');
+  if (dot && dot != basename)
+    *dot = '\0';
+
+  if (opt_output_dir)
+    {
+      gchar *name;
+
+      name = g_strconcat (basename, ".", opt_container, NULL);
+      output = g_build_filename (opt_output_dir, name, NULL);
+      g_free (name);
+    }
+  else
+    {
+      gchar **parts;
+
+      parts = g_strsplit (opt_output, "%s", -1);
+      output = g_strjoinv (basename, parts);
+      g_strfreev (parts);
+    }
+
+  g_free (basename);
+
+  return output;
+}
+
+static gboolean
+do_compress_file (gchar *filename)
+{
+  GdkPixbuf *source;
+  GError *error = NULL;
+  gboolean success = TRUE, cache_hit = FALSE;
+  gchar *output, *cached = NULL, *previous = NULL, *block_hashes = NULL;
+  gchar *keys[9], *values[9];
+  guint64 size = 0;
+  guint n_options = 0;
+
+  output = get_output_filename (filename);
+
+  if (opt_stream)
+    {
+      success = stream_compress_file (filename, output, &size);
+      goto update_stats;
+    }
+
+  source = gdk_pixbuf_new_from_file (filename, &error);
+  if (error)
+    {
+      g_printerr ("Could not open file %s: %s\n", filename, error->message);
+      g_error_free (error);
+      success = FALSE;
+      goto update_stats;
+    }
+
+  size = (guint64) gdk_pixbuf_get_width (source) *
+         gdk_pixbuf_get_height (source);
+
+  if (opt_cache_dir)
+    {
+      cached = get_cache_filename (source);
+      if (g_file_test (cached, G_FILE_TEST_EXISTS) &&
+          copy_file (cached, output))
+        {
+          cache_hit = TRUE;
+          goto done;
+        }
+    }
+
+  keys[n_options] = "format";
+  values[n_options++] = opt_format;
+  keys[n_options] = "quality";
+  values[n_options++] = opt_quality;
+  keys[n_options] = "threads";
+  values[n_options++] = encoder_threads;
+  keys[n_options] = "mipmaps";
+  values[n_options++] = opt_mipmaps ? "yes" : "no";
+  keys[n_options] = "supercompression";
+  values[n_options++] = opt_supercompression;
+  keys[n_options] = "container";
+  values[n_options++] = opt_container;
+
+  /* saving truncates output, move the previous version out of the way for
+   * the saver to copy the unchanged blocks from */
+  if (opt_update)
+    {
+      block_hashes = g_strconcat (output, ".blocks", NULL);
+      keys[n_options] = "block-hashes";
+      values[n_options++] = block_hashes;
+
+      previous = g_strconcat (output, ".old", NULL);
+      if (rename (output, previous) == 0)
+        {
+          keys[n_options] = "reference";
+          values[n_options++] = previous;
+        }
+      else
+        {
+          g_free (previous);
+          previous = NULL;
+        }
+    }
+
+  keys[n_options] = NULL;
+  values[n_options] = NULL;
+
+  if (opt_auto_format)
+    save_auto_format (source, filename, output, keys, values, &error);
+  else
+    gdk_pixbuf_savev (source, output, "pvr", keys, values, &error);
+  if (error)
+    {
+      g_printerr ("Could not save file %s: %s\n", output, error->message);
+      g_error_free (error);
+      success = FALSE;
+      size = 0;
+
+      if (previous)
+        rename (previous, output);
+
+      goto done;
+    }
+
+  if (previous)
+    unlink (previous);
+
+  if (cached)
+    cache_store (output, cached);
+
+done:
+  g_object_unref (source);
+update_stats:
+  G_LOCK (stats);
+  n_done++;
+  n_pixels += size;
+  if (cache_hit)
+    n_cache_hits++;
+  if (!success)
+    g_ptr_array_add (failed_files, filename);
+  G_UNLOCK (stats);
+
+  g_free (block_hashes);
+  g_free (previous);
+  g_free (cached);
+  g_free (output);
+
+  return success;
+}
+
+static void
+compress_job (gpointer data,
+              gpointer user_data)
+{
+  do_compress_file ((gchar *) data);
+}
+
+static void
+print_summary (gint64 elapsed)
+{
+  gdouble seconds, mpixels;
+  guint i;
+
+  seconds = elapsed / (gdouble) G_USEC_PER_SEC;
+  mpixels = n_pixels / 1e6;
+
+  g_print ("%u files (%u failed), %.1f Mpixels in %.2fs: %.1f files/s, "
+           "%.2f Mpixels/s\n",
+           n_done, failed_files->len, mpixels, seconds,
+           seconds > 0 ? n_done / seconds : 0,
+           seconds > 0 ? mpixels / seconds : 0);
+  if (opt_cache_dir)
+    g_print ("%u files found in the cache\n", n_cache_hits);
+
+  for (i = 0; i < failed_files->len; i++)
+    {
+      gchar *filename = (gchar *) g_ptr_array_index (failed_files, i);
+
+      g_printerr ("  failed: %s\n", filename);
+    }
+}
+
+/*
+ * Atlas mode: pack all the inputs into as few power of 2 pages as possible,
+ * compress each page once and describe where the sprites are in a binary
+ * rect table. All the values are little endian:
+ *
+ *   header: "PVRA", version (u32, 1), number of pages (u32),
+ *           number of rects (u32)
+ *   rects:  page, x, y, width, height (u16 each), padding (u16),
+ *           offset of the name in the string table (u32)
+ *   names:  the input file names, without directory, NUL terminated
+ *
+ * Sprites are placed on block boundaries and their size is rounded up to a
+ * whole number of blocks, so no block straddles two sprites. PVRTC colours
+ * are interpolated between neighbouring blocks so, for those formats, an
+ * extra block separates the sprites. The padding repeats the sprite edges.
+ *
+ * The packing uses a skyline: the page is described by the height of its
+ * top edge along x, and each sprite goes where its top ends up the lowest.
+ */
+
+typedef struct
+{
+  gchar *filename;
+  GdkPixbuf *pixbuf;
+  guint width, height;        /* padded */
+  guint page, x, y;
+} Sprite;
+
+typedef struct
+{
+  guint x, y, width;
+} SkylineSegment;
+
+typedef struct
+{
+  GArray *skyline;
+  guint used_width, used_height;
+} Page;
+
+static gboolean
+is_p2 (guint x)
+{
+  return x != 0 && !(x & (x - 1));
+}
+
+static guint
+next_p2 (guint x)
+{
+  guint p2 = 1;
+
+  while (p2 < x)
+    p2 *= 2;
+
+  return p2;
+}
+
+/* find where the top of a width x height sprite would be if its left edge
+ * was at the start of segment index */
+static gboolean
+skyline_fit (GArray *skyline,
+             guint   index,
+             guint   width,
+             guint   height,
+             guint  *y)
+{
+  SkylineSegment *segment;
+  guint remaining = width;
+
+  segment = &g_array_index (skyline, SkylineSegment, index);
+  if (segment->x + width > opt_atlas_size)
+    return FALSE;
+
+  *y = 0;
+  for (; remaining > 0; index++)
+    {
+      segment = &g_array_index (skyline, SkylineSegment, index);
+      *y = MAX (*y, segment->y);
+      if (*y + height > opt_atlas_size)
+        return FALSE;
+
+      if (segment->width >= remaining)
+        break;
+      remaining -= segment->width;
+    }
+
+  return TRUE;
+}
+
+static void
+skyline_add (GArray *skyline,
+             guint   index,
+             guint   x,
+             guint   y,
+             guint   width)
+{
+  SkylineSegment segment = { x, y, width };
+  guint i;
+
+  g_array_insert_val (skyline, index, segment);
+
+  /* trim or remove the segments now under the new one */
+  for (i = index + 1; i < skyline->len;)
+    {
+      SkylineSegment *current, *previous;
+      guint end;
+
+      current = &g_array_index (skyline, SkylineSegment, i);
+      previous = &g_array_index (skyline, SkylineSegment, i - 1);
+      end = previous->x + previous->width;
+
+      if (current->x >= end)
+        break;
+
+      if (current->x + current->width <= end)
+        {
+          g_array_remove_index (skyline, i);
+          continue;
+        }
+
+      current->width -= end - current->x;
+      current->x = end;
+      break;
+    }
+
+  /* merge the neighbours at the same height */
+  for (i = 0; i + 1 < skyline->len;)
+    {
+      SkylineSegment *current, *next;
+
+      current = &g_array_index (skyline, SkylineSegment, i);
+      next = &g_array_index (skyline, SkylineSegment, i + 1);
+
+      if (current->y == next->y)
+        {
+          current->width += next->width;
+          g_array_remove_index (skyline, i + 1);
+        }
+      else
+        {
+          i++;
+        }
+    }
+}
+
+static gboolean
+page_add_sprite (Page   *page,
+                 Sprite *sprite)
+{
+  guint i, y, best_index = 0, best_top = G_MAXUINT, best_x = G_MAXUINT;
+
+  for (i = 0; i < page->skyline->len; i++)
+    {
+      SkylineSegment *segment;
+
+      if (!skyline_fit (page->skyline, i, sprite->width, sprite->height, &y))
+        continue;
+
+      segment = &g_array_index (page->skyline, SkylineSegment, i);
+      if (y + sprite->height < best_top ||
+          (y + sprite->height == best_top && segment->x < best_x))
+        {
+          best_index = i;
+          best_top = y + sprite->height;
+          best_x = segment->x;
+        }
+    }
+
+  if (best_top == G_MAXUINT)
+    return FALSE;
+
+  sprite->x = best_x;
+  sprite->y = best_top - sprite->height;
+  skyline_add (page->skyline, best_index, sprite->x, best_top,
+               sprite->width);
+
+  page->used_width = MAX (page->used_width, sprite->x + sprite->width);
+  page->used_height = MAX (page->used_height, best_top);
+
+  return TRUE;
+}
+
+static Page *
+page_new (void)
+{
+  SkylineSegment segment = { 0, 0, opt_atlas_size };
+  Page *page;
+
+  page = g_new0 (Page, 1);
+  page->skyline = g_array_new (FALSE, FALSE, sizeof (SkylineSegment));
+  g_array_append_val (page->skyline, segment);
+
+  return page;
+}
+
+static gint
+compare_sprites (gconstpointer a,
+                 gconstpointer b)
+{
+  const Sprite *sprite_a = *(const Sprite **) a;
+  const Sprite *sprite_b = *(const Sprite **) b;
+
+  /* tallest first, then widest first */
+  if (sprite_a->height != sprite_b->height)
+    return sprite_b->height - sprite_a->height;
+
+  return sprite_b->width - sprite_a->width;
+}
+
+/* copy the sprite into the page and repeat its edges in the padding */
+static void
+blit_sprite (GdkPixbuf    *page,
+             const Sprite *sprite)
+{
+  guint width, height, i;
+
+  width = gdk_pixbuf_get_width (sprite->pixbuf);
+  height = gdk_pixbuf_get_height (sprite->pixbuf);
+
+  gdk_pixbuf_copy_area (sprite->pixbuf, 0, 0, width, height,
+                        page, sprite->x, sprite->y);
+
+  for (i = width; i < sprite->width; i++)
+    gdk_pixbuf_copy_area (page, sprite->x + width - 1, sprite->y, 1, height,
+                          page, sprite->x + i, sprite->y);
+
+  for (i = height; i < sprite->height; i++)
+    gdk_pixbuf_copy_area (page, sprite->x, sprite->y + height - 1,
+                          sprite->width, 1,
+                          page, sprite->x, sprite->y + i);
+}
+
+static gchar *
+get_atlas_filename (const gchar *suffix)
+{
+  gchar *name, *filename;
+
+  name = g_strconcat (opt_atlas, suffix, NULL);
+  if (opt_output_dir == NULL)
+    return name;
+
+  filename = g_build_filename (opt_output_dir, name, NULL);
+  g_free (name);
+
+  return filename;
+}
+
+static void
+append_le16 (GByteArray *array,
+             guint16     value)
+{
+  value = GUINT16_TO_LE (value);
+  g_byte_array_append (array, (guint8 *) &value, 2);
+}
+
+static void
+append_le32 (GByteArray *array,
+             guint32     value)
+{
+  value = GUINT32_TO_LE (value);
+  g_byte_array_append (array, (guint8 *) &value, 4);
+}
+
+static gboolean
+write_rect_table (GPtrArray  *sprites,
+                  guint       n_pages,
+                  GError    **error)
+{
+  GByteArray *table;
+  GString *names;
+  gchar *filename;
+  gboolean success;
+  guint i;
+
+  table = g_byte_array_new ();
+  names = g_string_new (NULL);
+
+  g_byte_array_append (table, (guint8 *) "PVRA", 4);
+  append_le32 (table, 1);
+  append_le32 (table, n_pages);
+  append_le32 (table, sprites->len);
+
+  for (i = 0; i < sprites->len; i++)
+    {
+      Sprite *sprite = g_ptr_array_index (sprites, i);
+      gchar *basename;
+
+      append_le16 (table, sprite->page);
+      append_le16 (table, sprite->x);
+      append_le16 (table, sprite->y);
+      append_le16 (table, gdk_pixbuf_get_width (sprite->pixbuf));
+      append_le16 (table, gdk_pixbuf_get_height (sprite->pixbuf));
+      append_le16 (table, 0);
+      append_le32 (table, names->len);
+
+      basename = g_path_get_basename (sprite->filename);
+      g_string_append_len (names, basename, strlen (basename) + 1);
+      g_free (basename);
+    }
+
+  g_byte_array_append (table, (guint8 *) names->str, names->len);
+
+  filename = get_atlas_filename (".atlas");
+  success = g_file_set_contents (filename, (gchar *) table->data, table->len,
+                                 error);
+
+  g_free (filename);
+  g_string_free (names, TRUE);
+  g_byte_array_free (table, TRUE);
+
+  return success;
+}
+
+static gboolean
+do_atlas (gint format)
+{
+  GPtrArray *sprites, *sorted, *pages;
+  GError *error = NULL;
+  guint block_width, block_height, gutter_x = 0, gutter_y = 0, i, j;
+  gboolean success = TRUE;
+
+  block_width = format_blocks[format][0];
+  block_height = format_blocks[format][1];
+  if (format == FORMAT_PRVTC2 || format == FORMAT_PRVTC4)
+    {
+      gutter_x = block_width;
+      gutter_y = block_height;
+    }
+
+  sprites = g_ptr_array_new ();
+  for (i = 0; opt_files[i]; i++)
+    {
+      Sprite *sprite;
+      GdkPixbuf *pixbuf;
+
+      pixbuf = gdk_pixbuf_new_from_file (opt_files[i], &error);
+      if (error)
+        {
+          g_printerr ("Could not open file %s: %s\n", opt_files[i],
+                      error->message);
+          g_clear_error (&error);
+          success = FALSE;
+          continue;
+        }
+
+      sprite = g_new0 (Sprite, 1);
+      sprite->filename = opt_files[i];
+      sprite->pixbuf = pixbuf;
+      sprite->width = gdk_pixbuf_get_width (pixbuf) + gutter_x;
+      sprite->width = (sprite->width + block_width - 1) / block_width *
+                      block_width;
+      sprite->height = gdk_pixbuf_get_height (pixbuf) + gutter_y;
+      sprite->height = (sprite->height + block_height - 1) / block_height *
+                       block_height;
+
+      g_ptr_array_add (sprites, sprite);
+    }
+
+  if (!success)
+    goto out;
+
+  /* pack */
+  sorted = g_ptr_array_sized_new (sprites->len);
+  for (i = 0; i < sprites->len; i++)
+    g_ptr_array_add (sorted, g_ptr_array_index (sprites, i));
+  g_ptr_array_sort (sorted, compare_sprites);
+
+  pages = g_ptr_array_new ();
+  for (i = 0; i < sorted->len && success; i++)
+    {
+      Sprite *sprite = g_ptr_array_index (sorted, i);
+
+      for (j = 0; j < pages->len; j++)
+        {
+          if (page_add_sprite (g_ptr_array_index (pages, j), sprite))
+            break;
+        }
+
+      if (j == pages->len)
+        {
+          g_ptr_array_add (pages, page_new ());
+          if (!page_add_sprite (g_ptr_array_index (pages, j), sprite))
+            {
+              g_printerr ("%s does not fit in a %dx%d page\n",
+                          sprite->filename, opt_atlas_size, opt_atlas_size);
+              success = FALSE;
+            }
+        }
+
+      sprite->page = j;
+    }
+  g_ptr_array_free (sorted, TRUE);
+
+  /* compress each page, shrunk to the power of 2 size that holds what was
+   * packed into it */
+  for (j = 0; j < pages->len && success; j++)
+    {
+      Page *page = g_ptr_array_index (pages, j);
+      GdkPixbuf *pixbuf;
+      gchar *suffix, *filename;
+
+      pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, TRUE, 8,
+                               next_p2 (page->used_width),
+                               next_p2 (page->used_height));
+      gdk_pixbuf_fill (pixbuf, 0);
+
+      for (i = 0; i < sprites->len; i++)
+        {
+          Sprite *sprite = g_ptr_array_index (sprites, i);
+
+          if (sprite->page == j)
+            blit_sprite (pixbuf, sprite);
+        }
+
+      suffix = g_strdup_printf ("-%u.%s", j, opt_container);
+      filename = get_atlas_filename (suffix);
+
+      gdk_pixbuf_save (pixbuf, filename, "pvr", &error,
+                       "format", opt_format,
+                       "quality", opt_quality,
+                       "mipmaps", opt_mipmaps ? "yes" : "no",
+                       "supercompression", opt_supercompression,
+                       "container", opt_container,
+                       NULL);
+      if (error)
+        {
+          g_printerr ("Could not save file %s: %s\n", filename,
+                      error->message);
+          g_clear_error (&error);
+          success = FALSE;
+        }
+      else
+        {
+          g_print ("%s: %dx%d\n", filename,
+                   gdk_pixbuf_get_width (pixbuf),
+                   gdk_pixbuf_get_height (pixbuf));
+        }
+
+      g_free (suffix);
+      g_free (filename);
+      g_object_unref (pixbuf);
+    }
+
+  if (success && !write_rect_table (sprites, pages->len, &error))
+    {
+      g_printerr ("Could not write the rect table: %s\n", error->message);
+      g_clear_error (&error);
+      success = FALSE;
+    }
+
+  for (j = 0; j < pages->len; j++)
+    {
+      Page *page = g_ptr_array_index (pages, j);
+
+      g_array_free (page->skyline, TRUE);
+      g_free (page);
+    }
+  g_ptr_array_free (pages, TRUE);
+
+out:
+  for (i = 0; i < sprites->len; i++)
+    {
+      Sprite *sprite = g_ptr_array_index (sprites, i);
+
+      g_object_unref (sprite->pixbuf);
+      g_free (sprite);
+    }
+  g_ptr_array_free (sprites, TRUE);
+
+  return success;
+}
+
+int
+main(int   argc,
+     char *argv[])
+{
+  GError *error = NULL;
+  GOptionContext *context;
+  GThreadPool *pool = NULL;
+  gint64 start;
+  guint i, n_files, n_processors;
+  gint format;
+
+  g_type_init ();
+
+  /* we compress and compare what the loader decodes, it has to be RGBA */
+  g_unsetenv ("GDK_PIXBUF_PVR_PIXEL_FORMAT");
+
+  context = g_option_context_new ("- A tool to manipulate textures");
+
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_print ("Failed to parse options: %s\n", error->message);
+      return EXIT_FAILURE;
+    }
+
+  if (opt_list_formats)
+    {
+      do_list_formats ();
+      return EXIT_SUCCESS;
+    }
+
+  format = lookup_format (opt_format);
+  if (format == -1)
+    {
+      g_printerr ("Invalid format '%s'\n", opt_format);
+      return EXIT_FAILURE;
+    }
+
+  if (strcmp (opt_supercompression, "none") != 0 &&
+      strcmp (opt_supercompression, "deflate") != 0)
+    {
+      g_printerr ("Invalid supercompression '%s'\n", opt_supercompression);
+      return EXIT_FAILURE;
+    }
+
+  if (strcmp (opt_container, "pvr") != 0 &&
+      strcmp (opt_container, "ktx") != 0 &&
+      strcmp (opt_container, "ktx2") != 0)
+    {
+      g_printerr ("Invalid container '%s'\n", opt_container);
+      return EXIT_FAILURE;
+    }
+
+  if (strcmp (opt_container, "ktx") == 0 &&
+      strcmp (opt_supercompression, "none") != 0)
+    {
+      g_printerr ("KTX files can't be supercompressed, use --container "
+                  "ktx2\n");
+      return EXIT_FAILURE;
+    }
+
+  /* PVR files have no pixel type for ETC2, --stream has its own message */
+  if (format_is_etc2 (format) && strcmp (opt_container, "pvr") == 0 &&
+      !opt_stream && !opt_auto_format)
+    {
+      g_printerr ("%s can only be written in KTX files, use --container ktx "
+                  "or ktx2\n", opt_format);
+      return EXIT_FAILURE;
+    }
+
+  if (opt_files == NULL)
+    {
+      g_printerr ("You need to give at least one file to operate on\n");
+      return EXIT_FAILURE;
+    }
+
+  if (opt_info)
+    {
+      gboolean success = TRUE;
+
+      for (i = 0; opt_files[i]; i++)
+        success &= do_info_file (opt_files[i]);
+
+      return !success;
+    }
+
+  if (opt_output_dir &&
+      g_mkdir_with_parents (opt_output_dir, 0755) == -1)
+    {
+      g_printerr ("Could not create directory %s\n", opt_output_dir);
+      return EXIT_FAILURE;
+    }
+
+  if (opt_cache_dir &&
+      g_mkdir_with_parents (opt_cache_dir, 0755) == -1)
+    {
+      g_printerr ("Could not create directory %s\n", opt_cache_dir);
+      return EXIT_FAILURE;
+    }
+
+  if (opt_auto_format && (opt_atlas || opt_update))
+    {
+      g_printerr ("--auto-format can't be used with --atlas or --update\n");
+      return EXIT_FAILURE;
+    }
+
+  if (opt_stream)
+    {
+      const PvrFormatInfo *info;
+      PvrQuality quality;
+
+      if (opt_atlas || opt_auto_format || opt_update || opt_mipmaps ||
+          opt_cache_dir || strcmp (opt_supercompression, "none") != 0 ||
+          strcmp (opt_container, "pvr") != 0)
+        {
+          g_printerr ("--stream can't be used with --atlas, --auto-format, "
+                      "--update, --mipmaps, --cache-dir, --supercompression "
+                      "or --container\n");
+          return EXIT_FAILURE;
+        }
+
+      if (format_is_etc2 (format))
+        {
+          g_printerr ("%s can't be streamed, it can only be written in KTX "
+                      "files\n", opt_format);
+          return EXIT_FAILURE;
+        }
+
+      info = pvr_format_info_lookup (format_pixel_types[format]);
+      if (info == NULL || info->encode == NULL)
+        {
+          g_printerr ("%s can't be streamed, only the formats the tool "
+                      "encodes itself can\n", opt_format);
+          return EXIT_FAILURE;
+        }
+
+      if (!lookup_quality (opt_quality, &quality))
+        {
+          g_printerr ("Invalid quality '%s'\n", opt_quality);
+          return EXIT_FAILURE;
+        }
+    }
+
+  if (opt_atlas)
+    {
+      if (!is_p2 (opt_atlas_size))
+        {
+          g_printerr ("The atlas size needs to be a power of 2\n");
+          return EXIT_FAILURE;
+        }
+
+      return !do_atlas (format);
+    }
+
+  n_files = g_strv_length (opt_files);
+  if (n_files > 1 && opt_output_dir == NULL && !strstr (opt_output, "%s"))
+    {
+      g_printerr ("Several input files need --output-dir or a %%s in the "
+                  "--output template\n");
+      return EXIT_FAILURE;
+    }
+
+  /* share the processors between the files being compressed in parallel
+   * and the threads each encoder can use */
+  n_processors = g_get_num_processors ();
+  if (opt_jobs <= 0)
+    opt_jobs = n_processors;
+  opt_jobs = MIN ((guint) opt_jobs, n_files);
+  encoder_threads = g_strdup_printf ("%u", MAX (1, n_processors / opt_jobs));
+
+  failed_files = g_ptr_array_new ();
+  start = g_get_monotonic_time ();
+
+  if (opt_jobs > 1)
+    pool = g_thread_pool_new (compress_job, NULL, opt_jobs, TRUE, NULL);
+
+  for (i = 0; i < n_files; i++)
+    {
+      if (pool)
+        g_thread_pool_push (pool, opt_files[i], NULL);
+      else
+        do_compress_file (opt_files[i]);
+    }
+
+  if (pool)
+    g_thread_pool_free (pool, FALSE, TRUE);
+
+  if (n_files > 1)
+    print_summary (g_get_monotonic_time () - start);
 
-  return !success;
+  return failed_files->len != 0;
 }